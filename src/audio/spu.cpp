@@ -3,6 +3,9 @@
 
 #include "../system.h"
 #include "../sys/irq_if.h"
+#include "../sys/headless.h"
+#include "../sys/scheduler.h"
+#include "../sys/sync.h"
 
 #include <stdio.h>
 #include <SDL2/SDL.h>
@@ -26,8 +29,15 @@ static constexpr int wave_channels = 26;
 const int wave_rate = 48000;
 const int wave_bytes = 2;
 
+// One output sample at 48kHz per event
+#define SPU_SAMPLE_CYCLES (MASTER_CLOCK_HZ / 48000)
+
+static void SPUUpdateEvent(uint64_t when);
+
 void InitSPUDevice(PeripheralInitInfo initInfo) {
   memptr = get_dma_ptr(0xA0000000);
+  sched_register(EVT_SPU, SPUUpdateEvent);
+  sched_set(EVT_SPU, sched_now() + SPU_SAMPLE_CYCLES);
 }
 
 const int chen = 0x0400;
@@ -576,53 +586,48 @@ void SPUDeviceResetHandler() {
     ch.reset();
 }
 
+static int beat_base_count = 0;
+
 void SPUDeviceStateHandler(SaveStater &s) {
   s.tag("SPU");
   s.a(spu_regs);
   for (auto &ch : spu_channels)
     ch.state(s);
+  // So output resumes exactly in step after a snapshot
+  uint32_t rate_conv;
+  memcpy(&rate_conv, &spu_rate_conv, sizeof(rate_conv));
+  s.i(rate_conv);
+  memcpy(&spu_rate_conv, &rate_conv, sizeof(rate_conv));
+  s.i(beat_base_count);
 }
 
 static SDL_AudioDeviceID audio_dev;
 
 std::mutex spu_buf_mutex;
 
-static int64_t spu_t0 = 0;
-static int64_t samp_t0 = 0;
-
-static int64_t spu_time() {
-  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
-}
-
-static int64_t samp_period = 20833;
-static int64_t min_speriod = 20700;
-static int64_t max_speriod = 20920;
-
 static constexpr int16_t max_buf_size = 4096;
 std::deque<std::pair<int16_t, int16_t>> audio_buf;
 
-static int64_t update_t = 0;
 static int ticks = 0;
 static int samps = 0;
-static int beat_base_count = 0;
 
-void SPUUpdate() {
-  int64_t curr_time = spu_time();
-  if ((curr_time - samp_t0) > samp_period) {
+static void SPUUpdateEvent(uint64_t when) {
+  sched_set(EVT_SPU, when + SPU_SAMPLE_CYCLES);
+  {
     std::lock_guard<std::mutex> spu_lock(spu_buf_mutex);
-    // we need to provide audio
     spu_rate_conv += (1.f / 48000.f);
     int16_t l, r;
     spu_mix_channels(l, r);
-    audio_buf.emplace_back(l, r);
+    if (headless)
+      HeadlessAudio(l, r);
+    else
+      for (int n = SyncSampleCount(); n > 0; n--)
+        audio_buf.emplace_back(l, r);
+    // Only when not synced to audio, if the device runs slow
     if (audio_buf.size() >= max_buf_size) {
-      // overflow
       while (audio_buf.size() >= (max_buf_size-100))
         audio_buf.pop_front();
-      if (samp_period < max_speriod)
-        samp_period += 20;
     }
-    samp_t0 += samp_period;
     ++samps;
   }
   bool beat_en = check_bit(spu_regs[spu_beatcnt], 15);
@@ -649,18 +654,14 @@ void SPUUpdate() {
     }
     ++ticks;
   }
-#if 0
-  if ((curr_time - update_t) > 1000000000) {
-    printf("%d %d %d\n", ticks, samps, samp_period);
-    update_t = curr_time;
-    ticks = 0;
-    samps = 0;
-  }
-#endif
+}
+
+size_t SPUQueuedSamples() {
+  std::lock_guard<std::mutex> spu_lock(spu_buf_mutex);
+  return audio_buf.size();
 }
 
 void audio_callback(void *userdata, uint8_t* stream, int len) {
-  bool underflow = false;
   int16_t l = 0, r = 0;
   for (int i = 0; i < len; i += 4) {
     std::lock_guard<std::mutex> spu_lock(spu_buf_mutex);
@@ -670,8 +671,6 @@ void audio_callback(void *userdata, uint8_t* stream, int len) {
       r = audio_buf.front().second;
 
       audio_buf.pop_front();
-    } else {
-      underflow = true;
     }
 
     stream[i+0] = (l & 0xFF);
@@ -679,31 +678,26 @@ void audio_callback(void *userdata, uint8_t* stream, int len) {
     stream[i+2] = (r & 0xFF);
     stream[i+3] = ((r >> 8) & 0xFF);
   }
-  if (underflow) {
-    // printf("underflow!!\n");
-    if (samp_period > min_speriod)
-      samp_period -= 20;
-  }
 }
 
 void SPUInitSound() {
-  SDL_AudioSpec want, have;
-
-  spu_t0 = spu_time();
-  samp_t0 = spu_time();
-
-  SDL_memset(&want, 0, sizeof(want)); /* or SDL_zero(want) */
-  want.freq = 48000;
-  want.format = AUDIO_S16LSB;
-  want.channels = 2;
-  want.samples = 256;
-  want.callback = audio_callback; // because we use SDL_QueueAudio
-  audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
-  if (audio_dev == 0) {
-    printf("failed to open audio device: %s!\n", SDL_GetError());
-    exit(1);
+  // Samples are only hashed when headless
+  if (!headless) {
+    SDL_AudioSpec want, have;
+
+    SDL_memset(&want, 0, sizeof(want)); /* or SDL_zero(want) */
+    want.freq = 48000;
+    want.format = AUDIO_S16LSB;
+    want.channels = 2;
+    want.samples = 256;
+    want.callback = audio_callback; // because we use SDL_QueueAudio
+    audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if (audio_dev == 0) {
+      printf("failed to open audio device: %s!\n", SDL_GetError());
+      exit(1);
+    }
+    SDL_PauseAudioDevice(audio_dev, 0);
   }
-  SDL_PauseAudioDevice(audio_dev, 0);
 #ifndef _WIN32
   if (spu_debug_flag) {
     wave_file = creat("../../test/ppudebug/spu_wave.wav", S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -747,8 +741,12 @@ void ShutdownSPU() {
 #endif
 }
 
+static const RegBitmap<16384> spu_write_side = {
+    chen, chen + uoffset, spu_ctrl, spu_softch_ctrl, spu_beatcnt};
+
 const Peripheral SPUPeripheral = {"SPU", InitSPUDevice, SPUDeviceReadHandler,
                                   SPUDeviceWriteHandler, SPUDeviceResetHandler,
-                                  SPUDeviceStateHandler};
+                                  SPUDeviceStateHandler, spu_regs, 16384,
+                                  nullptr, spu_write_side.bits};
 
 };
\ No newline at end of file
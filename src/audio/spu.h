@@ -8,7 +8,8 @@ extern const Peripheral SPUPeripheral;
 extern bool spu_debug_flag;
 
 void SPUInitSound();
-void SPUUpdate();
 void ShutdownSPU();
+// Output samples waiting for the audio device
+size_t SPUQueuedSamples();
 
 }
@@ -0,0 +1,426 @@
+#include "cpu.h"
+#include "aot_abi.h"
+#include "../helper.h"
+#include "../loadelf.h"
+#include "../system.h"
+#include <map>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
+using namespace std;
+
+// Ahead of time translation of firmware images. The generator walks the code
+// reachable from the entry point and ELF symbols with the same block rules as
+// the block cache, writing each block out as a C++ function. At runtime a
+// translated block is only used for a cached block with the same bounds and
+// code bytes, anything else runs as before.
+namespace Emu293 {
+
+// FNV-1a of the guest code bytes
+uint32_t CPU::code_hash(const CodeBlock &blk) const {
+  volatile uint8_t *ptr = ((blk.start & 0xFC000000) == 0xA0000000) ? memPtr : imemPtr;
+  uint32_t mask = ((blk.start & 0xFF000000) == 0x9F000000) ? 0x00FFFFFF : 0x03FFFFFF;
+  uint32_t hash = 2166136261U;
+  for (uint32_t addr = blk.start; addr != blk.end; addr++) {
+    hash ^= ptr[addr & mask];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+CPU::AotFn CPU::find_aot(const CodeBlock &blk) const {
+  auto found = aotBlocks.find(blk.start);
+  if (found == aotBlocks.end() || found->second->end != blk.end ||
+      found->second->hash != code_hash(blk))
+    return nullptr;
+  return found->second->fn;
+}
+
+void CPU::aot_fallback(Emu293AotContext *c, uint32_t index) {
+  CPU *cpu = static_cast<CPU *>(c->cpu);
+  execute_one(cpu, &static_cast<const CodeBlock *>(c->block)->insns[index]);
+}
+
+int CPU::run_aot(CodeBlock *blk) {
+  curBlock = nullptr;
+  codeInvalidated = false;
+  sync_flags();
+  aotCtx->block = blk;
+  int count = blk->aot(aotCtx);
+  count_cycles(blk, count);
+  idleLoop = blk->idle && pc == blk->start;
+  return count;
+}
+
+bool CPU::load_aot(const std::string &file) {
+#ifdef _WIN32
+  printf("AOT: loading translations is not supported on this platform\n");
+  return false;
+#else
+  void *lib = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (lib == nullptr) {
+    printf("AOT: failed to load %s: %s\n", file.c_str(), dlerror());
+    return false;
+  }
+  auto version = static_cast<const uint32_t *>(dlsym(lib, "emu293_aot_version"));
+  auto count = static_cast<const uint32_t *>(dlsym(lib, "emu293_aot_num_blocks"));
+  auto table = static_cast<const Emu293AotBlock *>(dlsym(lib, "emu293_aot_blocks"));
+  if (version == nullptr || count == nullptr || table == nullptr ||
+      *version != EMU293_AOT_VERSION) {
+    printf("AOT: %s is not a translation for this version\n", file.c_str());
+    dlclose(lib);
+    return false;
+  }
+  flush_code();
+  aotBlocks.clear();
+  for (uint32_t i = 0; i < *count; i++)
+    aotBlocks[table[i].start] = &table[i];
+  if (aotLib != nullptr)
+    dlclose(aotLib);
+  aotLib = lib;
+
+  if (aotCtx == nullptr)
+    aotCtx = new Emu293AotContext();
+  aotCtx->r = r;
+  aotCtx->cr = cr;
+  aotCtx->sr = sr;
+  aotCtx->cel = &CEL;
+  aotCtx->ceh = &CEH;
+  aotCtx->pc = &pc;
+  aotCtx->codeInvalidated = &codeInvalidated;
+  aotCtx->ram = get_dma_ptr(0xA0000000);
+  aotCtx->read8 = read_memU8;
+  aotCtx->read16 = read_memU16;
+  aotCtx->read32 = read_memU32;
+  aotCtx->write8 = write_memU8;
+  aotCtx->write16 = write_memU16;
+  aotCtx->write32 = write_memU32;
+  aotCtx->fallback = aot_fallback;
+  aotCtx->cpu = this;
+  printf("AOT: %u blocks from %s\n", *count, file.c_str());
+  return true;
+#endif
+}
+
+void CPU::unload_aot() {
+  flush_code();
+  aotBlocks.clear();
+#ifndef _WIN32
+  if (aotLib != nullptr)
+    dlclose(aotLib);
+#endif
+  aotLib = nullptr;
+  delete aotCtx;
+  aotCtx = nullptr;
+}
+
+namespace {
+
+string exit_to(uint32_t target, int count) {
+  return stringf("{ *c->pc = 0x%08xU; return %d; }", target, count);
+}
+
+string fallback(uint32_t pc, int index) {
+  return stringf("*c->pc = 0x%08xU; c->fallback(c, %d);", pc, index);
+}
+
+// C++ for one instruction, or a PCE half with whole being the pair. PC
+// quirks follow CPU::execute, as in JitX64::emit_insn
+string translate(const CPU::DecodedInsn &d, uint32_t pc, uint32_t len, int index, int count) {
+  uint32_t next = pc + len;
+  string A = stringf("r[%d]", d.rA), B = stringf("r[%d]", d.rB), D = stringf("r[%d]", d.rD);
+  string imm = stringf("0x%08xU", d.imm);
+  switch (d.op) {
+  case CPU::UOP_NOP:
+    return "";
+  case CPU::UOP_ADD:
+  case CPU::UOP_SUB:
+  case CPU::UOP_NEG:
+  case CPU::UOP_ADDI:
+  case CPU::UOP_SUBI: {
+    bool isSub = (d.op == CPU::UOP_SUB || d.op == CPU::UOP_NEG || d.op == CPU::UOP_SUBI);
+    bool isImm = (d.op == CPU::UOP_ADDI || d.op == CPU::UOP_SUBI);
+    string s = stringf("uint32_t a = %s, b = %s, res = a %c b; %s = res;",
+                       (d.op == CPU::UOP_NEG) ? "0" : A.c_str(), isImm ? imm.c_str() : B.c_str(),
+                       isSub ? '-' : '+', D.c_str());
+    if (d.cu)
+      s += isSub ? " aot_sub_flags(c, a, b, res);" : " aot_add_flags(c, a, b, res);";
+    return s;
+  }
+  case CPU::UOP_AND:
+  case CPU::UOP_OR:
+  case CPU::UOP_XOR:
+  case CPU::UOP_ANDI:
+  case CPU::UOP_ORI:
+  case CPU::UOP_XORI:
+  case CPU::UOP_TSTI: {
+    bool isImm = (d.op >= CPU::UOP_ANDI);
+    char op = (d.op == CPU::UOP_OR || d.op == CPU::UOP_ORI) ? '|'
+            : (d.op == CPU::UOP_XOR || d.op == CPU::UOP_XORI) ? '^' : '&';
+    string s = stringf("uint32_t res = %s %c %s;", A.c_str(), op, isImm ? imm.c_str() : B.c_str());
+    if (d.op != CPU::UOP_TSTI)
+      s += stringf(" %s = res;", D.c_str());
+    if (d.cu)
+      s += " aot_nz(c, res);";
+    return s;
+  }
+  case CPU::UOP_LDI:
+    return stringf("%s = %s;", D.c_str(), imm.c_str());
+  case CPU::UOP_CMP:
+  case CPU::UOP_CMPI: {
+    if (!d.cu)
+      return "";
+    string s = stringf("uint32_t a = %s, b = %s, res = a - b; aot_sub_flags(c, a, b, res);",
+                       A.c_str(), (d.op == CPU::UOP_CMPI) ? imm.c_str() : B.c_str());
+    if (d.rD == 0)
+      s += " aot_set_t(c, res == 0);";
+    else if (d.rD == 1)
+      s += " aot_set_t(c, res >> 31);";
+    return s;
+  }
+  case CPU::UOP_SLL:
+  case CPU::UOP_SRL:
+  case CPU::UOP_SRA:
+  case CPU::UOP_ROR:
+  case CPU::UOP_ROL:
+  case CPU::UOP_SLLI:
+  case CPU::UOP_SRLI:
+  case CPU::UOP_SRAI:
+  case CPU::UOP_RORI:
+  case CPU::UOP_ROLI: {
+    // C from shifts has edge cases best left to the interpreter
+    if (d.cu)
+      return fallback(pc, index);
+    bool isImm = (d.op >= CPU::UOP_SLLI);
+    int kind = d.op - (isImm ? CPU::UOP_SLLI : CPU::UOP_SLL);
+    string s = stringf("uint32_t a = %s, sa = %s;", A.c_str(),
+                       isImm ? stringf("%uU", d.imm).c_str() : (B + " & 0x1F").c_str());
+    static const char *const exprs[] = {
+        "a << sa", "a >> sa", "uint32_t(int32_t(a) >> sa)",
+        "sa ? ((a >> sa) | (a << (32 - sa))) : a", "sa ? ((a << sa) | (a >> (32 - sa))) : a"};
+    return s + stringf(" %s = %s;", D.c_str(), exprs[kind]);
+  }
+  case CPU::UOP_MUL:
+  case CPU::UOP_MULU: {
+    const char *prod = (d.op == CPU::UOP_MUL) ? "uint64_t(int64_t(int32_t(%s)) * int32_t(%s))"
+                                              : "uint64_t(%s) * %s";
+    return "uint64_t res = " + stringf(prod, A.c_str(), B.c_str()) +
+           "; *c->cel = uint32_t(res); *c->ceh = uint32_t(res >> 32);";
+  }
+  case CPU::UOP_MFCE:
+    if (d.rB == 0x01)
+      return D + " = *c->cel;";
+    if (d.rB == 0x02)
+      return D + " = *c->ceh;";
+    if (d.rB == 0x03)
+      return D + " = *c->ceh; " + A + " = *c->cel;";
+    return "";
+  case CPU::UOP_MTCE:
+    if (d.rB == 0x01)
+      return "*c->cel = " + D + ";";
+    if (d.rB == 0x02)
+      return "*c->ceh = " + D + ";";
+    if (d.rB == 0x03)
+      return "*c->ceh = " + D + "; *c->cel = " + A + ";";
+    return "";
+  case CPU::UOP_MFSR:
+  case CPU::UOP_MTSR:
+    if (d.rB >= 3)
+      return fallback(pc, index);
+    if (d.op == CPU::UOP_MFSR)
+      return stringf("%s = c->sr[%d];", D.c_str(), d.rB);
+    return stringf("c->sr[%d] = %s;", d.rB, A.c_str());
+  case CPU::UOP_MFCR:
+    return stringf("%s = c->cr[%d];", D.c_str(), d.rA);
+  case CPU::UOP_MTCR: {
+    string s = stringf("c->cr[%d] = %s;", d.rA, D.c_str());
+    // Let a pending interrupt fire if this enabled them
+    if (d.rA == 0)
+      s += " " + exit_to(next, count);
+    return s;
+  }
+  case CPU::UOP_TCOND:
+    return stringf("aot_set_t(c, aot_cond(c, %d));", d.rB);
+  case CPU::UOP_MV:
+    return D + " = " + A + ";";
+  case CPU::UOP_MVCOND:
+    return stringf("if (aot_cond(c, %d)) %s = %s;", d.rB, D.c_str(), A.c_str());
+  case CPU::UOP_EXTSB:
+  case CPU::UOP_EXTSH: {
+    string s = stringf("%s = uint32_t(int32_t(%s(%s)));", D.c_str(),
+                       (d.op == CPU::UOP_EXTSB) ? "int8_t" : "int16_t", A.c_str());
+    if (d.cu)
+      s += stringf(" aot_nz(c, %s);", D.c_str());
+    return s;
+  }
+  case CPU::UOP_BR:
+    // The target is read before linking
+    return stringf("if (aot_cond(c, %d)) { uint32_t t = %s; %s*c->pc = t; return %d; }", d.rB,
+                   A.c_str(), d.cu ? stringf("r[3] = 0x%08xU; ", pc + 4).c_str() : "", count);
+  case CPU::UOP_BR16:
+  case CPU::UOP_BRL16:
+    // ...but after for the 16 bit form
+    return stringf("if (aot_cond(c, %d)) { %s*c->pc = %s + %dU; return %d; }", d.rB,
+                   (d.op == CPU::UOP_BRL16) ? stringf("r[3] = 0x%08xU; ", pc + len).c_str() : "",
+                   A.c_str(), len - 2, count);
+  case CPU::UOP_J:
+  case CPU::UOP_J16: {
+    string s;
+    if (d.cu)
+      s = stringf("r[3] = 0x%08xU; ", pc + ((d.op == CPU::UOP_J) ? 4 : len));
+    if (d.op == CPU::UOP_J)
+      return s + exit_to((pc & 0xFC000000) | d.imm, count);
+    return s + exit_to(((pc & 0xFFFFF000) | d.imm) - 2 + len, count);
+  }
+  case CPU::UOP_BC:
+    return stringf("if (aot_cond(c, %d)) { %s%s }", d.rB,
+                   d.cu ? stringf("r[3] = 0x%08xU; ", pc + 4).c_str() : "",
+                   exit_to(pc + d.imm + len, count).c_str());
+  case CPU::UOP_RTE:
+  case CPU::UOP_INVALID:
+    return fallback(pc, index) + stringf(" return %d;", count);
+  case CPU::UOP_CACHE:
+    return fallback(pc, index) + " if (*c->codeInvalidated) " + exit_to(next, count);
+  default:
+    break;
+  }
+  if (d.op >= CPU::UOP_LW && d.op <= CPU::UOP_SB_POST) {
+    int func = (d.op - CPU::UOP_LW) & 0x7;
+    int mode = (d.op - CPU::UOP_LW) >> 3;
+    bool store = (func == 4 || func == 5 || func == 7);
+    string s;
+    if (mode == 1)
+      s = stringf("%s += %s; uint32_t addr = %s;", A.c_str(), imm.c_str(), A.c_str());
+    else if (mode == 2)
+      s = stringf("uint32_t addr = %s;", A.c_str());
+    else
+      s = stringf("uint32_t addr = %s + %s;", A.c_str(), imm.c_str());
+    static const char *const access[] = {
+        "%s = aot_ld32(c, addr, 0x%08xU);",
+        "%s = uint32_t(int32_t(int16_t(aot_ld16(c, addr, 0x%08xU))));",
+        "%s = aot_ld16(c, addr, 0x%08xU);",
+        "%s = uint32_t(int32_t(int8_t(aot_ld8(c, addr, 0x%08xU))));",
+        "aot_st32(c, addr, %s, 0x%08xU);",
+        "aot_st16(c, addr, %s, 0x%08xU);",
+        "%s = aot_ld8(c, addr, 0x%08xU);",
+        "aot_st8(c, addr, %s, 0x%08xU);"};
+    s += " " + stringf(access[func], D.c_str(), pc);
+    if (mode == 2)
+      s += stringf(" %s += %s;", A.c_str(), imm.c_str());
+    // Stores may have overwritten the rest of the block
+    if (store)
+      s += " if (*c->codeInvalidated) " + exit_to(next, count);
+    return s;
+  }
+  // addc/subc, div and anything else rare
+  return fallback(pc, index);
+}
+
+bool ends_flow(const CPU::DecodedInsn &d) {
+  switch (d.op) {
+  case CPU::UOP_J:
+  case CPU::UOP_J16:
+    return !d.cu;
+  case CPU::UOP_BC:
+  case CPU::UOP_BR:
+    return !d.cu && d.rB == 0xF;
+  case CPU::UOP_BR16:
+    return d.rB == 0xF;
+  case CPU::UOP_RTE:
+  case CPU::UOP_INVALID:
+    return true;
+  default:
+    return false;
+  }
+}
+
+} // namespace
+
+bool CPU::aot_generate(const std::string &file, const std::vector<uint32_t> &entries, uint32_t lo,
+                       uint32_t hi) {
+  FILE *out = fopen(file.c_str(), "w");
+  if (out == nullptr) {
+    printf("AOT: failed to create %s\n", file.c_str());
+    return false;
+  }
+  // Follow direct branches and fall through from each entry point
+  flush_code();
+  bool wasFusing = fuseOps;
+  fuseOps = false;
+  map<uint32_t, CodeBlock *> found;
+  vector<uint32_t> work(entries);
+  while (!work.empty()) {
+    uint32_t start = work.back();
+    work.pop_back();
+    if (start < lo || start >= hi || (start & 0x1) || (start & 0xFC000000) != 0xA0000000 ||
+        found.count(start))
+      continue;
+    CodeBlock *blk = find_block(start);
+    found[start] = blk;
+    uint32_t pc = blk->start;
+    for (auto &d : blk->insns) {
+      int halves = (d.op == UOP_PCE) ? 2 : 1;
+      for (int h = 0; h < halves; h++) {
+        const DecodedInsn &x = (d.op == UOP_PCE) ? d.pce[h] : d;
+        if (x.op == UOP_BC)
+          work.push_back(pc + x.imm + d.len);
+        else if (x.op == UOP_J)
+          work.push_back((pc & 0xFC000000) | x.imm);
+        else if (x.op == UOP_J16)
+          work.push_back(((pc & 0xFFFFF000) | x.imm) - 2 + d.len);
+      }
+      pc += d.len;
+    }
+    const DecodedInsn &last = blk->insns.back();
+    if (last.op != UOP_PCE && ends_flow(last))
+      continue;
+    work.push_back(blk->end);
+  }
+
+  fprintf(out, "// Generated by emu293 -aotgen, do not edit\n");
+  fprintf(out, "#include \"aot_abi.h\"\n\n");
+  for (auto &entry : found) {
+    CodeBlock *blk = entry.second;
+    auto sym = symbols_bwd.find(blk->start);
+    if (sym != symbols_bwd.end())
+      fprintf(out, "// %s\n", sym->second.c_str());
+    fprintf(out, "static int b_%08x(Emu293AotContext *c) {\n", blk->start);
+    fprintf(out, "  uint32_t *r = c->r;\n");
+    fprintf(out, "  (void)r;\n");
+    uint32_t pc = blk->start;
+    for (size_t i = 0; i < blk->insns.size(); i++) {
+      const DecodedInsn &d = blk->insns[i];
+      if (d.op == UOP_PCE) {
+        fprintf(out, "  if (c->cr[1] & 0x10) {\n    %s\n  } else {\n    %s\n  }\n",
+                translate(d.pce[1], pc, d.len, i, i + 1).c_str(),
+                translate(d.pce[0], pc, d.len, i, i + 1).c_str());
+      } else {
+        string s = translate(d, pc, d.len, i, i + 1);
+        if (!s.empty())
+          fprintf(out, "  { %s }\n", s.c_str());
+      }
+      pc += d.len;
+    }
+    fprintf(out, "  *c->pc = 0x%08xU;\n  return %d;\n}\n\n", blk->end, int(blk->insns.size()));
+  }
+  fprintf(out, "extern \"C\" {\n");
+  fprintf(out, "const uint32_t emu293_aot_version = EMU293_AOT_VERSION;\n");
+  fprintf(out, "const uint32_t emu293_aot_num_blocks = %d;\n", int(found.size()));
+  fprintf(out, "const Emu293AotBlock emu293_aot_blocks[] = {\n");
+  for (auto &entry : found) {
+    CodeBlock *blk = entry.second;
+    fprintf(out, "  {0x%08xU, 0x%08xU, 0x%08xU, b_%08x},\n", blk->start, blk->end, code_hash(*blk),
+            blk->start);
+  }
+  fprintf(out, "};\n}\n");
+  bool ok = (fclose(out) == 0);
+  printf("AOT: wrote %d blocks to %s\n", int(found.size()), file.c_str());
+  flush_code();
+  retiredBlocks.clear();
+  fuseOps = wasFusing;
+  return ok;
+}
+
+} // namespace Emu293
@@ -0,0 +1,167 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+// Interface between the emulator and ahead of time translated firmware, see
+// CPU::aot_generate() and CPU::load_aot(). Generated code only includes this
+// header, so it can be built as a shared library on its own:
+//   g++ -O2 -shared -fPIC -I src/cpu lead_aot.cpp -o lead_aot.so
+// Bump the version for any change here.
+#define EMU293_AOT_VERSION 1
+
+struct Emu293AotContext {
+  // Guest state, owned by the CPU
+  uint32_t *r, *cr, *sr, *cel, *ceh, *pc;
+  // Set when a store drops cached code, the block may have overwritten itself
+  const bool *codeInvalidated;
+  // Host pointer to the 64MB of RAM, seen at 0x80000000 and 0xA0000000
+  uint8_t *ram;
+  uint8_t (*read8)(uint32_t addr);
+  uint16_t (*read16)(uint32_t addr);
+  uint32_t (*read32)(uint32_t addr);
+  void (*write8)(uint32_t addr, uint8_t val);
+  void (*write16)(uint32_t addr, uint16_t val);
+  void (*write32)(uint32_t addr, uint32_t val);
+  // Runs instruction index of the current block in the interpreter, with PC
+  // set to it beforehand. PC is left at whatever follows
+  void (*fallback)(Emu293AotContext *c, uint32_t index);
+  void *cpu;
+  const void *block;
+};
+
+// Runs a whole block, returning the number of instructions executed with PC
+// set to the next one, as CPU::execute does
+typedef int (*Emu293AotBlockFn)(Emu293AotContext *c);
+
+struct Emu293AotBlock {
+  uint32_t start, end;
+  // Of the guest code bytes, so stale translations are never used
+  uint32_t hash;
+  Emu293AotBlockFn fn;
+};
+
+extern "C" {
+extern const uint32_t emu293_aot_version;
+extern const uint32_t emu293_aot_num_blocks;
+extern const Emu293AotBlock emu293_aot_blocks[];
+}
+
+// Helpers for the generated code. Flags are kept up to date in cr1 (V, C, Z,
+// N and T from bit 0), matching CPU::execute after sync_flags()
+static inline bool aot_is_ram(uint32_t addr) { return (addr & 0xDC000000) == 0x80000000; }
+
+static inline uint32_t aot_ld32(Emu293AotContext *c, uint32_t addr, uint32_t pc) {
+  uint32_t val;
+  if (aot_is_ram(addr)) {
+    memcpy(&val, c->ram + (addr & 0x03FFFFFF), 4);
+    return val;
+  }
+  // The memory system reports PC in diagnostics
+  *c->pc = pc;
+  return c->read32(addr);
+}
+
+static inline uint16_t aot_ld16(Emu293AotContext *c, uint32_t addr, uint32_t pc) {
+  uint16_t val;
+  if (aot_is_ram(addr)) {
+    memcpy(&val, c->ram + (addr & 0x03FFFFFF), 2);
+    return val;
+  }
+  *c->pc = pc;
+  return c->read16(addr);
+}
+
+static inline uint8_t aot_ld8(Emu293AotContext *c, uint32_t addr, uint32_t pc) {
+  if (aot_is_ram(addr))
+    return c->ram[addr & 0x03FFFFFF];
+  *c->pc = pc;
+  return c->read8(addr);
+}
+
+// Stores always go through the memory system, which drops overwritten code
+static inline void aot_st32(Emu293AotContext *c, uint32_t addr, uint32_t val, uint32_t pc) {
+  *c->pc = pc;
+  c->write32(addr, val);
+}
+
+static inline void aot_st16(Emu293AotContext *c, uint32_t addr, uint32_t val, uint32_t pc) {
+  *c->pc = pc;
+  c->write16(addr, val);
+}
+
+static inline void aot_st8(Emu293AotContext *c, uint32_t addr, uint32_t val, uint32_t pc) {
+  *c->pc = pc;
+  c->write8(addr, val);
+}
+
+static inline void aot_nz(Emu293AotContext *c, uint32_t res) {
+  uint32_t cr1 = c->cr[1] & ~0xCU;
+  if (res >> 31)
+    cr1 |= 0x8;
+  if (res == 0)
+    cr1 |= 0x4;
+  c->cr[1] = cr1;
+}
+
+static inline void aot_cv(Emu293AotContext *c, bool carry, bool overflow) {
+  c->cr[1] = (c->cr[1] & ~0x3U) | (carry ? 0x2 : 0) | (overflow ? 0x1 : 0);
+}
+
+static inline void aot_add_flags(Emu293AotContext *c, uint32_t a, uint32_t b, uint32_t res) {
+  aot_nz(c, res);
+  aot_cv(c, res < a, (~(a ^ b) & (a ^ res)) >> 31);
+}
+
+static inline void aot_sub_flags(Emu293AotContext *c, uint32_t a, uint32_t b, uint32_t res) {
+  aot_nz(c, res);
+  aot_cv(c, a >= b, ((a ^ b) & ~(res ^ b)) >> 31);
+}
+
+static inline void aot_set_t(Emu293AotContext *c, bool t) {
+  c->cr[1] = (c->cr[1] & ~0x10U) | (t ? 0x10 : 0);
+}
+
+static inline bool aot_cond(Emu293AotContext *c, int pattern) {
+  uint32_t cr1 = c->cr[1];
+  bool V = cr1 & 0x1, C = cr1 & 0x2, Z = cr1 & 0x4, N = cr1 & 0x8;
+  switch (pattern) {
+  case 0x0:
+    return C;
+  case 0x1:
+    return !C;
+  case 0x2:
+    return C && !Z;
+  case 0x3:
+    return !C || Z;
+  case 0x4:
+    return Z;
+  case 0x5:
+    return !Z;
+  case 0x6:
+    return (N == V) && !Z;
+  case 0x7:
+    return (N != V) || Z;
+  case 0x8:
+    return (N == V);
+  case 0x9:
+    return (N != V);
+  case 0xA:
+    return N;
+  case 0xB:
+    return !N;
+  case 0xC:
+    return V;
+  case 0xD:
+    return !V;
+  case 0xE: {
+    // Counts down sr0
+    bool taken = int32_t(c->sr[0]) > 0;
+    c->sr[0]--;
+    return taken;
+  }
+  case 0xF:
+    return true;
+  default:
+    return false;
+  }
+}
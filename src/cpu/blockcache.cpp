@@ -0,0 +1,304 @@
+#include "cpu.h"
+#include "../helper.h"
+#include "../system.h"
+#include <algorithm>
+
+using namespace std;
+
+// Pre-decoded basic block cache. Blocks are straight-line runs of decoded
+// instructions, ending at control flow or at a 4KB code page boundary, so
+// that writes to a page only need to drop the blocks registered against it.
+namespace Emu293 {
+
+static inline bool ends_block(const CPU::DecodedInsn &d) {
+  switch (d.op) {
+  case CPU::UOP_INVALID:
+  case CPU::UOP_BR:
+  case CPU::UOP_BR16:
+  case CPU::UOP_BRL16:
+  case CPU::UOP_J:
+  case CPU::UOP_J16:
+  case CPU::UOP_BC:
+  case CPU::UOP_RTE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Registers read and written by an op that may appear in an idle loop, false
+// for anything else
+static bool idle_op_regs(const CPU::DecodedInsn &d, uint32_t &reads, uint32_t &writes) {
+  switch (d.op) {
+  case CPU::UOP_NOP:
+    return true;
+  case CPU::UOP_LDI:
+    writes = 1U << d.rD;
+    return true;
+  case CPU::UOP_NEG:
+    reads = 1U << d.rB;
+    writes = 1U << d.rD;
+    return true;
+  case CPU::UOP_ADD:
+  case CPU::UOP_SUB:
+  case CPU::UOP_AND:
+  case CPU::UOP_OR:
+  case CPU::UOP_XOR:
+  case CPU::UOP_SLL:
+  case CPU::UOP_SRL:
+  case CPU::UOP_SRA:
+  case CPU::UOP_ROR:
+  case CPU::UOP_ROL:
+    reads = (1U << d.rA) | (1U << d.rB);
+    writes = 1U << d.rD;
+    return true;
+  case CPU::UOP_CMP:
+    reads = (1U << d.rA) | (1U << d.rB);
+    return true;
+  case CPU::UOP_TSTI:
+  case CPU::UOP_CMPI:
+    reads = 1U << d.rA;
+    return true;
+  case CPU::UOP_ADDI:
+  case CPU::UOP_SUBI:
+  case CPU::UOP_ANDI:
+  case CPU::UOP_ORI:
+  case CPU::UOP_XORI:
+  case CPU::UOP_SLLI:
+  case CPU::UOP_SRLI:
+  case CPU::UOP_SRAI:
+  case CPU::UOP_RORI:
+  case CPU::UOP_ROLI:
+  case CPU::UOP_MV:
+  case CPU::UOP_EXTSB:
+  case CPU::UOP_EXTSH:
+  case CPU::UOP_LW:
+  case CPU::UOP_LH:
+  case CPU::UOP_LHU:
+  case CPU::UOP_LB:
+  case CPU::UOP_LBU:
+    reads = 1U << d.rA;
+    writes = 1U << d.rD;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// A block that branches back to its own start, where each time round only
+// loads and recomputes the same values, can make no progress until memory is
+// changed by something else
+static bool is_idle_loop(const CPU::CodeBlock &blk) {
+  const CPU::DecodedInsn &last = blk.insns.back();
+  uint32_t pc = blk.end - last.len;
+  uint32_t target;
+  if (last.op == CPU::UOP_BC && !last.cu && last.rB != 0xE)
+    target = pc + last.imm + last.len;
+  else if (last.op == CPU::UOP_J && !last.cu)
+    target = (pc & 0xFC000000) | last.imm;
+  else if (last.op == CPU::UOP_J16 && !last.cu)
+    target = ((pc & 0xFFFFF000) | last.imm) - 2 + last.len;
+  else
+    return false;
+  if (target != blk.start)
+    return false;
+  size_t n = blk.insns.size() - 1;
+  vector<uint32_t> reads(n, 0), writes(n, 0);
+  uint32_t loopWrites = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!idle_op_regs(blk.insns[i], reads[i], writes[i]))
+      return false;
+    loopWrites |= writes[i];
+  }
+  // Registers carried over from the last time round would make each pass
+  // different
+  uint32_t written = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (reads[i] & loopWrites & ~written)
+      return false;
+    written |= writes[i];
+  }
+  return true;
+}
+
+static int insn_cycles(const CPU::DecodedInsn &d) {
+  if (d.op >= CPU::UOP_LW && d.op <= CPU::UOP_SB_POST)
+    return CPU::CYCLES_MEM;
+  switch (d.op) {
+  case CPU::UOP_MUL:
+  case CPU::UOP_MULU:
+    return CPU::CYCLES_MUL;
+  case CPU::UOP_DIV:
+  case CPU::UOP_DIVU:
+    return CPU::CYCLES_DIV;
+  default:
+    return 1;
+  }
+}
+
+static inline uint32_t code_page(uint32_t pc) {
+  if ((pc & 0xFF000000) == 0x9F000000)
+    return CPU::RAM_CODE_PAGES + ((pc & 0x00FFFFFF) >> CPU::CODE_PAGE_SHIFT);
+  else
+    return (pc & 0x03FFFFFF) >> CPU::CODE_PAGE_SHIFT;
+}
+
+CPU::CodeBlock *CPU::find_block(uint32_t start) {
+  CodeBlock *blk = blockLut[(start >> 1) & (BLOCK_LUT_SIZE - 1)];
+  if (blk == nullptr || blk->start != start) {
+    auto found = blocks.find(start);
+    blk = (found != blocks.end()) ? found->second.get() : compile_block(start);
+    blockLut[(start >> 1) & (BLOCK_LUT_SIZE - 1)] = blk;
+  }
+  return blk;
+}
+
+const CPU::DecodedInsn *CPU::fetch_decoded() {
+  if (curBlock == nullptr || pc != nextPC) {
+    curBlock = find_block(pc);
+    curIndex = 0;
+  }
+  const DecodedInsn *insn = &curBlock->insns[curIndex++];
+  nextPC = pc + insn->len;
+  if (curIndex >= curBlock->insns.size())
+    curBlock = nullptr;
+  return insn;
+}
+
+CPU::CodeBlock *CPU::compile_block(uint32_t start) {
+  // Same fetch rules as the uncached path in step()
+  volatile uint8_t *ptr = ((start & 0xFC000000) == 0xA0000000) ? memPtr : imemPtr;
+  uint32_t mask = ((start & 0xFF000000) == 0x9F000000) ? 0x00FFFFFC : 0x03FFFFFC;
+
+  CodeBlock *blk = new CodeBlock();
+  blk->start = start;
+  // PCE alternatives are stored separately, and linked once the vector stops growing
+  vector<size_t> pce_insns;
+  uint32_t addr = start;
+  bool done = false;
+  while (!done) {
+    DecodedInsn d;
+    uint32_t instruction = get_uint32le(ptr + (addr & mask));
+    if ((addr & 0x03) == 2)
+      instruction >>= 16;
+    if (((instruction & 0x80008000) == 0x80008000) && ((addr & 0x03) == 0)) {
+      // Remove p0 and p1 bits before handling the instruction as 30bit
+      uint32_t w2 = instruction & 0xFFFF0000;
+      instruction &= 0x00007FFF;
+      instruction |= w2 >> 1;
+      instruction &= 0x3FFFFFFF;
+      decode32(instruction, d);
+      done = ends_block(d);
+    } else if ((instruction & 0x8000) && ((addr & 0x03) == 0)) {
+      DecodedInsn lo, hi;
+      decode16(instruction & 0x7FFF, lo);
+      decode16(instruction >> 16, hi);
+      blk->pce.push_back(lo);
+      blk->pce.push_back(hi);
+      d = DecodedInsn();
+      d.op = UOP_PCE;
+      d.len = 4;
+      d.imm = blk->pce.size() - 2;
+      pce_insns.push_back(blk->insns.size());
+      done = ends_block(lo) || ends_block(hi);
+    } else {
+      decode16(instruction & 0x7FFF, d);
+      done = ends_block(d);
+    }
+    blk->insns.push_back(d);
+    addr += d.len;
+    if ((addr & ((1 << CODE_PAGE_SHIFT) - 1)) == 0 || blk->insns.size() >= MAX_BLOCK_INSNS)
+      done = true;
+  }
+  for (auto idx : pce_insns)
+    blk->insns[idx].pce = &blk->pce[blk->insns[idx].imm];
+  for (auto &d : blk->insns) {
+    if (d.op == UOP_PCE)
+      d.cycles = max(insn_cycles(d.pce[0]), insn_cycles(d.pce[1]));
+    else
+      d.cycles = insn_cycles(d);
+    blk->cycles += d.cycles;
+  }
+  blk->end = addr;
+  blk->idle = is_idle_loop(*blk);
+  auto hook = hleHooks.find(start);
+  if (hook != hleHooks.end())
+    blk->hle = hook->second;
+  if (!aotBlocks.empty())
+    blk->aot = find_aot(*blk);
+  // After everything else that looks at the decoded ops
+  if (jit == nullptr && fuseOps)
+    fuse_pairs(*blk);
+
+  uint32_t page = code_page(start);
+  pageBlocks[page].push_back(start);
+  codePages[page] = 1;
+  blocks[start].reset(blk);
+  return blk;
+}
+
+void CPU::fuse_pairs(CodeBlock &blk) {
+  // The second of each pair stays as it is, for single stepping into it
+  for (size_t i = 0; i + 1 < blk.insns.size(); i++) {
+    DecodedInsn &a = blk.insns[i];
+    const DecodedInsn &b = blk.insns[i + 1];
+    if ((a.op == UOP_CMP || a.op == UOP_CMPI) && a.cu && b.op == UOP_BC && !b.cu) {
+      a.op = (a.op == UOP_CMP) ? UOP_CMP_BC : UOP_CMPI_BC;
+    } else if (a.op == UOP_LDI && (b.op == UOP_ORI || b.op == UOP_ADDI) && b.rA == a.rD &&
+               b.rD == a.rD) {
+      a.op = (b.op == UOP_ORI) ? UOP_LDI_ORI : UOP_LDI_ADDI;
+      // ldi ignores its own .c bit
+      a.cu = b.cu;
+    } else if (a.op == UOP_LW_POST && b.op == UOP_SW_POST && b.rD == a.rD) {
+      a.op = UOP_LW_SW_POST;
+    } else {
+      continue;
+    }
+    i++;
+  }
+}
+
+void CPU::invalidate_code_page(uint32_t page) {
+  for (auto start : pageBlocks[page]) {
+    auto found = blocks.find(start);
+    if (found == blocks.end())
+      continue;
+    CodeBlock *&lut = blockLut[(start >> 1) & (BLOCK_LUT_SIZE - 1)];
+    if (lut == found->second.get())
+      lut = nullptr;
+    // The block may be the one currently executing, so keep it alive until
+    // the next step
+    retiredBlocks.push_back(std::move(found->second));
+    blocks.erase(found);
+  }
+  pageBlocks[page].clear();
+  codePages[page] = 0;
+  curBlock = nullptr;
+  codeInvalidated = true;
+}
+
+void CPU::add_hle_hook(uint32_t addr, HleHandler handler) {
+  hleHooks[addr] = handler;
+  flush_code();
+}
+
+void CPU::clear_hle_hooks() {
+  if (hleHooks.empty())
+    return;
+  hleHooks.clear();
+  flush_code();
+}
+
+void CPU::flush_code() {
+  for (auto &blk : blocks)
+    retiredBlocks.push_back(std::move(blk.second));
+  blocks.clear();
+  std::fill(blockLut.begin(), blockLut.end(), nullptr);
+  for (auto &page : pageBlocks)
+    page.clear();
+  std::fill(codePages.begin(), codePages.end(), 0);
+  curBlock = nullptr;
+  codeInvalidated = true;
+}
+
+} // namespace Emu293
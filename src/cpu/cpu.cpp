@@ -1,4 +1,5 @@
 #include "cpu.h"
+#include "jit_x64.h"
 #include "../helper.h"
 #include "../sys/irq_if.h"
 #include "../system.h"
@@ -11,6 +12,11 @@
 using namespace std;
 // Based on https://github.com/LiraNuna/hyperscan-emulator
 
+// Code that is fetched through the block cache
+static inline bool is_cached_code(uint32_t pc) {
+  return (pc & 0xFC000000) == 0xA0000000 || (pc & 0xFF000000) == 0x9F000000;
+}
+
 static int32_t sign_extend(uint32_t x, uint8_t b) {
   uint32_t m = 1ULL << (b - 1);
 
@@ -40,15 +46,44 @@ uint64_t divs_op(int32_t a, int32_t b) {
 }
 
 
-CPU::CPU() {
+CPU::CPU()
+    : blockLut(BLOCK_LUT_SIZE, nullptr), pageBlocks(CODE_PAGES),
+      codePages(CODE_PAGES, 0) {
   reset();
   memPtr = get_dma_ptr(0xA0000000);
   imemPtr = get_dma_ptr(0x9F000000);
 }
 
+CPU::~CPU() {
+  unload_aot();
+  delete jit;
+}
+
+bool CPU::set_engine(Engine engine) {
+  flush_code();
+  delete jit;
+  jit = nullptr;
+  if (engine == ENGINE_JIT) {
+#ifdef EMU293_JIT_X64
+    jit = new JitX64(this);
+    if (!jit->init()) {
+      printf("Failed to allocate JIT code buffer, using interpreter\n");
+      delete jit;
+      jit = nullptr;
+      return false;
+    }
+#else
+    printf("JIT not supported on this host, using interpreter\n");
+    return false;
+#endif
+  }
+  return true;
+}
+
 void CPU::reset() {
   reset_flags();
   reset_registers();
+  flush_code();
 }
 
 void CPU::reset_flags() {
@@ -58,6 +93,7 @@ void CPU::reset_flags() {
   V = 0;
   T = 0;
   isPCE = false;
+  lazyFlags = 0;
 }
 
 void CPU::reset_registers() {
@@ -71,6 +107,8 @@ void CPU::reset_registers() {
   pc = 0;
 
   queuedInterrupt = 0;
+  lazyFlags = 0;
+  cycleCount = 0;
 }
 
 void CPU::step() {
@@ -151,72 +189,13 @@ void CPU::step() {
 
   lastpc = pc;
 
-  if (queuedInterrupt != 0) {
-    // Don't fire if interrupts are disabled
-    if (!(cr0 & 1)) {
-
-    } else {
-      // set_bit(cr0, 0);
-      // Set cause in cr2
-      uint64_t irq = 0;
-      for (unsigned i = 0; i < 64; i++) { // todo: use ffs intrinsic
-        if (queuedInterrupt & (1ULL << i)) {
-          irq = i;
-          break;
-        }
-      }
-      last_ien = (cr0 & 1);
-      clear_bit(cr0, 0);
-      cr2 &= ~0x00FC0000;
-      cr2 |= (irq & 0x3F) << 18;
-
-      // Save old PC
-      cr5 = pc;
-
-      // Jump to interrupt
-      pc = cr3 + 0x200 + (irq * 4);
-      // printf("Jumping to IRQ handler at %08x\n", pc);
-      queuedInterrupt &= ~(1ULL << irq);
-    }
-  }
-  if ((pc & 0xFC000000) == 0xA0000000 || (pc & 0xFF000000) == 0x9F000000) {
-    auto ptr = ((pc & 0xFC000000) == 0xA0000000) ? memPtr : imemPtr;
-    uint32_t mask = ((pc & 0xFF000000) == 0x9F000000 || (pc & 0xFF000000) == 0xBF000000 || (pc & 0xFF000000) == 0x9C000000) ? 0x00FFFFFC : 0x03FFFFFC;
-    uint32_t instruction = get_uint32le(ptr + (pc & mask));
-    if ((pc & 0x03) == 2)
-      instruction >>= 16;
-    // uint32_t instruction = read_memU16(pc);
-    //printf("PC=0x%08x instr = %08x, ptr=%16x %16x\n",pc, instruction, uint64_t(ptr), imemPtr);
-    // Pre-decode the instruction
-    if (((instruction & 0x80008000) == 0x80008000) && ((pc & 0x03) == 0)) {
-      // Remove p0 and p1 bits before handling the instruction as 30bit
-      uint32_t w2 = instruction & 0xFFFF0000;
-      instruction &= 0x00007FFF;
-      instruction |= w2 >> 1;
-      instruction &= 0x3FFFFFFF;
-      // instruction |= read_memU16(pc + 2) << 15;
-      // instruction &= 0x3FFFFFFF;
-
-      exec32(instruction);
-      pc += 4;
-    } else {
-
-      if ((instruction & 0x8000) && ((pc & 0x03) == 0)) {
-        isPCE = true;
-        if (T) {
-          exec16(instruction >> 16);
-        } else {
-          exec16(instruction & 0x7FFF);
-        }
-        pc += 4;
-      } else {
-        isPCE = false;
-        exec16(instruction & 0x7FFF);
-        pc += 2;
-      }
-    }
+  check_interrupts();
+  if (is_cached_code(pc)) {
+    retiredBlocks.clear();
+    const DecodedInsn *insn = fetch_decoded();
+    execute(insn, insn + 1);
   } else {
-
+    DecodedInsn insn;
     uint32_t instruction = read_memU16(pc);
     // Pre-decode the instruction
     if (instruction & 0x8000) {
@@ -225,16 +204,116 @@ void CPU::step() {
       instruction |= read_memU16(pc + 2) << 15;
       instruction &= 0x3FFFFFFF;
 
-      exec32(instruction);
-      pc += 4;
+      decode32(instruction, insn);
     } else {
       // p0 bit is not present and there is no next instruction
       // TODO: if p1 bit is in next 16bit instruction, parallel execution mode
 
-      exec16(instruction);
-      pc += 2;
+      decode16(instruction, insn);
+    }
+    execute(&insn, &insn + 1);
+  }
+}
+
+int CPU::run_block() {
+  idleLoop = false;
+#ifdef EMU293_JIT_X64
+  if (jit != nullptr) {
+    check_interrupts();
+    if (is_cached_code(pc)) {
+      // Blocks retired by the last run may be dropped now
+      retiredBlocks.clear();
+      if (jit->full()) {
+        flush_code();
+        retiredBlocks.clear();
+        jit->reset();
+      }
+      CodeBlock *blk = find_block(pc);
+      if (blk->hle != nullptr) {
+        int count = blk->hle(*this);
+        cycleCount += count;
+        pc = r3;
+        return count;
+      }
+      if (blk->aot != nullptr)
+        return run_aot(blk);
+      if (blk->native == nullptr)
+        blk->native = jit->compile(*blk);
+      curBlock = nullptr;
+      codeInvalidated = false;
+      // Translated code keeps the flags in cr1 up to date itself
+      sync_flags();
+      int count = JitX64::enter(blk->native);
+      count_cycles(blk, count);
+      idleLoop = blk->idle && pc == blk->start;
+      return count;
     }
   }
+#endif
+  check_interrupts();
+  if (!is_cached_code(pc)) {
+    step();
+    cycleCount++;
+    return 1;
+  }
+  retiredBlocks.clear();
+  CodeBlock *blk = find_block(pc);
+  if (blk->hle != nullptr) {
+    int count = blk->hle(*this);
+    cycleCount += count;
+    pc = r3;
+    return count;
+  }
+  if (blk->aot != nullptr)
+    return run_aot(blk);
+  curBlock = nullptr;
+  codeInvalidated = false;
+  int count = execute(blk->insns.data(), blk->insns.data() + blk->insns.size());
+  count_cycles(blk, count);
+  // Went round without leaving the loop
+  idleLoop = blk->idle && pc == blk->start;
+  return count;
+}
+
+int64_t CPU::run(int64_t cycles) {
+  uint64_t start = cycleCount;
+  runStopped = false;
+  while (int64_t(cycleCount - start) < cycles) {
+    run_block();
+    if (idleLoop || runStopped || (pc == stopPC && stopPC != 0))
+      break;
+  }
+  return cycleCount - start;
+}
+
+void CPU::count_cycles(const CodeBlock *blk, int count) {
+  if (size_t(count) == blk->insns.size()) {
+    cycleCount += blk->cycles;
+    // Anything other than falling through took the final branch
+    if (pc != blk->end)
+      cycleCount += CYCLES_TAKEN;
+  } else {
+    for (int i = 0; i < count; i++)
+      cycleCount += blk->insns[i].cycles;
+  }
+}
+
+void CPU::take_interrupt() {
+  // Lowest numbered first; set cause in cr2
+  uint64_t irq = ctz64(queuedInterrupt);
+  sync_flags();
+  last_ien = (cr0 & 1);
+  clear_bit(cr0, 0);
+  cr2 &= ~0x00FC0000;
+  cr2 |= (irq & 0x3F) << 18;
+
+  // Save old PC
+  cr5 = pc;
+
+  // Jump to interrupt
+  pc = cr3 + 0x200 + (irq * 4);
+  // printf("Jumping to IRQ handler at %08x\n", pc);
+  queuedInterrupt &= ~(1ULL << irq);
 }
 
 void CPU::interrupt(uint8_t cause) { queuedInterrupt |= (1ULL << cause); }
@@ -256,760 +335,937 @@ void CPU::link16() {
   }
 }
 
-void CPU::exec32(Instruction32 insn) {
+void CPU::decode32(Instruction32 insn, DecodedInsn &d) {
+  d = DecodedInsn();
+  d.op = UOP_INVALID;
+  d.len = 4;
   switch (insn.OP) {
   case 0x00: {
-    uint32_t &rD = r[insn.spform.rD];
-    uint32_t &rA = r[insn.spform.rA];
-    uint32_t &rB = r[insn.spform.rB];
+    d.rD = insn.spform.rD;
+    d.rA = insn.spform.rA;
+    d.rB = insn.spform.rB;
+    d.cu = insn.spform.CU;
     switch (insn.spform.func6) {
     // nop
-    case 0x00: /* nothing */
+    case 0x00:
+      d.op = UOP_NOP;
       break;
-
     // br{cond}[l] rA
     case 0x04:
-      if (conditional(insn.spform.rB))
-        branch(rA - 4, insn.spform.CU);
+      d.op = UOP_BR;
       break;
-
     // add[.c] rD, rA, rB
     case 0x08:
-      rD = add(rA, rB, insn.spform.CU);
+      d.op = UOP_ADD;
       break;
     // addc[.c] rD, rA, rB
     case 0x09:
-      rD = addc(rA, rB, insn.spform.CU);
+      d.op = UOP_ADDC;
       break;
     // sub[.c] rD, rA, rB
     case 0x0A:
-      rD = sub(rA, rB, insn.spform.CU);
+      d.op = UOP_SUB;
       break;
     // subc[.c] rD, rA, rB
     case 0x0B:
-      rD = subc(rA, rB, insn.spform.CU);
+      d.op = UOP_SUBC;
       break;
     // cmp{tcs}.c rA, rB
     case 0x0C:
-      cmp(rA, rB, insn.spform.rD & 0x03, insn.spform.CU);
+      d.op = UOP_CMP;
+      d.rD &= 0x03;
       break;
     // cmpz{tcs}.c rA, rB
     case 0x0D:
-      cmp(rA, 0, insn.spform.rD & 0x03, insn.spform.CU);
+      d.op = UOP_CMPI;
+      d.rD &= 0x03;
+      d.imm = 0;
       break;
-
     // neg[.c] rD, rB
     case 0x0F:
-      rD = sub(0, rB, insn.spform.CU);
+      d.op = UOP_NEG;
       break;
     // and[.c] rD, rA, rB
     case 0x10:
-      rD = bit_and(rA, rB, insn.spform.CU);
+      d.op = UOP_AND;
       break;
     // or[.c] rD, rA, rB
     case 0x11:
-      rD = bit_or(rA, rB, insn.spform.CU);
+      d.op = UOP_OR;
       break;
     // not[.c] rD, rA, rB
     case 0x12:
-      rD = bit_xor(rA, ~0, insn.spform.CU);
+      d.op = UOP_XORI;
+      d.imm = ~0U;
       break;
     // xor[.c] rD, rA, rB
     case 0x13:
-      rD = bit_xor(rA, rB, insn.spform.CU);
+      d.op = UOP_XOR;
       break;
     // bitclr[.c] rD, rA, imm5
     case 0x14:
-      rD = bit_and(rA, ~(1 << insn.spform.rB), insn.spform.CU);
+      d.op = UOP_ANDI;
+      d.imm = ~(1U << insn.spform.rB);
       break;
     // bitset[.c] rD, rA, imm5
     case 0x15:
-      rD = bit_or(rA, 1 << insn.spform.rB, insn.spform.CU);
+      d.op = UOP_ORI;
+      d.imm = 1U << insn.spform.rB;
       break;
     // bittst.c rA, imm5
     case 0x16:
-      bit_and(rA, 1 << insn.spform.rB, insn.spform.CU);
+      d.op = UOP_TSTI;
+      d.imm = 1U << insn.spform.rB;
       break;
     // bittgl[.c] rA, imm5
     case 0x17:
-      rD = bit_xor(rA, 1 << insn.spform.rB, insn.spform.CU);
+      d.op = UOP_XORI;
+      d.imm = 1U << insn.spform.rB;
       break;
     // sll[.c] rA, rB
     case 0x18:
-      rD = sll(rA, rB & 0x1F, insn.spform.CU);
+      d.op = UOP_SLL;
       break;
     // srl[.c] rA, rB
     case 0x1A:
-      rD = srl(rA, rB & 0x1F, insn.spform.CU);
+      d.op = UOP_SRL;
       break;
     // sra[.c] rA, rB
     case 0x1B:
-      rD = sra(rA, rB & 0x1F, insn.spform.CU);
+      d.op = UOP_SRA;
       break;
     // ror[.c] rA, RB
     case 0x1C:
-      rD = ror(rA, rB & 0x1F, insn.spform.CU);
+      d.op = UOP_ROR;
       break;
     // ror[.c] rA, RB
     case 0x1E:
-      rD = rol(rA, rB & 0x1F, insn.spform.CU);
+      d.op = UOP_ROL;
       break;
     // mul rA, rD
     case 0x20:
-      ce_op(rA, rB, muls_op);
+      d.op = UOP_MUL;
       break;
     // mulu rA, rD
     case 0x21:
-      ce_op(rA, rB, mulu_op);
+      d.op = UOP_MULU;
       break;
     // div rA, rD
     case 0x22:
-      ce_op(rA, rB, divs_op);
+      d.op = UOP_DIV;
       break;
     // divu rA, rD
     case 0x23:
-      ce_op(rA, rB, divu_op);
+      d.op = UOP_DIVU;
       break;
-
     // mfce{hl} rD[, rA]
     case 0x24:
-      switch (insn.spform.rB) {
-      case 0x01:
-        rD = CEL;
-        break;
-      case 0x02:
-        rD = CEH;
-        break;
-      case 0x03:
-        rD = CEH;
-        rA = CEL;
-        break;
-      }
+      d.op = UOP_MFCE;
       break;
     // mtce{hl} rD[, rA]
     case 0x25:
-      switch (insn.spform.rB) {
-      case 0x01:
-        CEL = rD;
-        break;
-      case 0x02:
-        CEH = rD;
-        break;
-      case 0x03:
-        CEH = rD;
-        CEL = rA;
-        break;
-      }
+      d.op = UOP_MTCE;
       break;
-
     // mfsr rA, Srn
     case 0x28:
-      rD = sr[insn.spform.rB];
+      d.op = UOP_MFSR;
       break;
     // mtsr rA, Srn
     case 0x29:
-      sr[insn.spform.rB] = rA;
+      d.op = UOP_MTSR;
       break;
     // t{cond}
     case 0x2A:
-      T = conditional(insn.spform.rB);
+      d.op = UOP_TCOND;
       break;
     // mv{cond} rD, rA
     case 0x2B:
-      if (conditional(insn.spform.rB))
-        rD = rA;
+      d.op = UOP_MVCOND;
       break;
     // extsb[.c] rD, rA
     case 0x2C:
-      rD = sign_extend(rA, 8);
-      if (insn.spform.CU)
-        basic_flags(rD);
+      d.op = UOP_EXTSB;
       break;
     // extsh[.c] rD, rA
     case 0x2D:
-      rD = sign_extend(rA, 16);
-      if (insn.spform.CU)
-        basic_flags(rD);
+      d.op = UOP_EXTSH;
       break;
     // extzb[.c] rD, rA
     case 0x2E:
-      rD = bit_and(rA, 0x000000FF, insn.spform.CU);
+      d.op = UOP_ANDI;
+      d.imm = 0x000000FF;
       break;
     // extzh[.c] rD, rA
     case 0x2F:
-      rD = bit_and(rA, 0x0000FFFF, insn.spform.CU);
+      d.op = UOP_ANDI;
+      d.imm = 0x0000FFFF;
       break;
-
     // slli[.c] rD, rA, imm5
     case 0x38:
-      rD = sll(rA, insn.spform.rB, insn.spform.CU);
+      d.op = UOP_SLLI;
+      d.imm = insn.spform.rB;
       break;
-
     // srli[.c] rD, rA, imm5
     case 0x3A:
-      rD = srl(rA, insn.spform.rB, insn.spform.CU);
+      d.op = UOP_SRLI;
+      d.imm = insn.spform.rB;
       break;
     // srai[.c] rD, rA, imm5
     case 0x3B:
-      rD = sra(rA, insn.spform.rB, insn.spform.CU);
+      d.op = UOP_SRAI;
+      d.imm = insn.spform.rB;
       break;
     // rori[.c] rD, rA, imm5
     case 0x3C:
-      rD = ror(rA, insn.spform.rB, insn.spform.CU);
+      d.op = UOP_RORI;
+      d.imm = insn.spform.rB;
       break;
     // roli[.c] rD, rA, imm5
     case 0x3E:
-      rD = rol(rA, insn.spform.rB, insn.spform.CU);
+      d.op = UOP_ROLI;
+      d.imm = insn.spform.rB;
       break;
-    default:
-      debugDump();
     }
   } break;
-  case 0x01: {
-    uint32_t &rD = r[insn.iform.rD];
+  case 0x01:
+  case 0x05: {
+    // OP 0x05 is the same with the immediate in the upper halfword
+    bool upper = (insn.OP == 0x05);
+    d.rD = insn.iform.rD;
+    d.rA = insn.iform.rD;
+    d.cu = insn.iform.CU;
     switch (insn.iform.func3) {
-    // addi[.c] rD, imm16
+    // addi[s][.c] rD, imm16
     case 0x00:
-      rD = add(rD, sign_extend(insn.iform.Imm16, 16), insn.iform.CU);
+      d.op = UOP_ADDI;
+      d.imm = upper ? (insn.iform.Imm16 << 16) : sign_extend(insn.iform.Imm16, 16);
       break;
-    // cmpi.c rD, imm16
+    // cmpi[s].c rD, imm16
     case 0x02:
-      cmp(rD, sign_extend(insn.iform.Imm16, 16), 3, insn.iform.CU);
+      d.op = UOP_CMPI;
+      d.rD = 3;
+      d.imm = upper ? (insn.iform.Imm16 << 16) : sign_extend(insn.iform.Imm16, 16);
       break;
-    // andi.c rD, imm16
+    // andi[s].c rD, imm16
     case 0x04:
-      rD = bit_and(rD, insn.iform.Imm16, insn.iform.CU);
+      d.op = UOP_ANDI;
+      d.imm = upper ? (insn.iform.Imm16 << 16) : insn.iform.Imm16;
       break;
-    // ori.c rD, imm16
+    // ori[s].c rD, imm16
     case 0x05:
-      rD = bit_or(rD, insn.iform.Imm16, insn.iform.CU);
+      d.op = UOP_ORI;
+      d.imm = upper ? (insn.iform.Imm16 << 16) : insn.iform.Imm16;
       break;
-    // ldi rD, imm16
+    // ldi[s] rD, imm16
     case 0x06:
-      rD = sign_extend(insn.iform.Imm16, 16);
+      d.op = UOP_LDI;
+      d.imm = upper ? (insn.iform.Imm16 << 16) : sign_extend(insn.iform.Imm16, 16);
       break;
-
-    default:
-      debugDump();
     }
   } break;
-  case 0x02: {
+  case 0x02:
     // j[l] imm24
-    if (insn.jform.LK)
-      link();
-    uint32_t oldpc = pc;
-    // Update PC
-    pc &= 0xFC000000;
-    pc |= (insn.jform.Disp24 << 1);
-    pc -= 4;
-    //printf("J 0x%08x from 0x%08x\n", pc+4, oldpc);
-  } break;
-  case 0x03: {
-    uint32_t &rD = r[insn.rixform.rD];
-    uint32_t &rA = r[insn.rixform.rA];
-
-    // Pre-increment
-    rA += sign_extend(insn.rixform.Imm12, 12);
-    switch (insn.rixform.func3) {
-    // lw rD, [rA, imm12]+
-    case 0x00:
-      rD = read_memU32(rA);
-      break;
-    // lh rD, [rA, imm12]+
-    case 0x01:
-      rD = sign_extend(read_memU16(rA), 16);
-      break;
-    // lhu rD, [rA, imm12]+
-    case 0x02:
-      rD = read_memU16(rA);
-      break;
-    // lb rD, [rA, imm12]+
-    case 0x03:
-      rD = sign_extend(read_memU8(rA), 8);
-      break;
-    // sw rD, [rA, imm12]+
-    case 0x04:
-      write_memU32(rA, rD);
-      break;
-    // sh rD, [rA, imm12]+
-    case 0x05:
-      write_memU16(rA, rD);
-      break;
-    // lbu rD, [rA, imm12]+
-    case 0x06:
-      rD = read_memU8(rA);
-      break;
-    // sb rD, [rA, imm12]+
-    case 0x07:
-      write_memU8(rA, rD);
-      break;
-
-    default:
-      debugDump();
-    }
-  } break;
-  case 0x04: {
+    d.op = UOP_J;
+    d.cu = insn.jform.LK;
+    d.imm = insn.jform.Disp24 << 1;
+    break;
+  case 0x03:
+    // l*/s* rD, [rA, imm12]+
+    d.op = UOP_LW_PRE + insn.rixform.func3;
+    d.rD = insn.rixform.rD;
+    d.rA = insn.rixform.rA;
+    d.imm = sign_extend(insn.rixform.Imm12, 12);
+    break;
+  case 0x04:
     // b{cond}[l]
-    if (conditional(insn.bcform.BC)) {
-      if (insn.bcform.LK)
-        link();
-      //	uint32_t oldpc = pc;
-      pc += sign_extend(
-                ((insn.bcform.Disp18_9 << 9) | insn.bcform.Disp8_0) << 1, 20) -
-            4;
-      //	printf("Bc 0x%08x from 0x%08x\n", pc+4, oldpc);
-    }
-  } break;
-  case 0x05: {
-    uint32_t &rD = r[insn.iform.rD];
-    uint32_t imm16 = insn.iform.Imm16 << 16;
-    switch (insn.iform.func3) {
-    // addis[.c] rD, imm16
-    case 0x00:
-      rD = add(rD, imm16, insn.iform.CU);
-      break;
-    // cmpis.c rD, imm16
-    case 0x02:
-      cmp(rD, imm16, 3, insn.iform.CU);
-      break;
-    // andis.c rD, imm16
-    case 0x04:
-      rD = bit_and(rD, imm16, insn.iform.CU);
-      break;
-    // oris.c rD, imm16
-    case 0x05:
-      rD = bit_or(rD, imm16, insn.iform.CU);
-      break;
-    // ldis rD, imm16
-    case 0x06:
-      rD = imm16;
-      break;
-
-    default:
-      debugDump();
-    }
-  } break;
-  case 0x06: {
-    uint32_t &rD = r[insn.crform.rD];
-    uint32_t &crA = cr[insn.crform.crA];
+    d.op = UOP_BC;
+    d.rB = insn.bcform.BC;
+    d.cu = insn.bcform.LK;
+    d.imm = sign_extend(((insn.bcform.Disp18_9 << 9) | insn.bcform.Disp8_0) << 1, 20) - 4;
+    break;
+  case 0x06:
+    d.rD = insn.crform.rD;
+    d.rA = insn.crform.crA;
     switch (insn.crform.CR_OP) {
     // mtcr rD, crA
     case 0x00:
-      crA = rD;
+      d.op = UOP_MTCR;
       break;
     // mfcr rD, crA
     case 0x01:
-      rD = crA;
+      d.op = UOP_MFCR;
       break;
     // rte
     case 0x84:
-      if (last_ien)
-        cr0 |= 0x1;
-      branch(cr5 - 4, false); /* TODO: missing PSR */
+      d.op = UOP_RTE;
       break;
-
-    default:
-      debugDump();
     }
-  } break;
-  case 0x07: {
-    uint32_t &rD = r[insn.rixform.rD];
-    uint32_t &rA = r[insn.rixform.rA];
-    switch (insn.rixform.func3) {
-    // lw rD, [rA]+, imm12
-    case 0x00:
-      rD = read_memU32(rA);
-      break;
-    // lh rD, [rA]+, imm12
-    case 0x01:
-      rD = sign_extend(read_memU16(rA), 16);
-      break;
-    // lhu rD, [rA]+, imm12
-    case 0x02:
-      rD = read_memU16(rA);
-      break;
-    // lb rD, [rA]+, imm12
-    case 0x03:
-      rD = sign_extend(read_memU8(rA), 8);
-      break;
-    // sw rD, [rA]+, imm12
-    case 0x04:
-      write_memU32(rA, rD);
-      break;
-    // sh rD, [rA]+, imm12
-    case 0x05:
-      write_memU16(rA, rD);
-      break;
-    // lbu rD, [rA]+, imm12
-    case 0x06:
-      rD = read_memU8(rA);
-      break;
-    // sb rD, [rA]+, imm12
-    case 0x07:
-      write_memU8(rA, rD);
-      break;
-
-    default:
-      debugDump();
-    }
-    // Post-increment
-    rA += sign_extend(insn.rixform.Imm12, 12);
-  } break;
-  case 0x08: {
+    break;
+  case 0x07:
+    // l*/s* rD, [rA]+, imm12
+    d.op = UOP_LW_POST + insn.rixform.func3;
+    d.rD = insn.rixform.rD;
+    d.rA = insn.rixform.rA;
+    d.imm = sign_extend(insn.rixform.Imm12, 12);
+    break;
+  case 0x08:
     // addri[.c] rD, rA, imm14
-    uint32_t &rD = r[insn.riform.rD];
-    uint32_t &rA = r[insn.riform.rA];
-    uint32_t imm14 = sign_extend(insn.riform.Imm14, 14);
-
-    rD = add(rA, imm14, insn.riform.CU);
-  } break;
-  case 0x0C: {
-    // andri[.c] rD, rA, imm14
-    uint32_t &rD = r[insn.riform.rD];
-    uint32_t &rA = r[insn.riform.rA];
-    uint32_t imm14 = insn.riform.Imm14;
-
-    rD = bit_and(rA, imm14, insn.riform.CU);
-  } break;
-  case 0x0D: {
-    // orri[.c] rD, rA, imm14
-    uint32_t &rD = r[insn.riform.rD];
-    uint32_t &rA = r[insn.riform.rA];
-    uint32_t imm14 = insn.riform.Imm14;
-
-    rD = bit_or(rA, imm14, insn.riform.CU);
-  } break;
-  case 0x10: {
-    // lw rD, [rA, imm15]
-    uint32_t &rD = r[insn.mform.rD];
-    uint32_t &rA = r[insn.mform.rA];
-    uint32_t imm15 = sign_extend(insn.mform.Imm15, 15);
-
-    rD = read_memU32(rA + imm15);
-  } break;
-  case 0x11: {
-    // lh rD, [rA, imm15]
-    uint32_t &rD = r[insn.mform.rD];
-    uint32_t &rA = r[insn.mform.rA];
-    uint32_t imm15 = sign_extend(insn.mform.Imm15, 15);
-
-    rD = sign_extend(read_memU16(rA + imm15), 16);
-  } break;
-  case 0x12: {
-    // lhu rD, [rA, imm15]
-    uint32_t &rD = r[insn.mform.rD];
-    uint32_t &rA = r[insn.mform.rA];
-    uint32_t imm15 = sign_extend(insn.mform.Imm15, 15);
-
-    rD = read_memU16(rA + imm15);
-  } break;
-  case 0x13: {
-    // lb rD, [rA, imm15]
-    uint32_t &rD = r[insn.mform.rD];
-    uint32_t &rA = r[insn.mform.rA];
-    uint32_t imm15 = sign_extend(insn.mform.Imm15, 15);
-
-    rD = sign_extend(read_memU8(rA + imm15), 8);
-  } break;
-  case 0x14: {
-    // sw rD, [rA, imm15]
-    uint32_t &rD = r[insn.mform.rD];
-    uint32_t &rA = r[insn.mform.rA];
-    uint32_t imm15 = sign_extend(insn.mform.Imm15, 15);
-    //	printf("w 0x%08x at 0x%08x!\n",rA + imm15,pc);
-    write_memU32(rA + imm15, rD);
-  } break;
-  case 0x15: {
-    // sh rD, [rA, imm15]
-    uint32_t &rD = r[insn.mform.rD];
-    uint32_t &rA = r[insn.mform.rA];
-    uint32_t imm15 = sign_extend(insn.mform.Imm15, 15);
-
-    write_memU16(rA + imm15, rD);
-  } break;
-  case 0x16: {
-    // lbu rD, [rA, imm15]
-    uint32_t &rD = r[insn.mform.rD];
-    uint32_t &rA = r[insn.mform.rA];
-    uint32_t imm15 = sign_extend(insn.mform.Imm15, 15);
-
-    rD = read_memU8(rA + imm15);
-  } break;
-  case 0x17: {
-    // sb rD, [rA, imm15]
-    uint32_t &rD = r[insn.mform.rD];
-    uint32_t &rA = r[insn.mform.rA];
-    uint32_t imm15 = sign_extend(insn.mform.Imm15, 15);
-
-    write_memU8(rA + imm15, rD);
-  } break;
+    d.op = UOP_ADDI;
+    d.rD = insn.riform.rD;
+    d.rA = insn.riform.rA;
+    d.cu = insn.riform.CU;
+    d.imm = sign_extend(insn.riform.Imm14, 14);
+    break;
+  case 0x0C:
+  case 0x0D:
+    // andri[.c]/orri[.c] rD, rA, imm14
+    d.op = (insn.OP == 0x0C) ? UOP_ANDI : UOP_ORI;
+    d.rD = insn.riform.rD;
+    d.rA = insn.riform.rA;
+    d.cu = insn.riform.CU;
+    d.imm = insn.riform.Imm14;
+    break;
+  case 0x10:
+  case 0x11:
+  case 0x12:
+  case 0x13:
+  case 0x14:
+  case 0x15:
+  case 0x16:
+  case 0x17:
+    // l*/s* rD, [rA, imm15]
+    d.op = UOP_LW + (insn.OP - 0x10);
+    d.rD = insn.mform.rD;
+    d.rA = insn.mform.rA;
+    d.imm = sign_extend(insn.mform.Imm15, 15);
+    break;
   case 0x18:
     // cache op, [rA, imm15]
+    d.op = UOP_CACHE;
+    d.rA = insn.mform.rA;
+    d.imm = sign_extend(insn.mform.Imm15, 15);
     break;
-  default:
-    debugDump();
   }
 }
 
-void CPU::exec16(Instruction16 insn) {
+void CPU::decode16(Instruction16 insn, DecodedInsn &d) {
+  d = DecodedInsn();
+  d.op = UOP_INVALID;
+  d.len = 2;
+  d.cu = 1;
   switch (insn.OP) {
   case 0x00:
+    d.rD = insn.rform.rD;
+    d.rA = insn.rform.rA;
     switch (insn.rform.func4) {
     // nop!
-    case 0x00: /* noting */
+    case 0x00:
+      d.op = UOP_NOP;
       break;
     // mlfh! rDg0, rAg1
     case 0x01:
-      g0[insn.rform.rD] = g1[insn.rform.rA];
+      d.op = UOP_MV;
+      d.rA += 16;
       break;
     // mhfl! rDg1, rAg0
     case 0x02:
-      g1[insn.rform.rD] = g0[insn.rform.rA];
+      d.op = UOP_MV;
+      d.rD += 16;
       break;
     // mv! rDg0, rAg0
     case 0x03:
-      g0[insn.rform.rD] = g0[insn.rform.rA];
+      d.op = UOP_MV;
       break;
     // br{cond}! rAg0
     case 0x04:
-      if (conditional(insn.rform.rD))
-        branch(g0[insn.rform.rA] - 2, false);
+      d.op = UOP_BR16;
+      d.rB = insn.rform.rD;
       break;
     // t{cond}!
     case 0x05:
-      T = conditional(insn.rform.rD);
+      d.op = UOP_TCOND;
+      d.rB = insn.rform.rD;
       break;
-    // sll!
+    // sll!, srl!, sra! rDg0, rAg0
     case 0x08:
-      g0[insn.rform.rD] = sll(g0[insn.rform.rD], g0[insn.rform.rA] & 0x1F, true);
-      break;
-    // addc!
-    case 0x09:
-      g0[insn.rform.rD] = addc(g0[insn.rform.rA], g0[insn.rform.rD], true);
-      break;
-    // srl!
     case 0x0A:
-      g0[insn.rform.rD] = srl(g0[insn.rform.rD], g0[insn.rform.rA] & 0x1F, true);
-      break;
-    // sra!
     case 0x0B:
-      g0[insn.rform.rD] = sra(g0[insn.rform.rD], g0[insn.rform.rA] & 0x1F, true);
+      d.op = (insn.rform.func4 == 0x08) ? UOP_SLL : (insn.rform.func4 == 0x0A) ? UOP_SRL : UOP_SRA;
+      d.rA = insn.rform.rD;
+      d.rB = insn.rform.rA;
+      break;
+    // addc! rDg0, rAg0
+    case 0x09:
+      d.op = UOP_ADDC;
+      d.rB = insn.rform.rD;
       break;
     // br{cond}l! rAg0
     case 0x0C:
-      if (conditional(insn.rform.rD)) {
-        link16();
-        branch(g0[insn.rform.rA] - 2, false);
-      };
+      d.op = UOP_BRL16;
+      d.rB = insn.rform.rD;
       break;
-    default:
-      debugDump();
     }
     break;
-  case 0x01: {
-    uint32_t &rA = g0[insn.rform.rA];
-    //				uint32_t &rD = g0[insn.rform.rD];
-    switch (insn.rform.func4) {
-    // mtce{lh}! rA
-    case 0x00:
-      switch (insn.rform.rD) {
-      case 0x00:
-        CEL = rA;
-        break;
-      case 0x01:
-        CEH = rA;
-        break;
-      }
-      break;
-    // mfce{lh}! rA
-    case 0x01:
-      switch (insn.rform.rD) {
-      case 0x00:
-        rA = CEL;
-        break;
-      case 0x01:
-        rA = CEH;
-        break;
-      }
-      break;
-
-    default:
-      debugDump();
+  case 0x01:
+    // mtce{lh}! rA / mfce{lh}! rA
+    if (insn.rform.func4 <= 0x01) {
+      d.op = (insn.rform.func4 == 0x00) ? UOP_MTCE : UOP_MFCE;
+      d.rD = insn.rform.rA;
+      d.rB = (insn.rform.rD == 0x00) ? 0x01 : (insn.rform.rD == 0x01) ? 0x02 : 0x00;
     }
-  } break;
-  case 0x02: {
-    uint32_t &rA = g0[insn.rform.rA];
-    uint32_t &rD = g0[insn.rform.rD];
-    uint32_t &rAh = g0[insn.rhform.rA];
-    uint32_t &rDh = g[insn.rhform.H][insn.rhform.rD];
+    break;
+  case 0x02:
+    d.rD = insn.rform.rD;
+    d.rA = insn.rform.rD;
+    d.rB = insn.rform.rA;
     switch (insn.rform.func4) {
     // add! rDg0, rAg0
     case 0x00:
-      rD = add(rD, rA, true);
+      d.op = UOP_ADD;
       break;
     // sub! rDg0, rAg0
     case 0x01:
-      rD = sub(rD, rA, true);
+      d.op = UOP_SUB;
       break;
     // neg! rDg0, rAg0
     case 0x02:
-      rD = sub(0, rA, true);
+      d.op = UOP_NEG;
       break;
     // cmp! rDg0, rAg0
     case 0x03:
-      sub(rD, rA, true); /*printf("cmp %08x %08x at %08x\n",rD,rA,pc);*/
+      d.op = UOP_CMP;
+      d.rD = 3;
       break;
     // and! rDg0, rAg0
     case 0x04:
-      rD = bit_and(rD, rA, true);
+      d.op = UOP_AND;
       break;
     // or! rDg0, rAg0
     case 0x05:
-      rD = bit_or(rD, rA, true);
+      d.op = UOP_OR;
       break;
     // not! rDg0, rAg0
     case 0x06:
-      rD = bit_xor(rA, ~0, true);
+      d.op = UOP_XORI;
+      d.rA = insn.rform.rA;
+      d.imm = ~0U;
       break;
     // xor! rDg0, rAg0
     case 0x07:
-      rD = bit_xor(rD, rA, true);
+      d.op = UOP_XOR;
       break;
-    // lw! rDg0, [rAg0]
+    // lw!, lh!, lbu!, sw!, sh!, sb! rDg0, [rAg0]
     case 0x08:
-      rD = read_memU32(rA);
-      break;
-    // lh! rDg0, [rAg0]
     case 0x09:
-      rD = sign_extend(read_memU16(rA), 16);
-      break;
-    // pop! rDgh, [rAg0]
-    case 0x0A:
-      rDh = read_memU32(rAh);
-      rAh += 4;
-      break;
-    // lbu! rDg0, [rAg0]
     case 0x0B:
-      rD = read_memU8(rA);
-      break;
-    // sw! rDg0, [rAg0]
     case 0x0C:
-      write_memU32(rA, rD);
-      break;
-    // sh! rDg0, [rAg0]
     case 0x0D:
-      write_memU16(rA, rD);
+    case 0x0F: {
+      static const uint8_t ops[] = {UOP_LW, UOP_LH, 0, UOP_LBU, UOP_SW, UOP_SH, 0, UOP_SB};
+      d.op = ops[insn.rform.func4 - 0x08];
+      d.rA = insn.rform.rA;
+      d.imm = 0;
+    } break;
+    // pop! rDgh, [rAg0]
+    case 0x0A:
+      d.op = UOP_LW_POST;
+      d.rD = insn.rhform.H * 16 + insn.rhform.rD;
+      d.rA = insn.rhform.rA;
+      d.imm = 4;
       break;
     // push! rDgh, [rAg0]
     case 0x0E:
-      rAh -= 4;
-      write_memU32(rAh, rDh);
-      break;
-    // sb! rDg0, [rAg0]
-    case 0x0F:
-      write_memU8(rA, rD);
+      d.op = UOP_SW_PRE;
+      d.rD = insn.rhform.H * 16 + insn.rhform.rD;
+      d.rA = insn.rhform.rA;
+      d.imm = uint32_t(-4);
       break;
     }
-  } break;
-  case 0x03: {
+    break;
+  case 0x03:
     // j[l]! imm11
-    if (insn.jform.LK)
-      link16();
-
-    pc &= 0xFFFFF000;
-    pc |= (insn.jform.Disp11 << 1);
-    pc -= 2;
-  } break;
-  case 0x04: {
+    d.op = UOP_J16;
+    d.cu = insn.jform.LK;
+    d.imm = insn.jform.Disp11 << 1;
+    break;
+  case 0x04:
     // b{cond}! imm8
-    if (conditional(insn.bxform.EC))
-      pc += (sign_extend(insn.bxform.Imm8, 8) << 1) - 2;
-  } break;
+    d.op = UOP_BC;
+    d.cu = 0;
+    d.rB = insn.bxform.EC;
+    d.imm = (uint32_t(sign_extend(insn.bxform.Imm8, 8)) << 1) - 2;
+    break;
   case 0x05:
     // ldiu! imm8
-    g0[insn.iform2.rD] = insn.iform2.Imm8;
+    d.op = UOP_LDI;
+    d.rD = insn.iform2.rD;
+    d.imm = insn.iform2.Imm8;
     break;
   case 0x06: {
-    uint32_t &rD = g0[insn.iform1.rD];
-    uint32_t imm = 1 << insn.iform1.Imm5;
+    uint32_t imm = 1U << insn.iform1.Imm5;
+    d.rD = insn.iform1.rD;
+    d.rA = insn.iform1.rD;
     switch (insn.iform1.func3) {
     // subei! rD, imm5 / addei! rD, imm5
-    case 0x00: {
-      uint32_t imm4 = 1 << (insn.iform1.Imm5 & 0xF);
-      if (insn.iform1.Imm5 & 0x10)
-        rD = sub(rD, imm4, true);
-      else
-        rD = add(rD, imm4, true);
-    }
-    break;
+    case 0x00:
+      d.op = (insn.iform1.Imm5 & 0x10) ? UOP_SUBI : UOP_ADDI;
+      d.imm = 1U << (insn.iform1.Imm5 & 0xF);
+      break;
     // slli! rD, imm5
     case 0x01:
-      rD = sll(rD, insn.iform1.Imm5, true);
+      d.op = UOP_SLLI;
+      d.imm = insn.iform1.Imm5;
       break;
     // srli! rD, imm5
     case 0x03:
-      rD = srl(rD, insn.iform1.Imm5, true);
+      d.op = UOP_SRLI;
+      d.imm = insn.iform1.Imm5;
       break;
     // bitclr! rD, imm5
     case 0x04:
-      rD = bit_and(rD, ~imm, true);
+      d.op = UOP_ANDI;
+      d.imm = ~imm;
       break;
     // bitset! rD, imm5
     case 0x05:
-      rD = bit_or(rD, imm, true);
+      d.op = UOP_ORI;
+      d.imm = imm;
       break;
     // bittst! rD, imm5
     case 0x06:
-      bit_and(rD, imm, true);
+      d.op = UOP_TSTI;
+      d.imm = imm;
       break;
     // bittgt! rD, imm5
     case 0x07:
-      rD = bit_xor(rD, imm, true);
+      d.op = UOP_XORI;
+      d.imm = imm;
       break;
-    default:
-      debugDump();
     }
   } break;
   case 0x07: {
-    uint32_t &rD = g0[insn.iform1.rD];
-    uint32_t imm = insn.iform1.Imm5 /* << 2*/;
+    uint32_t imm = insn.iform1.Imm5;
+    d.rD = insn.iform1.rD;
+    d.rA = 2;
     switch (insn.iform1.func3) {
     // lwp! rDg0, imm
     case 0x00:
-      rD = read_memU32(r2 + (imm << 2));
+      d.op = UOP_LW;
+      d.imm = imm << 2;
       break;
     // lhp! rDg0, imm
     case 0x01:
-      rD = sign_extend(read_memU16(r2 + (imm << 1)), 16);
+      d.op = UOP_LH;
+      d.imm = imm << 1;
       break;
     // lbup! rDg0, imm
     case 0x03:
-      rD = read_memU8(r2 + imm);
+      d.op = UOP_LBU;
+      d.imm = imm;
       break;
     // swp! rDg0, imm
     case 0x04:
-      write_memU32(r2 + (imm << 2), rD);
+      d.op = UOP_SW;
+      d.imm = imm << 2;
       break;
     // shp! rDg0, imm
     case 0x05:
-      write_memU16(r2 + (imm << 1), rD);
+      d.op = UOP_SH;
+      d.imm = imm << 1;
       break;
-
     // sbp! rDg0, imm
     case 0x07:
-      write_memU8(r2 + imm, rD);
+      d.op = UOP_SB;
+      d.imm = imm;
       break;
-
-    default:
-      debugDump();
     }
   } break;
+  }
+}
+
+template <int Func> void CPU::mem_op(uint8_t rD, uint32_t addr) {
+  switch (Func) {
+  // lw
+  case 0x00:
+    r[rD] = read_memU32(addr);
+    break;
+  // lh
+  case 0x01:
+    r[rD] = sign_extend(read_memU16(addr), 16);
+    break;
+  // lhu
+  case 0x02:
+    r[rD] = read_memU16(addr);
+    break;
+  // lb
+  case 0x03:
+    r[rD] = sign_extend(read_memU8(addr), 8);
+    break;
+  // sw
+  case 0x04:
+    write_memU32(addr, r[rD]);
+    break;
+  // sh
+  case 0x05:
+    write_memU16(addr, r[rD]);
+    break;
+  // lbu
+  case 0x06:
+    r[rD] = read_memU8(addr);
+    break;
+  // sb
+  case 0x07:
+    write_memU8(addr, r[rD]);
+    break;
+  }
+}
+
+// Handlers are selected by (op << 1) | cu. Ops in SPLIT_OPS get a separate
+// handler for each value of the .c (or link) bit, with F as a compile time
+// constant, the rest share one handler
+#define SPLIT_OPS(X)                                                           \
+  X(UOP_ADD) X(UOP_ADDC) X(UOP_SUB) X(UOP_SUBC) X(UOP_NEG) X(UOP_AND)          \
+  X(UOP_OR) X(UOP_XOR) X(UOP_ADDI) X(UOP_SUBI) X(UOP_ANDI) X(UOP_ORI)          \
+  X(UOP_XORI) X(UOP_TSTI) X(UOP_CMP) X(UOP_CMPI) X(UOP_SLL) X(UOP_SRL)         \
+  X(UOP_SRA) X(UOP_ROR) X(UOP_ROL) X(UOP_SLLI) X(UOP_SRLI) X(UOP_SRAI)         \
+  X(UOP_RORI) X(UOP_ROLI) X(UOP_EXTSB) X(UOP_EXTSH) X(UOP_BR) X(UOP_J)         \
+  X(UOP_J16) X(UOP_BC) X(UOP_LDI_ORI) X(UOP_LDI_ADDI)
+#define PLAIN_OPS(X)                                                           \
+  X(UOP_INVALID) X(UOP_NOP) X(UOP_PCE) X(UOP_LDI) X(UOP_MUL) X(UOP_MULU)       \
+  X(UOP_DIV) X(UOP_DIVU) X(UOP_MFCE) X(UOP_MTCE) X(UOP_MFSR) X(UOP_MTSR)       \
+  X(UOP_MFCR) X(UOP_MTCR) X(UOP_TCOND) X(UOP_MV) X(UOP_MVCOND) X(UOP_BR16)     \
+  X(UOP_BRL16) X(UOP_RTE) X(UOP_LW) X(UOP_LH) X(UOP_LHU) X(UOP_LB) X(UOP_SW)   \
+  X(UOP_SH) X(UOP_LBU) X(UOP_SB) X(UOP_LW_PRE) X(UOP_LH_PRE) X(UOP_LHU_PRE)    \
+  X(UOP_LB_PRE) X(UOP_SW_PRE) X(UOP_SH_PRE) X(UOP_LBU_PRE) X(UOP_SB_PRE)       \
+  X(UOP_LW_POST) X(UOP_LH_POST) X(UOP_LHU_POST) X(UOP_LB_POST)                 \
+  X(UOP_SW_POST) X(UOP_SH_POST) X(UOP_LBU_POST) X(UOP_SB_POST) X(UOP_CACHE)   \
+  X(UOP_CMP_BC) X(UOP_CMPI_BC) X(UOP_LW_SW_POST)
+
+#if defined(__GNUC__)
+// Threaded dispatch using the labels as values extension
+#define CPU_COMPUTED_GOTO
+#define HANDLER(op, c) h_##op##_##c:
+#define PLAIN_HANDLER(op) h_##op:
+#define DISPATCH() goto *targets[(d->op << 1) | d->cu]
+#else
+#define HANDLER(op, c) case (op << 1) | c: h_##op##_##c:
+#define PLAIN_HANDLER(op) case op << 1: case (op << 1) | 1: h_##op:
+#define DISPATCH() goto dispatch
+#endif
+
+#define SPLIT_HANDLER(op, ...)                                                 \
+  HANDLER(op, 0) {                                                             \
+    constexpr bool F = false;                                                  \
+    (void)F;                                                                   \
+    __VA_ARGS__;                                                               \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(op, 1) {                                                             \
+    constexpr bool F = true;                                                   \
+    (void)F;                                                                   \
+    __VA_ARGS__;                                                               \
+  }                                                                            \
+  NEXT();
+
+// Advance PC past the current instruction and run the next one
+#define NEXT()                                                                 \
+  do {                                                                         \
+    pc += len;                                                                 \
+    count++;                                                                   \
+    if (++insn == end)                                                         \
+      return count;                                                            \
+    d = insn;                                                                  \
+    len = d->len;                                                              \
+    if (len == 2)                                                              \
+      isPCE = false;                                                           \
+    DISPATCH();                                                                \
+  } while (0)
+
+// Stop early after the current instruction
+#define STOP()                                                                 \
+  do {                                                                         \
+    pc += len;                                                                 \
+    return count + 1;                                                          \
+  } while (0)
+
+// Stores may have overwritten the rest of the block
+#define NEXT_STORE()                                                           \
+  do {                                                                         \
+    if (codeInvalidated)                                                       \
+      STOP();                                                                  \
+    NEXT();                                                                    \
+  } while (0)
+
+// Fused pairs run both instructions and move on past them. When the range
+// ends after the first, as it does for a single step, that runs alone
+// through its usual handler
+#define FUSED(single)                                                          \
+  if (insn + 1 == end)                                                         \
+    goto single;                                                               \
+  n = insn + 1;
+
+#define NEXT_PAIR()                                                            \
+  do {                                                                         \
+    pc += len + n->len;                                                        \
+    count += 2;                                                                \
+    if ((insn += 2) == end)                                                    \
+      return count;                                                            \
+    d = insn;                                                                  \
+    len = d->len;                                                              \
+    if (len == 2 || n->len == 2)                                               \
+      isPCE = false;                                                           \
+    DISPATCH();                                                                \
+  } while (0)
+
+#define NEXT_PAIR_STORE()                                                      \
+  do {                                                                         \
+    if (codeInvalidated) {                                                     \
+      pc += len + n->len;                                                      \
+      return count + 2;                                                        \
+    }                                                                          \
+    NEXT_PAIR();                                                               \
+  } while (0)
+
+#define MEM_HANDLERS(op, func, next)                                           \
+  PLAIN_HANDLER(op)                                                            \
+  mem_op<func>(d->rD, r[d->rA] + d->imm);                                      \
+  next();                                                                      \
+  PLAIN_HANDLER(op##_PRE)                                                      \
+  r[d->rA] += d->imm;                                                          \
+  mem_op<func>(d->rD, r[d->rA]);                                               \
+  next();                                                                      \
+  PLAIN_HANDLER(op##_POST)                                                     \
+  mem_op<func>(d->rD, r[d->rA]);                                               \
+  r[d->rA] += d->imm;                                                          \
+  next();
+
+int CPU::execute(const DecodedInsn *insn, const DecodedInsn *end) {
+#ifdef CPU_COMPUTED_GOTO
+  static const void *targets[UOP_COUNT << 1];
+  static bool targetsInit = false;
+  if (!targetsInit) {
+    std::fill(targets, targets + (UOP_COUNT << 1), &&h_UOP_INVALID);
+#define SET_SPLIT(op)                                                          \
+  targets[op << 1] = &&h_##op##_0;                                             \
+  targets[(op << 1) | 1] = &&h_##op##_1;
+#define SET_PLAIN(op) targets[op << 1] = targets[(op << 1) | 1] = &&h_##op;
+    SPLIT_OPS(SET_SPLIT)
+    PLAIN_OPS(SET_PLAIN)
+#undef SET_SPLIT
+#undef SET_PLAIN
+    targetsInit = true;
+  }
+#endif
+  int count = 0;
+  const DecodedInsn *d = insn, *n;
+  uint32_t len = d->len;
+  if (len == 2)
+    isPCE = false;
+  DISPATCH();
+
+#ifndef CPU_COMPUTED_GOTO
+dispatch:
+  switch ((d->op << 1) | d->cu) {
   default:
-    debugDump();
+#endif
+  PLAIN_HANDLER(UOP_INVALID)
+  debugDump();
+  NEXT();
+  PLAIN_HANDLER(UOP_NOP)
+  NEXT();
+  PLAIN_HANDLER(UOP_PCE)
+  // Run the half selected by T, advancing PC by the whole pair
+  isPCE = true;
+  len = 4;
+  d = &d->pce[T ? 1 : 0];
+  DISPATCH();
+  SPLIT_HANDLER(UOP_ADD, r[d->rD] = add<F>(r[d->rA], r[d->rB]))
+  SPLIT_HANDLER(UOP_ADDC, r[d->rD] = addc<F>(r[d->rA], r[d->rB]))
+  SPLIT_HANDLER(UOP_SUB, r[d->rD] = sub<F>(r[d->rA], r[d->rB]))
+  SPLIT_HANDLER(UOP_SUBC, r[d->rD] = subc<F>(r[d->rA], r[d->rB]))
+  SPLIT_HANDLER(UOP_NEG, r[d->rD] = sub<F>(0, r[d->rB]))
+  SPLIT_HANDLER(UOP_AND, r[d->rD] = bit_and<F>(r[d->rA], r[d->rB]))
+  SPLIT_HANDLER(UOP_OR, r[d->rD] = bit_or<F>(r[d->rA], r[d->rB]))
+  SPLIT_HANDLER(UOP_XOR, r[d->rD] = bit_xor<F>(r[d->rA], r[d->rB]))
+  SPLIT_HANDLER(UOP_ADDI, r[d->rD] = add<F>(r[d->rA], d->imm))
+  SPLIT_HANDLER(UOP_SUBI, r[d->rD] = sub<F>(r[d->rA], d->imm))
+  SPLIT_HANDLER(UOP_ANDI, r[d->rD] = bit_and<F>(r[d->rA], d->imm))
+  SPLIT_HANDLER(UOP_ORI, r[d->rD] = bit_or<F>(r[d->rA], d->imm))
+  SPLIT_HANDLER(UOP_XORI, r[d->rD] = bit_xor<F>(r[d->rA], d->imm))
+  SPLIT_HANDLER(UOP_TSTI, bit_and<F>(r[d->rA], d->imm))
+  PLAIN_HANDLER(UOP_LDI)
+  r[d->rD] = d->imm;
+  NEXT();
+  SPLIT_HANDLER(UOP_CMP, cmp<F>(r[d->rA], r[d->rB], d->rD))
+  SPLIT_HANDLER(UOP_CMPI, cmp<F>(r[d->rA], d->imm, d->rD))
+  SPLIT_HANDLER(UOP_SLL, r[d->rD] = sll<F>(r[d->rA], r[d->rB] & 0x1F))
+  SPLIT_HANDLER(UOP_SRL, r[d->rD] = srl<F>(r[d->rA], r[d->rB] & 0x1F))
+  SPLIT_HANDLER(UOP_SRA, r[d->rD] = sra<F>(r[d->rA], r[d->rB] & 0x1F))
+  SPLIT_HANDLER(UOP_ROR, r[d->rD] = ror<F>(r[d->rA], r[d->rB] & 0x1F))
+  SPLIT_HANDLER(UOP_ROL, r[d->rD] = rol<F>(r[d->rA], r[d->rB] & 0x1F))
+  SPLIT_HANDLER(UOP_SLLI, r[d->rD] = sll<F>(r[d->rA], d->imm))
+  SPLIT_HANDLER(UOP_SRLI, r[d->rD] = srl<F>(r[d->rA], d->imm))
+  SPLIT_HANDLER(UOP_SRAI, r[d->rD] = sra<F>(r[d->rA], d->imm))
+  SPLIT_HANDLER(UOP_RORI, r[d->rD] = ror<F>(r[d->rA], d->imm))
+  SPLIT_HANDLER(UOP_ROLI, r[d->rD] = rol<F>(r[d->rA], d->imm))
+  PLAIN_HANDLER(UOP_MUL)
+  ce_op(r[d->rA], r[d->rB], muls_op);
+  NEXT();
+  PLAIN_HANDLER(UOP_MULU)
+  ce_op(r[d->rA], r[d->rB], mulu_op);
+  NEXT();
+  PLAIN_HANDLER(UOP_DIV)
+  ce_op(r[d->rA], r[d->rB], divs_op);
+  NEXT();
+  PLAIN_HANDLER(UOP_DIVU)
+  ce_op(r[d->rA], r[d->rB], divu_op);
+  NEXT();
+  PLAIN_HANDLER(UOP_MFCE)
+  switch (d->rB) {
+  case 0x01:
+    r[d->rD] = CEL;
+    break;
+  case 0x02:
+    r[d->rD] = CEH;
+    break;
+  case 0x03:
+    r[d->rD] = CEH;
+    r[d->rA] = CEL;
+    break;
+  }
+  NEXT();
+  PLAIN_HANDLER(UOP_MTCE)
+  switch (d->rB) {
+  case 0x01:
+    CEL = r[d->rD];
+    break;
+  case 0x02:
+    CEH = r[d->rD];
+    break;
+  case 0x03:
+    CEH = r[d->rD];
+    CEL = r[d->rA];
+    break;
+  }
+  NEXT();
+  PLAIN_HANDLER(UOP_MFSR)
+  r[d->rD] = sr[d->rB];
+  NEXT();
+  PLAIN_HANDLER(UOP_MTSR)
+  sr[d->rB] = r[d->rA];
+  NEXT();
+  PLAIN_HANDLER(UOP_MFCR)
+  if (d->rA == 1)
+    sync_flags();
+  r[d->rD] = cr[d->rA];
+  NEXT();
+  PLAIN_HANDLER(UOP_MTCR)
+  cr[d->rA] = r[d->rD];
+  // Anything pending would overwrite the new flags
+  if (d->rA == 1)
+    lazyFlags = 0;
+  // Give a pending interrupt the chance to fire if this enabled them
+  if (d->rA == 0)
+    STOP();
+  NEXT();
+  PLAIN_HANDLER(UOP_TCOND)
+  T = conditional(d->rB);
+  NEXT();
+  PLAIN_HANDLER(UOP_MV)
+  r[d->rD] = r[d->rA];
+  NEXT();
+  PLAIN_HANDLER(UOP_MVCOND)
+  if (conditional(d->rB))
+    r[d->rD] = r[d->rA];
+  NEXT();
+  SPLIT_HANDLER(UOP_EXTSB, r[d->rD] = sign_extend(r[d->rA], 8); if (F) basic_flags(r[d->rD]))
+  SPLIT_HANDLER(UOP_EXTSH, r[d->rD] = sign_extend(r[d->rA], 16); if (F) basic_flags(r[d->rD]))
+  SPLIT_HANDLER(UOP_BR, if (conditional(d->rB)) branch(r[d->rA] - 4, F))
+  PLAIN_HANDLER(UOP_BR16)
+  if (conditional(d->rB))
+    branch(r[d->rA] - 2, false);
+  NEXT();
+  PLAIN_HANDLER(UOP_BRL16)
+  if (conditional(d->rB)) {
+    link16();
+    branch(r[d->rA] - 2, false);
+  }
+  NEXT();
+  SPLIT_HANDLER(UOP_J, if (F) link(); pc &= 0xFC000000; pc |= d->imm; pc -= 4)
+  SPLIT_HANDLER(UOP_J16, if (F) link16(); pc &= 0xFFFFF000; pc |= d->imm; pc -= 2)
+  SPLIT_HANDLER(UOP_BC, if (conditional(d->rB)) {
+    if (F)
+      link();
+    pc += d->imm;
+  })
+  PLAIN_HANDLER(UOP_RTE)
+  if (last_ien)
+    cr0 |= 0x1;
+  branch(cr5 - 4, false); /* TODO: missing PSR */
+  NEXT();
+  MEM_HANDLERS(UOP_LW, 0, NEXT)
+  MEM_HANDLERS(UOP_LH, 1, NEXT)
+  MEM_HANDLERS(UOP_LHU, 2, NEXT)
+  MEM_HANDLERS(UOP_LB, 3, NEXT)
+  MEM_HANDLERS(UOP_SW, 4, NEXT_STORE)
+  MEM_HANDLERS(UOP_SH, 5, NEXT_STORE)
+  MEM_HANDLERS(UOP_LBU, 6, NEXT)
+  MEM_HANDLERS(UOP_SB, 7, NEXT_STORE)
+  PLAIN_HANDLER(UOP_CACHE) {
+    // Treat any cache op as a hint that code in the line may have changed
+    uint32_t addr = r[d->rA] + d->imm;
+    if ((addr & 0xFC000000) == 0xA0000000 || (addr & 0xFC000000) == 0x80000000)
+      code_written((addr & 0x03FFFFFF) >> CODE_PAGE_SHIFT);
+    else if ((addr & 0xDF000000) == 0x9F000000)
+      code_written(RAM_CODE_PAGES + ((addr & 0x00FFFFFF) >> CODE_PAGE_SHIFT));
+  }
+  NEXT_STORE();
+  // cmp[i].c then bc, without link
+  PLAIN_HANDLER(UOP_CMP_BC)
+  FUSED(h_UOP_CMP_1)
+  cmp<true>(r[d->rA], r[d->rB], d->rD);
+  if (conditional(n->rB))
+    pc += n->imm;
+  NEXT_PAIR();
+  PLAIN_HANDLER(UOP_CMPI_BC)
+  FUSED(h_UOP_CMPI_1)
+  cmp<true>(r[d->rA], d->imm, d->rD);
+  if (conditional(n->rB))
+    pc += n->imm;
+  NEXT_PAIR();
+  // ldi[s] then ori/addri into the same register, building a constant. The
+  // pair is split on the .c bit of the second
+  SPLIT_HANDLER(UOP_LDI_ORI, FUSED(h_UOP_LDI) r[d->rD] = bit_or<F>(d->imm, n->imm); NEXT_PAIR())
+  SPLIT_HANDLER(UOP_LDI_ADDI, FUSED(h_UOP_LDI) r[d->rD] = add<F>(d->imm, n->imm); NEXT_PAIR())
+  // lw then sw of the same register with post increment, as in copy loops
+  PLAIN_HANDLER(UOP_LW_SW_POST)
+  FUSED(h_UOP_LW_POST)
+  r[d->rD] = read_memU32(r[d->rA]);
+  r[d->rA] += d->imm;
+  write_memU32(r[n->rA], r[n->rD]);
+  r[n->rA] += n->imm;
+  NEXT_PAIR_STORE();
+#ifndef CPU_COMPUTED_GOTO
   }
+#endif
+}
+
+void CPU::execute_one(CPU *cpu, const DecodedInsn *insn) {
+  cpu->execute(insn, insn + 1);
+  cpu->sync_flags();
 }
 
 bool CPU::conditional(uint8_t pattern) {
+  // Evaluate straight from any pending flags, leaving them pending
+  bool N = this->N, Z = this->Z, C = this->C, V = this->V;
+  if (lazyFlags & LAZY_NZ) {
+    N = (lazyRes >> 31);
+    Z = (lazyRes == 0);
+  }
+  if (lazyFlags & LAZY_CV) {
+    C = lazy_c();
+    V = lazy_v();
+  }
   switch (pattern) {
   case 0x0:
     return C;
@@ -1056,21 +1312,60 @@ bool CPU::conditional(uint8_t pattern) {
 }
 
 void CPU::basic_flags(uint32_t res) {
-  N = (res >> 31);
-  Z = (res == 0);
+  lazyRes = res;
+  lazyFlags |= LAZY_NZ;
+}
+
+void CPU::lazy_cv(uint8_t op, uint32_t a, uint32_t b, uint32_t res) {
+  lazyOp = op;
+  lazyA = a;
+  lazyB = b;
+  lazyCvRes = res;
+  lazyFlags |= LAZY_CV;
+}
+
+bool CPU::lazy_c() const {
+  switch (lazyOp) {
+  case LAZY_ADD:
+    return lazyCvRes < lazyA;
+  case LAZY_ADC:
+    return lazyCvRes <= lazyA;
+  default:
+    return lazyA >= lazyB;
+  }
+}
+
+bool CPU::lazy_v() const {
+  uint32_t a = lazyA, b = lazyB, res = lazyCvRes;
+  if (lazyOp == LAZY_SUB)
+    return ((a ^ b) & ~(res ^ b)) >> 31;
+  else
+    return (~(a ^ b) & (a ^ res)) >> 31;
+}
+
+void CPU::materialize_flags() {
+  if (lazyFlags & LAZY_NZ) {
+    N = (lazyRes >> 31);
+    Z = (lazyRes == 0);
+  }
+  if (lazyFlags & LAZY_CV) {
+    C = lazy_c();
+    V = lazy_v();
+  }
+  lazyFlags = 0;
 }
 
-void CPU::cmp(uint32_t a, uint32_t b, int tcs, bool flags) {
+template <bool flags> void CPU::cmp(uint32_t a, uint32_t b, int tcs) {
   if (!flags)
     return;
   // printf("cmp %08x %08x at %08x\n",a,b,pc);
-  sub(a, b, true);
+  uint32_t res = sub<true>(a, b);
   switch (tcs) {
   case 0x00:
-    T = Z;
+    T = (res == 0);
     break;
   case 0x01:
-    T = N;
+    T = (res >> 31);
     break;
   }
 }
@@ -1082,51 +1377,50 @@ template <typename Op> void CPU::ce_op(uint32_t a, uint32_t b, Op op) {
   CEH = result >> 32;
 }
 
-uint32_t CPU::add(uint32_t a, uint32_t b, bool flags) {
+template <bool flags> uint32_t CPU::add(uint32_t a, uint32_t b) {
   uint32_t res = a + b;
   if (flags) {
     basic_flags(res);
-    C = (b > (0xFFFFFFFFULL - a));
-    V = (~(a ^ b) & (a ^ res)) >> 31;
+    lazy_cv(LAZY_ADD, a, b, res);
   }
 
   return res;
 }
 
-uint32_t CPU::addc(uint32_t a, uint32_t b, bool flags) {
-  uint64_t res = uint64_t(a) + uint64_t(b) + C;
+template <bool flags> uint32_t CPU::addc(uint32_t a, uint32_t b) {
+  sync_flags();
+  uint32_t res = a + b + C;
   if (flags) {
     basic_flags(res);
-    C = (res >> 32ULL) & 0x1;
-    V = ((~(a ^ b) & (a ^ res)) >> 31) & 0x1;
+    lazy_cv(C ? LAZY_ADC : LAZY_ADD, a, b, res);
   }
 
   return res;
 }
 
-uint32_t CPU::sub(uint32_t a, uint32_t b, bool flags) {
+template <bool flags> uint32_t CPU::sub(uint32_t a, uint32_t b) {
   uint32_t res = a - b;
   if (flags) {
     basic_flags(res);
-    C = (a >= b);
-    V = ((a ^ b) & ~(res ^ b)) >> 31;
+    lazy_cv(LAZY_SUB, a, b, res);
   }
 
   return res;
 }
 
-uint32_t CPU::subc(uint32_t a, uint32_t b, bool flags) {
-  uint64_t res = uint64_t(a) + uint64_t(~b) + (C);
+template <bool flags> uint32_t CPU::subc(uint32_t a, uint32_t b) {
+  sync_flags();
+  uint32_t res = a + ~b + C;
   if (flags) {
     basic_flags(res);
-    C = (res >> 32) & 0x1;
-    V = ((~(a ^ b) & (a ^ res)) >> 31) & 0x1;
+    // V uses the addition formula with the original b, as on hardware
+    lazy_cv(C ? LAZY_ADC : LAZY_ADD, a, b, res);
   }
 
   return res;
 }
 
-uint32_t CPU::bit_and(uint32_t a, uint32_t b, bool flags) {
+template <bool flags> uint32_t CPU::bit_and(uint32_t a, uint32_t b) {
   uint32_t res = a & b;
   if (flags)
     basic_flags(res);
@@ -1134,7 +1428,7 @@ uint32_t CPU::bit_and(uint32_t a, uint32_t b, bool flags) {
   return res;
 }
 
-uint32_t CPU::bit_or(uint32_t a, uint32_t b, bool flags) {
+template <bool flags> uint32_t CPU::bit_or(uint32_t a, uint32_t b) {
   uint32_t res = a | b;
   if (flags)
     basic_flags(res);
@@ -1142,7 +1436,7 @@ uint32_t CPU::bit_or(uint32_t a, uint32_t b, bool flags) {
   return res;
 }
 
-uint32_t CPU::bit_xor(uint32_t a, uint32_t b, bool flags) {
+template <bool flags> uint32_t CPU::bit_xor(uint32_t a, uint32_t b) {
   uint32_t res = a ^ b;
   if (flags)
     basic_flags(res);
@@ -1150,9 +1444,11 @@ uint32_t CPU::bit_xor(uint32_t a, uint32_t b, bool flags) {
   return res;
 }
 
-uint32_t CPU::sll(uint32_t a, uint8_t sa, bool flags) {
+template <bool flags> uint32_t CPU::sll(uint32_t a, uint8_t sa) {
   uint32_t res = a << sa;
   if (flags) {
+    // Shifts leave V alone, so settle any pending C/V before writing C
+    sync_flags();
     basic_flags(res);
     C = a & (1 << (32 - sa));
   }
@@ -1160,9 +1456,10 @@ uint32_t CPU::sll(uint32_t a, uint8_t sa, bool flags) {
   return res;
 }
 
-uint32_t CPU::srl(uint32_t a, uint8_t sa, bool flags) {
+template <bool flags> uint32_t CPU::srl(uint32_t a, uint8_t sa) {
   uint32_t res = a >> sa;
   if (flags) {
+    sync_flags();
     basic_flags(res);
     C = a &
         (1 << (sa - 1)); // XXX: Docs say this is right, but what if sa is 0?
@@ -1171,9 +1468,10 @@ uint32_t CPU::srl(uint32_t a, uint8_t sa, bool flags) {
   return res;
 }
 
-uint32_t CPU::sra(uint32_t a, uint8_t sa, bool flags) {
+template <bool flags> uint32_t CPU::sra(uint32_t a, uint8_t sa) {
   uint32_t res = int32_t(a) >> sa;
   if (flags) {
+    sync_flags();
     basic_flags(res);
     C = a &
         (1 << (sa - 1)); // XXX: Docs say this is right, but what if sa is 0?
@@ -1182,7 +1480,7 @@ uint32_t CPU::sra(uint32_t a, uint8_t sa, bool flags) {
   return res;
 }
 
-uint32_t CPU::ror(uint32_t a, uint8_t sa, bool flags) {
+template <bool flags> uint32_t CPU::ror(uint32_t a, uint8_t sa) {
   if (sa == 0) {
     if (flags) {
       basic_flags(a);
@@ -1192,6 +1490,7 @@ uint32_t CPU::ror(uint32_t a, uint8_t sa, bool flags) {
     uint32_t res = (a >> sa);
     res |= (a << (32u - sa));
     if (flags) {
+      sync_flags();
       basic_flags(res);
       C = a & (1 << (sa - 1));
     }
@@ -1199,7 +1498,7 @@ uint32_t CPU::ror(uint32_t a, uint8_t sa, bool flags) {
   }
 }
 
-uint32_t CPU::rol(uint32_t a, uint8_t sa, bool flags) {
+template <bool flags> uint32_t CPU::rol(uint32_t a, uint8_t sa) {
   if (sa == 0) {
     if (flags) {
       basic_flags(a);
@@ -1209,6 +1508,7 @@ uint32_t CPU::rol(uint32_t a, uint8_t sa, bool flags) {
     uint32_t res = (a << sa);
     res |= (a >> (32u - sa));
     if (flags) {
+      sync_flags();
       basic_flags(res);
       C = a & (1 << (32u - sa));
     }
@@ -1219,6 +1519,7 @@ uint32_t CPU::rol(uint32_t a, uint8_t sa, bool flags) {
 extern bool softreset_flag;
 
 void CPU::debugDump(bool noExit) {
+  sync_flags();
   /* if ((pc % 4) == 0) {
     printf("mem[PC] = 0x%08x\n", read_memU32(pc));
   } else {
@@ -1278,6 +1579,8 @@ void CPU::debugDump(bool noExit) {
 }
 
 void CPU::state(SaveStater &s) {
+  // Also drops anything pending when loading
+  sync_flags();
   s.tag("CPU");
   s.a(r);
   s.a(cr);
@@ -1287,6 +1590,8 @@ void CPU::state(SaveStater &s) {
   s.i(pc);
   s.i(queuedInterrupt);
   s.i(last_ien);
+  if (s.is_load && !s.keep_code)
+    flush_code();
 }
 
 
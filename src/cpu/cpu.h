@@ -1,9 +1,21 @@
 #pragma once
 #include "../helper.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 using namespace std;
+
+struct Emu293AotContext;
+struct Emu293AotBlock;
+
 namespace Emu293 {
 
+class JitX64;
+
 class CPU {
+  friend class JitX64;
+
 public:
 
   uint64_t queuedInterrupt;
@@ -146,7 +158,86 @@ public:
     uint16_t encoded;
   };
 
+  // Operations produced by the decoder. Memory ops are laid out in func3 order
+  // (lw, lh, lhu, lb, sw, sh, lbu, sb) for each addressing mode
+  enum MicroOp : uint8_t {
+    UOP_INVALID, UOP_NOP, UOP_PCE,
+    UOP_ADD, UOP_ADDC, UOP_SUB, UOP_SUBC, UOP_NEG,
+    UOP_AND, UOP_OR, UOP_XOR,
+    UOP_ADDI, UOP_SUBI, UOP_ANDI, UOP_ORI, UOP_XORI, UOP_TSTI, UOP_LDI,
+    UOP_CMP, UOP_CMPI,
+    UOP_SLL, UOP_SRL, UOP_SRA, UOP_ROR, UOP_ROL,
+    UOP_SLLI, UOP_SRLI, UOP_SRAI, UOP_RORI, UOP_ROLI,
+    UOP_MUL, UOP_MULU, UOP_DIV, UOP_DIVU, UOP_MFCE, UOP_MTCE,
+    UOP_MFSR, UOP_MTSR, UOP_MFCR, UOP_MTCR,
+    UOP_TCOND, UOP_MV, UOP_MVCOND, UOP_EXTSB, UOP_EXTSH,
+    UOP_BR, UOP_BR16, UOP_BRL16, UOP_J, UOP_J16, UOP_BC, UOP_RTE,
+    UOP_LW, UOP_LH, UOP_LHU, UOP_LB, UOP_SW, UOP_SH, UOP_LBU, UOP_SB,
+    UOP_LW_PRE, UOP_LH_PRE, UOP_LHU_PRE, UOP_LB_PRE,
+    UOP_SW_PRE, UOP_SH_PRE, UOP_LBU_PRE, UOP_SB_PRE,
+    UOP_LW_POST, UOP_LH_POST, UOP_LHU_POST, UOP_LB_POST,
+    UOP_SW_POST, UOP_SH_POST, UOP_LBU_POST, UOP_SB_POST,
+    UOP_CACHE,
+    // Pairs run as one op by the interpreter, see fuse_pairs()
+    UOP_CMP_BC, UOP_CMPI_BC, UOP_LDI_ORI, UOP_LDI_ADDI, UOP_LW_SW_POST,
+    UOP_COUNT
+  };
+
+  // A decoded instruction. Register fields are absolute indices into r[] (16
+  // bit forms are already mapped onto g0/g1), rB doubles as the condition or
+  // mfce/mtce select field and rD holds the tcs field for compares
+  struct DecodedInsn {
+    uint8_t op;
+    uint8_t rD, rA, rB;
+    uint8_t cu;  // .c flag, or link bit for branches
+    uint8_t len; // bytes to advance PC by
+    uint8_t cycles; // cost when executed, not counting a taken branch
+    uint32_t imm; // sign/zero extended immediate
+    const DecodedInsn *pce; // PCE pairs: [0] runs when T is clear, [1] when set
+  };
+
+  // Native handler run in place of a guest routine, returning roughly how many
+  // guest instructions it stands in for
+  typedef int (*HleHandler)(CPU &cpu);
+
+  // Ahead of time translated block, see load_aot()
+  typedef int (*AotFn)(Emu293AotContext *c);
+
+  // Straight-line run of decoded instructions, never crossing a code page
+  struct CodeBlock {
+    uint32_t start, end;
+    std::vector<DecodedInsn> insns;
+    std::vector<DecodedInsn> pce;
+    void *native = nullptr; // translated code, when running under the JIT
+    bool idle = false;      // loop that only polls memory, see is_idle()
+    HleHandler hle = nullptr; // runs instead of the block, see add_hle_hook()
+    AotFn aot = nullptr;      // translation of the block, see load_aot()
+    int cycles = 0;           // cost of every instruction, as above
+  };
+
+  // Code pages used for block invalidation: 64MB of RAM followed by 16MB of
+  // internal memory
+  static const int CODE_PAGE_SHIFT = 12;
+  static const uint32_t RAM_CODE_PAGES = 0x04000000 >> CODE_PAGE_SHIFT;
+  static const uint32_t CODE_PAGES = RAM_CODE_PAGES + (0x01000000 >> CODE_PAGE_SHIFT);
+
+  // Timing is in cycles: one per instruction, with these instead for the
+  // slower ones and extra for a taken branch
+  static const int CYCLES_MEM = 2;
+  static const int CYCLES_MUL = 2;
+  static const int CYCLES_DIV = 12;
+  static const int CYCLES_TAKEN = 1;
+
+  enum Engine { ENGINE_INTERP, ENGINE_JIT };
+
   CPU();
+  ~CPU();
+
+  /**
+   * Select the execution engine, returns false if it is not available on this
+   * host (the interpreter is kept in that case)
+   */
+  bool set_engine(Engine engine);
 
   /**
    * Reset the CPU
@@ -169,6 +260,41 @@ public:
    */
   void step();
 
+  /**
+   * Runs a whole cached block from PC, or a single instruction outside cached
+   * code. Returns the number of instructions executed
+   */
+  int run_block();
+
+  /**
+   * Runs blocks until at least the given number of cycles have passed, or the
+   * guest is found idling (see is_idle()). Returns the cycles used
+   */
+  int64_t run(int64_t cycles);
+
+  /**
+   * Makes run() return after the current block, for when something needs
+   * attention sooner than the budget it was given
+   */
+  void stop_run() { runStopped = true; }
+
+  /**
+   * Makes run() return whenever PC reaches addr between blocks, so a branch
+   * target such as a loop head. 0 turns it off
+   */
+  void set_stop_pc(uint32_t addr) { stopPC = addr; }
+
+  /**
+   * Cycles run since reset
+   */
+  uint64_t cycles() const { return cycleCount; }
+
+  /**
+   * True if the last run_block() went round a loop that only polls memory, so
+   * nothing will change until a peripheral or interrupt does something
+   */
+  bool is_idle() const { return idleLoop; }
+
   /**
    * Causes an interrupt to fire
    */
@@ -176,10 +302,104 @@ public:
 
   void state(SaveStater &s);
 
+  /**
+   * Notify the CPU that a code page was written to, dropping any cached blocks
+   */
+  inline void code_written(uint32_t page) {
+    if (codePages[page])
+      invalidate_code_page(page);
+  }
+
+  /**
+   * Drop all cached blocks
+   */
+  void flush_code();
+
+  /**
+   * Run handler instead of the guest routine at addr, returning to r3 after.
+   * Only takes effect for calls reaching addr through run_block()
+   */
+  void add_hle_hook(uint32_t addr, HleHandler handler);
+
+  /**
+   * Remove all hooks added by add_hle_hook()
+   */
+  void clear_hle_hooks();
+
+  /**
+   * Translate the code reachable from entries within [lo, hi) to C++ in file,
+   * for building into a library for load_aot()
+   */
+  bool aot_generate(const std::string &file, const std::vector<uint32_t> &entries, uint32_t lo,
+                    uint32_t hi);
+
+  /**
+   * Use the translated blocks in a library made from aot_generate() output,
+   * where they still match the code in memory. Returns false if it can't be
+   * loaded
+   */
+  bool load_aot(const std::string &file);
+
+  /**
+   * Stop using translated blocks from load_aot()
+   */
+  void unload_aot();
+
+  /**
+   * Write any flags still pending from the last flag setting operation to cr1
+   */
+  inline void sync_flags() {
+    if (lazyFlags)
+      materialize_flags();
+  }
+
 protected:
-  void exec16(Instruction16 insn);
+  static void decode16(Instruction16 insn, DecodedInsn &d);
+
+  static void decode32(Instruction32 insn, DecodedInsn &d);
+
+  /**
+   * Runs decoded instructions from insn up to end, advancing PC past each.
+   * Stops early if a store invalidated cached code or cr0 was written.
+   * Returns the number of instructions executed
+   */
+  int execute(const DecodedInsn *insn, const DecodedInsn *end);
+
+  /**
+   * Runs a single decoded instruction for translated code, which reads the
+   * flags straight from cr1
+   */
+  static void execute_one(CPU *cpu, const DecodedInsn *insn);
+
+  template <int Func> void mem_op(uint8_t rD, uint32_t addr);
+
+  // Don't fire if interrupts are disabled
+  inline void check_interrupts() {
+    if (queuedInterrupt != 0 && (cr0 & 1))
+      take_interrupt();
+  }
+
+  void take_interrupt();
+
+  CodeBlock *find_block(uint32_t start);
+
+  void count_cycles(const CodeBlock *blk, int count);
+
+  uint32_t code_hash(const CodeBlock &blk) const;
 
-  void exec32(Instruction32 insn);
+  AotFn find_aot(const CodeBlock &blk) const;
+
+  int run_aot(CodeBlock *blk);
+
+  static void aot_fallback(Emu293AotContext *c, uint32_t index);
+
+  const DecodedInsn *fetch_decoded();
+
+  CodeBlock *compile_block(uint32_t start);
+
+  void invalidate_code_page(uint32_t page);
+
+  void fuse_pairs(CodeBlock &blk);
 
   void branch(uint32_t address, bool link);
 
@@ -190,39 +410,89 @@ protected:
 
   void basic_flags(uint32_t res);
 
-  void cmp(uint32_t a, uint32_t b, int tcs = 3, bool flags = true);
+  void lazy_cv(uint8_t op, uint32_t a, uint32_t b, uint32_t res);
+
+  bool lazy_c() const;
+  bool lazy_v() const;
+
+  void materialize_flags();
+
+  template <bool flags> void cmp(uint32_t a, uint32_t b, int tcs = 3);
 
   template <typename Op> void ce_op(uint32_t a, uint32_t b, Op op);
 
-  uint32_t add(uint32_t a, uint32_t b, bool flags);
+  template <bool flags> uint32_t add(uint32_t a, uint32_t b);
 
-  uint32_t addc(uint32_t a, uint32_t b, bool flags);
+  template <bool flags> uint32_t addc(uint32_t a, uint32_t b);
 
-  uint32_t sub(uint32_t a, uint32_t b, bool flags);
+  template <bool flags> uint32_t sub(uint32_t a, uint32_t b);
 
-  uint32_t subc(uint32_t a, uint32_t b, bool flags);
+  template <bool flags> uint32_t subc(uint32_t a, uint32_t b);
 
-  uint32_t bit_and(uint32_t a, uint32_t b, bool flags);
+  template <bool flags> uint32_t bit_and(uint32_t a, uint32_t b);
 
-  uint32_t bit_or(uint32_t a, uint32_t b, bool flags);
+  template <bool flags> uint32_t bit_or(uint32_t a, uint32_t b);
 
-  uint32_t bit_xor(uint32_t a, uint32_t b, bool flags);
+  template <bool flags> uint32_t bit_xor(uint32_t a, uint32_t b);
 
-  uint32_t sll(uint32_t a, uint8_t sa, bool flags);
+  template <bool flags> uint32_t sll(uint32_t a, uint8_t sa);
 
-  uint32_t srl(uint32_t a, uint8_t sa, bool flags);
+  template <bool flags> uint32_t srl(uint32_t a, uint8_t sa);
 
-  uint32_t sra(uint32_t a, uint8_t sa, bool flags);
+  template <bool flags> uint32_t sra(uint32_t a, uint8_t sa);
 
-  uint32_t ror(uint32_t a, uint8_t sa, bool flags);
+  template <bool flags> uint32_t ror(uint32_t a, uint8_t sa);
 
-  uint32_t rol(uint32_t a, uint8_t sa, bool flags);
+  template <bool flags> uint32_t rol(uint32_t a, uint8_t sa);
 
 
   volatile uint8_t *memPtr, *imemPtr;
 
   bool isPCE;
 
+  // Block cache
+  static const int BLOCK_LUT_SIZE = 65536;
+  static const int MAX_BLOCK_INSNS = 64;
+  std::unordered_map<uint32_t, std::unique_ptr<CodeBlock>> blocks;
+  std::vector<CodeBlock *> blockLut;
+  std::vector<std::vector<uint32_t>> pageBlocks;
+  std::vector<uint8_t> codePages;
+  // Blocks dropped while one of their instructions may still be executing
+  std::vector<std::unique_ptr<CodeBlock>> retiredBlocks;
+  CodeBlock *curBlock = nullptr;
+  size_t curIndex = 0;
+  uint32_t nextPC = 0;
+  // Set whenever cached code is dropped, so translated blocks can stop after a
+  // store that hit their own code
+  bool codeInvalidated = false;
+  bool idleLoop = false;
+  bool runStopped = false;
+  uint32_t stopPC = 0;
+  // Fused pairs are only for the interpreter, code for translation is kept
+  // as decoded
+  bool fuseOps = true;
+  uint64_t cycleCount = 0;
+
+  std::unordered_map<uint32_t, HleHandler> hleHooks;
+
+  JitX64 *jit = nullptr;
+
+  // Translations from load_aot(), by start address
+  std::unordered_map<uint32_t, const Emu293AotBlock *> aotBlocks;
+  void *aotLib = nullptr;
+  Emu293AotContext *aotCtx = nullptr;
+
+  // Lazy flags. Flag setting ops only record their result and operands here,
+  // N/Z/C/V in cr1 are brought up to date when something reads them
+  enum LazyFlags : uint8_t { LAZY_NZ = 1, LAZY_CV = 2 };
+  // C/V sources: addition with a carry in of 0 or 1 (subc is an addition of
+  // ~b), or subtraction
+  enum LazyOp : uint8_t { LAZY_ADD, LAZY_ADC, LAZY_SUB };
+  uint8_t lazyFlags = 0;
+  uint8_t lazyOp = LAZY_ADD;
+  uint32_t lazyRes = 0;
+  uint32_t lazyA = 0, lazyB = 0, lazyCvRes = 0;
+
 public:
   void debugDump(bool noExit = false);
   // Registers
@@ -0,0 +1,117 @@
+#include "hle.h"
+#include "../loadelf.h"
+#include "../system.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+using namespace std;
+
+// Native versions of hot C library routines in the firmware. They follow the
+// guest calling convention, taking arguments in r4-r7 and returning in r4,
+// and CPU::run_block returns to r3 afterwards. Whole ranges in RAM are
+// accessed directly, anything else goes through the memory handlers so MMIO
+// side effects are the same as running the guest code.
+namespace Emu293 {
+
+// Rough guest instruction counts, so peripherals still see the time pass
+static const int CALL_COST = 8;
+// Lengths come from the guest, so a garbage one must not wrap the count
+static const uint64_t MAX_CALL_COST = 1 << 24;
+
+static int call_cost(uint64_t work) {
+  return int(min<uint64_t>(CALL_COST + work, MAX_CALL_COST));
+}
+
+// Host pointer to [addr, addr + len) if it lies within one memory, or nullptr
+static uint8_t *host_range(uint32_t addr, uint32_t len) {
+  if (len == 0)
+    return nullptr;
+  uint8_t *start = get_dma_ptr(addr);
+  uint8_t *end = get_dma_ptr(addr + len - 1);
+  if (start == nullptr || end == nullptr || (end - start) != ptrdiff_t(len - 1))
+    return nullptr;
+  return start;
+}
+
+static int hle_memmove(CPU &cpu) {
+  uint32_t dst = cpu.r4, src = cpu.r5, len = cpu.r6;
+  uint8_t *d = host_range(dst, len), *s = host_range(src, len);
+  if (d != nullptr && s != nullptr) {
+    memmove(d, s, len);
+    mark_dma_write(dst, len);
+  } else if (dst > src && dst - src < len) {
+    for (uint32_t i = len; i > 0; i--)
+      write_memU8(dst + i - 1, read_memU8(src + i - 1));
+  } else {
+    for (uint32_t i = 0; i < len; i++)
+      write_memU8(dst + i, read_memU8(src + i));
+  }
+  return call_cost(len);
+}
+
+static int hle_memset(CPU &cpu) {
+  uint32_t dst = cpu.r4, len = cpu.r6;
+  uint8_t val = cpu.r5;
+  uint8_t *d = host_range(dst, len);
+  if (d != nullptr) {
+    memset(d, val, len);
+    mark_dma_write(dst, len);
+  } else {
+    for (uint32_t i = 0; i < len; i++)
+      write_memU8(dst + i, val);
+  }
+  return call_cost(len);
+}
+
+static int hle_strlen(CPU &cpu) {
+  uint32_t len = 0;
+  while (read_memU8(cpu.r4 + len) != 0)
+    len++;
+  cpu.r4 = len;
+  return call_cost(3 * uint64_t(len));
+}
+
+static int hle_strcmp(CPU &cpu) {
+  uint32_t a = cpu.r4, b = cpu.r5, i = 0;
+  uint8_t ca, cb;
+  do {
+    ca = read_memU8(a + i);
+    cb = read_memU8(b + i);
+    i++;
+  } while (ca != 0 && ca == cb);
+  cpu.r4 = int32_t(ca) - int32_t(cb);
+  return call_cost(5 * uint64_t(i));
+}
+
+static int hle_strcpy(CPU &cpu) {
+  uint32_t dst = cpu.r4, src = cpu.r5, i = 0;
+  uint8_t c;
+  do {
+    c = read_memU8(src + i);
+    write_memU8(dst + i, c);
+    i++;
+  } while (c != 0);
+  return call_cost(4 * uint64_t(i));
+}
+
+void hle_install(CPU &cpu) {
+  static const struct {
+    const char *name;
+    CPU::HleHandler handler;
+  } routines[] = {
+      // memcpy with overlapping ranges is undefined, so it can share memmove
+      {"memcpy", hle_memmove}, {"memmove", hle_memmove}, {"memset", hle_memset},
+      {"strlen", hle_strlen},  {"strcmp", hle_strcmp},   {"strcpy", hle_strcpy},
+  };
+  cpu.clear_hle_hooks();
+  for (auto &routine : routines) {
+    auto sym = symbols_fwd.find(routine.name);
+    if (sym == symbols_fwd.end())
+      continue;
+    cpu.add_hle_hook(sym->second, routine.handler);
+    printf("HLE: %s at 0x%08x\n", routine.name, sym->second);
+  }
+}
+
+} // namespace Emu293
@@ -0,0 +1,13 @@
+#pragma once
+#include "cpu.h"
+
+using namespace std;
+namespace Emu293 {
+
+/**
+ * Hook the firmware routines we have native versions of, found by their ELF
+ * symbols. Call after each ELF load; hooks from a previous load are dropped
+ */
+void hle_install(CPU &cpu);
+
+} // namespace Emu293
@@ -0,0 +1,928 @@
+#include "jit_x64.h"
+#include "../system.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef EMU293_JIT_X64
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <signal.h>
+#include <ucontext.h>
+#endif
+
+using namespace std;
+namespace Emu293 {
+
+namespace {
+enum HostReg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+// Opcode extensions for the 0x81/0x83, 0xC1/0xD3 and 0xF7 groups
+enum AluOp { ALU_ADD, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+enum ShiftOp { SH_ROL = 0, SH_ROR = 1, SH_SHL = 4, SH_SHR = 5, SH_SAR = 7 };
+enum UnaryOp { UN_NOT = 2, UN_NEG = 3, UN_MUL = 4, UN_IMUL = 5 };
+enum CondCode { CC_NEVER = -2, CC_ALWAYS = -1, CC_E = 4, CC_NE = 5, CC_G = 15 };
+
+#ifdef _WIN32
+const int ARG0 = RCX, ARG1 = RDX;
+// Includes shadow space for callees
+const int FRAME_SIZE = 40;
+#else
+const int ARG0 = RDI, ARG1 = RSI;
+const int FRAME_SIZE = 8;
+#endif
+
+const int savedRegs[] = {RBX, RBP, R12, R13, R14, R15};
+// RBX holds the state base, the rest cache guest registers
+const int cacheRegs[] = {RBP, R12, R13, R14, R15};
+
+const size_t CODE_SIZE = 32 * 1024 * 1024;
+// Well above the size of the largest possible block
+const size_t BLOCK_MARGIN = 128 * 1024;
+
+void count_regs(const CPU::DecodedInsn &d, unsigned uses[32]) {
+  switch (d.op) {
+  case CPU::UOP_LDI:
+  case CPU::UOP_MFSR:
+  case CPU::UOP_MFCR:
+  case CPU::UOP_MTCR:
+    uses[d.rD]++;
+    break;
+  case CPU::UOP_TSTI:
+  case CPU::UOP_CMPI:
+  case CPU::UOP_MTSR:
+  case CPU::UOP_BR:
+  case CPU::UOP_BR16:
+  case CPU::UOP_BRL16:
+  case CPU::UOP_CACHE:
+    uses[d.rA]++;
+    break;
+  case CPU::UOP_NEG:
+    uses[d.rD]++;
+    uses[d.rB]++;
+    break;
+  case CPU::UOP_CMP:
+  case CPU::UOP_MUL:
+  case CPU::UOP_MULU:
+  case CPU::UOP_DIV:
+  case CPU::UOP_DIVU:
+    uses[d.rA]++;
+    uses[d.rB]++;
+    break;
+  case CPU::UOP_ADD:
+  case CPU::UOP_ADDC:
+  case CPU::UOP_SUB:
+  case CPU::UOP_SUBC:
+  case CPU::UOP_AND:
+  case CPU::UOP_OR:
+  case CPU::UOP_XOR:
+  case CPU::UOP_SLL:
+  case CPU::UOP_SRL:
+  case CPU::UOP_SRA:
+  case CPU::UOP_ROR:
+  case CPU::UOP_ROL:
+    uses[d.rD]++;
+    uses[d.rA]++;
+    uses[d.rB]++;
+    break;
+  case CPU::UOP_ADDI:
+  case CPU::UOP_SUBI:
+  case CPU::UOP_ANDI:
+  case CPU::UOP_ORI:
+  case CPU::UOP_XORI:
+  case CPU::UOP_SLLI:
+  case CPU::UOP_SRLI:
+  case CPU::UOP_SRAI:
+  case CPU::UOP_RORI:
+  case CPU::UOP_ROLI:
+  case CPU::UOP_MV:
+  case CPU::UOP_MVCOND:
+  case CPU::UOP_EXTSB:
+  case CPU::UOP_EXTSH:
+  case CPU::UOP_MFCE:
+  case CPU::UOP_MTCE:
+    uses[d.rD]++;
+    uses[d.rA]++;
+    break;
+  default:
+    if (d.op >= CPU::UOP_LW && d.op <= CPU::UOP_SB_POST) {
+      uses[d.rD]++;
+      uses[d.rA]++;
+    }
+    break;
+  }
+}
+
+#ifdef __linux__
+JitX64 *faultJit = nullptr;
+struct sigaction prevSegv;
+
+void segv_handler(int sig, siginfo_t *info, void *ctx) {
+  ucontext_t *uc = static_cast<ucontext_t *>(ctx);
+  uint8_t *rip = reinterpret_cast<uint8_t *>(uc->uc_mcontext.gregs[REG_RIP]);
+  uint8_t *resume = faultJit ? faultJit->fastmem_fault(rip) : nullptr;
+  if (resume != nullptr) {
+    uc->uc_mcontext.gregs[REG_RIP] = reinterpret_cast<greg_t>(resume);
+    return;
+  }
+  // Not ours, so fault again with the previous handler
+  sigaction(SIGSEGV, &prevSegv, nullptr);
+}
+#endif
+} // namespace
+
+JitX64::JitX64(CPU *cpu) : cpu(cpu) {
+  stateBase = reinterpret_cast<uint8_t *>(cpu->r) + 128;
+  std::fill(hostFor, hostFor + 32, -1);
+}
+
+JitX64::~JitX64() {
+  if (code == nullptr)
+    return;
+#ifdef __linux__
+  if (faultJit == this)
+    faultJit = nullptr;
+#endif
+#ifdef _WIN32
+  VirtualFree(code, 0, MEM_RELEASE);
+#else
+  munmap(code, CODE_SIZE);
+#endif
+}
+
+bool JitX64::init() {
+#ifdef _WIN32
+  void *mem = VirtualAlloc(nullptr, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+  if (mem == nullptr)
+    return false;
+#else
+  void *mem = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return false;
+#endif
+  code = static_cast<uint8_t *>(mem);
+  codeEnd = code + CODE_SIZE;
+  reset();
+#ifdef __linux__
+  fastmem = get_fastmem_base();
+  if (fastmem != nullptr) {
+    if (faultJit == nullptr) {
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = segv_handler;
+      sa.sa_flags = SA_SIGINFO;
+      sigemptyset(&sa.sa_mask);
+      sigaction(SIGSEGV, &sa, &prevSegv);
+    }
+    faultJit = this;
+  }
+#endif
+  return true;
+}
+
+bool JitX64::full() const { return size_t(codeEnd - ptr) < BLOCK_MARGIN; }
+
+void JitX64::reset() {
+  ptr = code;
+  fastmemSites.clear();
+}
+
+uint8_t *JitX64::fastmem_fault(uint8_t *rip) {
+  auto found = fastmemSites.find(rip);
+  if (found == fastmemSites.end())
+    return nullptr;
+  // Most likely MMIO, which would keep faulting, so jump to the handler call
+  // directly in future
+  uint8_t *site = found->second.site;
+  site[0] = 0xE9;
+  patch(site + 1, found->second.stub);
+  return found->second.stub;
+}
+
+void *JitX64::compile(const CPU::CodeBlock &blk) {
+  // Cache the most used guest registers of the block
+  unsigned uses[32] = {0};
+  for (auto &d : blk.insns) {
+    if (d.op == CPU::UOP_PCE) {
+      count_regs(d.pce[0], uses);
+      count_regs(d.pce[1], uses);
+    } else {
+      count_regs(d, uses);
+    }
+  }
+  vector<int> order;
+  for (int g = 0; g < 32; g++)
+    if (uses[g] >= 2)
+      order.push_back(g);
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return uses[a] > uses[b]; });
+  std::fill(hostFor, hostFor + 32, -1);
+  cached.clear();
+  for (size_t i = 0; i < order.size() && i < sizeof(cacheRegs) / sizeof(cacheRegs[0]); i++) {
+    hostFor[order[i]] = cacheRegs[i];
+    cached.push_back(order[i]);
+  }
+  exits.clear();
+  slowLoads.clear();
+
+  uint8_t *entry = ptr;
+  for (int reg : savedRegs)
+    push_r(reg);
+  byte(0x48);
+  byte(0x83);
+  modrm_r(ALU_SUB, RSP);
+  byte(FRAME_SIZE);
+  mov_ri64(RBX, reinterpret_cast<uint64_t>(stateBase));
+  reload_regs();
+
+  uint32_t pc = blk.start;
+  for (size_t i = 0; i < blk.insns.size(); i++) {
+    const CPU::DecodedInsn &d = blk.insns[i];
+    if (d.op == CPU::UOP_PCE) {
+      // Pick the half of the pair on T
+      op_m(0xF6, 0, disp(&cpu->cr[1]));
+      byte(0x10);
+      uint8_t *hi = jcc(CC_NE);
+      emit_insn(d.pce[0], d, pc, i + 1);
+      uint8_t *join = jmp();
+      patch(hi, ptr);
+      emit_insn(d.pce[1], d, pc, i + 1);
+      patch(join, ptr);
+    } else {
+      emit_insn(d, d, pc, i + 1);
+    }
+    pc += d.len;
+  }
+  mov_mi(disp(&cpu->pc), blk.end);
+  mov_ri(RAX, blk.insns.size());
+
+  for (auto rel : exits)
+    patch(rel, ptr);
+  flush_regs();
+  byte(0x48);
+  byte(0x83);
+  modrm_r(ALU_ADD, RSP);
+  byte(FRAME_SIZE);
+  for (int i = sizeof(savedRegs) / sizeof(savedRegs[0]) - 1; i >= 0; i--)
+    pop_r(savedRegs[i]);
+  byte(0xC3);
+  emit_slow_loads();
+  return entry;
+}
+
+void JitX64::emit_insn(const CPU::DecodedInsn &d, const CPU::DecodedInsn &whole, uint32_t pc,
+                       int count) {
+  // PC quirks follow CPU::execute, where PC is advanced by the full pair
+  // length afterwards for PCE halves
+  uint32_t len = whole.len;
+  uint32_t next = pc + len;
+  int32_t dpc = disp(&cpu->pc);
+  switch (d.op) {
+  case CPU::UOP_NOP:
+    break;
+  case CPU::UOP_ADD:
+  case CPU::UOP_SUB:
+  case CPU::UOP_AND:
+  case CPU::UOP_OR:
+  case CPU::UOP_XOR:
+  case CPU::UOP_NEG: {
+    int ext = (d.op == CPU::UOP_ADD) ? ALU_ADD : (d.op == CPU::UOP_AND) ? ALU_AND
+            : (d.op == CPU::UOP_OR) ? ALU_OR : (d.op == CPU::UOP_XOR) ? ALU_XOR : ALU_SUB;
+    if (d.op == CPU::UOP_NEG)
+      op_rr(0x31, RAX, RAX);
+    else
+      load_guest(RAX, d.rA);
+    alu_guest(ext, RAX, d.rB);
+    store_guest(d.rD, RAX);
+    if (d.cu) {
+      if (ext == ALU_ADD || ext == ALU_SUB)
+        emit_flags(ext == ALU_SUB, -1);
+      else
+        emit_basic_flags();
+    }
+  } break;
+  case CPU::UOP_ADDI:
+  case CPU::UOP_SUBI:
+  case CPU::UOP_ANDI:
+  case CPU::UOP_ORI:
+  case CPU::UOP_XORI:
+  case CPU::UOP_TSTI: {
+    int ext = (d.op == CPU::UOP_ADDI) ? ALU_ADD : (d.op == CPU::UOP_SUBI) ? ALU_SUB
+            : (d.op == CPU::UOP_ORI) ? ALU_OR : (d.op == CPU::UOP_XORI) ? ALU_XOR : ALU_AND;
+    load_guest(RAX, d.rA);
+    alu_ri(ext, RAX, d.imm);
+    if (d.op != CPU::UOP_TSTI)
+      store_guest(d.rD, RAX);
+    if (d.cu) {
+      if (ext == ALU_ADD || ext == ALU_SUB)
+        emit_flags(ext == ALU_SUB, -1);
+      else
+        emit_basic_flags();
+    }
+  } break;
+  case CPU::UOP_ADDC:
+  case CPU::UOP_SUBC:
+    if (d.op == CPU::UOP_SUBC && d.cu) {
+      // subc sets V as if for an add, leave that to the interpreter
+      emit_fallback(whole, pc, count, false);
+      break;
+    }
+    load_guest(RAX, d.rA);
+    load_guest(RDX, d.rB);
+    if (d.op == CPU::UOP_SUBC)
+      unary_r(UN_NOT, RDX);
+    // Shift C into the host carry
+    op_rm(0x8B, RCX, disp(&cpu->cr[1]));
+    shift_ri(SH_SHR, RCX, 2);
+    op_rr(0x11, RAX, RDX);
+    store_guest(d.rD, RAX);
+    if (d.cu)
+      emit_flags(false, -1);
+    break;
+  case CPU::UOP_LDI:
+    if (hostFor[d.rD] >= 0)
+      mov_ri(hostFor[d.rD], d.imm);
+    else
+      mov_mi(disp_r(d.rD), d.imm);
+    break;
+  case CPU::UOP_CMP:
+  case CPU::UOP_CMPI:
+    if (!d.cu)
+      break;
+    load_guest(RAX, d.rA);
+    if (d.op == CPU::UOP_CMP)
+      alu_guest(ALU_CMP, RAX, d.rB);
+    else
+      alu_ri(ALU_CMP, RAX, d.imm);
+    emit_flags(true, d.rD);
+    break;
+  case CPU::UOP_SLL:
+  case CPU::UOP_SRL:
+  case CPU::UOP_SRA:
+  case CPU::UOP_ROR:
+  case CPU::UOP_ROL:
+  case CPU::UOP_SLLI:
+  case CPU::UOP_SRLI:
+  case CPU::UOP_SRAI:
+  case CPU::UOP_RORI:
+  case CPU::UOP_ROLI: {
+    if (d.cu) {
+      emit_fallback(whole, pc, count, false);
+      break;
+    }
+    static const uint8_t shifts[] = {SH_SHL, SH_SHR, SH_SAR, SH_ROR, SH_ROL};
+    bool imm = (d.op >= CPU::UOP_SLLI);
+    int ext = shifts[d.op - (imm ? CPU::UOP_SLLI : CPU::UOP_SLL)];
+    // The host masks the count to 5 bits like the guest does
+    if (!imm)
+      load_guest(RCX, d.rB);
+    load_guest(RAX, d.rA);
+    if (imm)
+      shift_ri(ext, RAX, d.imm);
+    else
+      shift_rcl(ext, RAX);
+    store_guest(d.rD, RAX);
+  } break;
+  case CPU::UOP_MUL:
+  case CPU::UOP_MULU:
+    load_guest(RAX, d.rA);
+    unary_guest(d.op == CPU::UOP_MUL ? UN_IMUL : UN_MUL, d.rB);
+    op_rm(0x89, RAX, disp(&cpu->CEL));
+    op_rm(0x89, RDX, disp(&cpu->CEH));
+    break;
+  case CPU::UOP_MFCE:
+    if (d.rB == 0x01 || d.rB == 0x02) {
+      op_rm(0x8B, RAX, disp(d.rB == 0x01 ? &cpu->CEL : &cpu->CEH));
+      store_guest(d.rD, RAX);
+    } else if (d.rB == 0x03) {
+      op_rm(0x8B, RAX, disp(&cpu->CEH));
+      store_guest(d.rD, RAX);
+      op_rm(0x8B, RAX, disp(&cpu->CEL));
+      store_guest(d.rA, RAX);
+    }
+    break;
+  case CPU::UOP_MTCE:
+    if (d.rB == 0x01 || d.rB == 0x02) {
+      load_guest(RAX, d.rD);
+      op_rm(0x89, RAX, disp(d.rB == 0x01 ? &cpu->CEL : &cpu->CEH));
+    } else if (d.rB == 0x03) {
+      load_guest(RAX, d.rD);
+      op_rm(0x89, RAX, disp(&cpu->CEH));
+      load_guest(RAX, d.rA);
+      op_rm(0x89, RAX, disp(&cpu->CEL));
+    }
+    break;
+  case CPU::UOP_MFSR:
+  case CPU::UOP_MTSR:
+    if (d.rB >= 3) {
+      emit_fallback(whole, pc, count, false);
+    } else if (d.op == CPU::UOP_MFSR) {
+      op_rm(0x8B, RAX, disp(&cpu->sr[d.rB]));
+      store_guest(d.rD, RAX);
+    } else {
+      load_guest(RAX, d.rA);
+      op_rm(0x89, RAX, disp(&cpu->sr[d.rB]));
+    }
+    break;
+  case CPU::UOP_MFCR:
+    op_rm(0x8B, RAX, disp(&cpu->cr[d.rA]));
+    store_guest(d.rD, RAX);
+    break;
+  case CPU::UOP_MTCR:
+    load_guest(RAX, d.rD);
+    op_rm(0x89, RAX, disp(&cpu->cr[d.rA]));
+    // Let a pending interrupt fire if this enabled them
+    if (d.rA == 0)
+      emit_exit(next, count);
+    break;
+  case CPU::UOP_TCOND: {
+    int cc = emit_cond(d.rB);
+    if (cc == CC_ALWAYS || cc == CC_NEVER) {
+      op_m(0x80, (cc == CC_ALWAYS) ? ALU_OR : ALU_AND, disp(&cpu->cr[1]));
+      byte((cc == CC_ALWAYS) ? 0x10 : ~0x10);
+    } else {
+      setcc(cc, RAX);
+      ext_r(0xB6, RAX, RAX);
+      shift_ri(SH_SHL, RAX, 4);
+      op_rm(0x8B, RCX, disp(&cpu->cr[1]));
+      alu_ri(ALU_AND, RCX, ~0x10U);
+      op_rr(0x09, RCX, RAX);
+      op_rm(0x89, RCX, disp(&cpu->cr[1]));
+    }
+  } break;
+  case CPU::UOP_MV:
+  case CPU::UOP_MVCOND: {
+    uint8_t *skip = nullptr;
+    if (d.op == CPU::UOP_MVCOND) {
+      int cc = emit_cond(d.rB);
+      if (cc == CC_NEVER)
+        break;
+      if (cc != CC_ALWAYS)
+        skip = jcc(cc ^ 1);
+    }
+    load_guest(RAX, d.rA);
+    store_guest(d.rD, RAX);
+    if (skip)
+      patch(skip, ptr);
+  } break;
+  case CPU::UOP_EXTSB:
+  case CPU::UOP_EXTSH:
+    load_guest(RAX, d.rA);
+    ext_r(d.op == CPU::UOP_EXTSB ? 0xBE : 0xBF, RAX, RAX);
+    store_guest(d.rD, RAX);
+    if (d.cu)
+      emit_basic_flags();
+    break;
+  case CPU::UOP_BR:
+  case CPU::UOP_BR16:
+  case CPU::UOP_BRL16: {
+    int cc = emit_cond(d.rB);
+    if (cc == CC_NEVER)
+      break;
+    uint8_t *skip = (cc == CC_ALWAYS) ? nullptr : jcc(cc ^ 1);
+    if (d.op == CPU::UOP_BRL16) {
+      mov_ri(RCX, pc + len);
+      store_guest(3, RCX);
+    }
+    load_guest(RAX, d.rA);
+    if (d.op != CPU::UOP_BR && len != 2)
+      alu_ri(ALU_ADD, RAX, len - 2);
+    op_rm(0x89, RAX, dpc);
+    if (d.op == CPU::UOP_BR && d.cu) {
+      mov_ri(RCX, pc + 4);
+      store_guest(3, RCX);
+    }
+    emit_exit_dynamic(count);
+    if (skip)
+      patch(skip, ptr);
+  } break;
+  case CPU::UOP_J:
+  case CPU::UOP_J16:
+    if (d.cu) {
+      mov_ri(RCX, pc + ((d.op == CPU::UOP_J) ? 4 : len));
+      store_guest(3, RCX);
+    }
+    if (d.op == CPU::UOP_J)
+      emit_exit((pc & 0xFC000000) | d.imm, count);
+    else
+      emit_exit(((pc & 0xFFFFF000) | d.imm) - 2 + len, count);
+    break;
+  case CPU::UOP_BC: {
+    int cc = emit_cond(d.rB);
+    if (cc == CC_NEVER)
+      break;
+    uint8_t *skip = (cc == CC_ALWAYS) ? nullptr : jcc(cc ^ 1);
+    if (d.cu) {
+      mov_ri(RCX, pc + 4);
+      store_guest(3, RCX);
+    }
+    emit_exit(pc + d.imm + len, count);
+    if (skip)
+      patch(skip, ptr);
+  } break;
+  case CPU::UOP_RTE:
+  case CPU::UOP_INVALID:
+    emit_fallback(whole, pc, count, true);
+    break;
+  case CPU::UOP_CACHE:
+    emit_fallback(whole, pc, count, false);
+    emit_code_check(next, count);
+    break;
+  default:
+    if (d.op >= CPU::UOP_LW && d.op <= CPU::UOP_SB_POST) {
+      static const void *const handlers[] = {
+          (const void *)&read_memU32, (const void *)&read_memU16, (const void *)&read_memU16,
+          (const void *)&read_memU8,  (const void *)&write_memU32, (const void *)&write_memU16,
+          (const void *)&read_memU8,  (const void *)&write_memU8};
+      int func = (d.op - CPU::UOP_LW) & 0x7;
+      int mode = (d.op - CPU::UOP_LW) >> 3;
+      bool store = (func == 4 || func == 5 || func == 7);
+      bool fast = !store && fastmem != nullptr;
+      // The memory system reports PC in diagnostics
+      if (!fast)
+        mov_mi(dpc, pc);
+      load_guest(ARG0, d.rA);
+      if (mode != 2 && d.imm != 0)
+        alu_ri(ALU_ADD, ARG0, d.imm);
+      if (mode == 1)
+        store_guest(d.rA, ARG0);
+      if (store)
+        load_guest(ARG1, d.rD);
+      if (fast) {
+        // mov rax, fastmem; mov/movzx eax, [rax + ARG0]
+        SlowLoad slow;
+        slow.site = ptr;
+        mov_ri64(RAX, reinterpret_cast<uint64_t>(fastmem));
+        slow.load = ptr;
+        if (func != 0)
+          byte(0x0F);
+        byte((func == 0) ? 0x8B : (func == 1 || func == 2) ? 0xB7 : 0xB6);
+        byte(0x04);
+        byte((ARG0 << 3) | RAX);
+        slow.resume = ptr;
+        slow.fn = handlers[func];
+        slow.pc = pc;
+        slowLoads.push_back(slow);
+      } else {
+        emit_call(handlers[func]);
+      }
+      if (!store) {
+        static const uint8_t exts[] = {0, 0xBF, 0xB7, 0xBE, 0, 0, 0xB6, 0};
+        if (exts[func])
+          ext_r(exts[func], RAX, RAX);
+        store_guest(d.rD, RAX);
+      }
+      if (mode == 2) {
+        load_guest(RAX, d.rA);
+        alu_ri(ALU_ADD, RAX, d.imm);
+        store_guest(d.rA, RAX);
+      }
+      if (store)
+        emit_code_check(next, count);
+    } else {
+      emit_fallback(whole, pc, count, false);
+    }
+    break;
+  }
+}
+
+void JitX64::emit_fallback(const CPU::DecodedInsn &d, uint32_t pc, int count, bool branch) {
+  flush_regs();
+  mov_mi(disp(&cpu->pc), pc);
+  mov_ri64(ARG0, reinterpret_cast<uint64_t>(cpu));
+  mov_ri64(ARG1, reinterpret_cast<uint64_t>(&d));
+  emit_call(reinterpret_cast<const void *>(&CPU::execute_one));
+  reload_regs();
+  if (branch)
+    emit_exit_dynamic(count);
+}
+
+// Evaluate a guest condition, returning the host condition code that is set
+// when it holds, or CC_ALWAYS/CC_NEVER. Clobbers RAX, RCX and RDX
+int JitX64::emit_cond(uint8_t pattern) {
+  int32_t dcr1 = disp(&cpu->cr[1]);
+  switch (pattern) {
+  case 0x0:
+  case 0x1:
+  case 0x4:
+  case 0x5:
+  case 0xA:
+  case 0xB:
+  case 0xC:
+  case 0xD: {
+    static const uint8_t masks[] = {0x2, 0x2, 0, 0, 0x4, 0x4, 0, 0, 0, 0, 0x8, 0x8, 0x1, 0x1};
+    op_m(0xF6, 0, dcr1);
+    byte(masks[pattern]);
+    return (pattern & 1) ? CC_E : CC_NE;
+  }
+  case 0x2:
+  case 0x3:
+    // C && !Z
+    op_rm(0x8B, RCX, dcr1);
+    alu_ri(ALU_AND, RCX, 0x6);
+    alu_ri(ALU_CMP, RCX, 0x2);
+    return (pattern & 1) ? CC_NE : CC_E;
+  case 0x6:
+  case 0x7:
+    // (N == V) && !Z
+    op_rm(0x8B, RCX, dcr1);
+    op_rr(0x89, RDX, RCX);
+    shift_ri(SH_SHR, RDX, 3);
+    op_rr(0x31, RDX, RCX);
+    alu_ri(ALU_AND, RDX, 0x1);
+    alu_ri(ALU_AND, RCX, 0x4);
+    op_rr(0x09, RCX, RDX);
+    return (pattern & 1) ? CC_NE : CC_E;
+  case 0x8:
+  case 0x9:
+    // N == V
+    op_rm(0x8B, RCX, dcr1);
+    op_rr(0x89, RDX, RCX);
+    shift_ri(SH_SHR, RDX, 3);
+    op_rr(0x31, RCX, RDX);
+    alu_ri(ALU_AND, RCX, 0x1);
+    return (pattern & 1) ? CC_NE : CC_E;
+  case 0xE: {
+    // Decrement CNT, testing the old value
+    int32_t dcnt = disp(&cpu->CNT);
+    op_rm(0x8B, RDX, dcnt);
+    op_rr(0x89, RAX, RDX);
+    alu_ri(ALU_SUB, RAX, 1);
+    op_rm(0x89, RAX, dcnt);
+    op_rr(0x85, RDX, RDX);
+    return CC_G;
+  }
+  case 0xF:
+    return CC_ALWAYS;
+  default:
+    return CC_NEVER;
+  }
+}
+
+// Store the host N/Z/C/V flags into cr1, plus T for compares. Subtraction
+// inverts the host borrow to get the guest carry. Clobbers RAX, RCX and RDX
+void JitX64::emit_flags(bool invertC, int tcs) {
+  byte(0x9C); // pushfq
+  pop_r(RCX);
+  op_rr(0x89, RAX, RCX);
+  alu_ri(ALU_AND, RAX, 0x1);
+  if (invertC)
+    alu_ri(ALU_XOR, RAX, 0x1);
+  op_rr(0x01, RAX, RAX);
+  op_rr(0x89, RDX, RCX);
+  shift_ri(SH_SHR, RDX, 4);
+  alu_ri(ALU_AND, RDX, 0xC);
+  op_rr(0x09, RAX, RDX);
+  shift_ri(SH_SHR, RCX, 11);
+  alu_ri(ALU_AND, RCX, 0x1);
+  op_rr(0x09, RAX, RCX);
+  uint32_t mask = 0xF;
+  if (tcs == 0 || tcs == 1) {
+    // T takes Z or N
+    op_rr(0x89, RCX, RAX);
+    shift_ri(SH_SHL, RCX, (tcs == 0) ? 2 : 1);
+    alu_ri(ALU_AND, RCX, 0x10);
+    op_rr(0x09, RAX, RCX);
+    mask = 0x1F;
+  }
+  op_rm(0x8B, RCX, disp(&cpu->cr[1]));
+  alu_ri(ALU_AND, RCX, ~mask);
+  op_rr(0x09, RCX, RAX);
+  op_rm(0x89, RCX, disp(&cpu->cr[1]));
+}
+
+// N and Z from the result in RAX
+void JitX64::emit_basic_flags() {
+  op_rr(0x85, RAX, RAX);
+  byte(0x9C); // pushfq
+  pop_r(RCX);
+  shift_ri(SH_SHR, RCX, 4);
+  alu_ri(ALU_AND, RCX, 0xC);
+  op_rm(0x8B, RDX, disp(&cpu->cr[1]));
+  alu_ri(ALU_AND, RDX, ~0xCU);
+  op_rr(0x09, RDX, RCX);
+  op_rm(0x89, RDX, disp(&cpu->cr[1]));
+}
+
+// Leave the block if a store hit cached code, which may include this block
+void JitX64::emit_code_check(uint32_t nextPC, int count) {
+  op_m(0x80, ALU_CMP, disp(&cpu->codeInvalidated));
+  byte(0);
+  uint8_t *skip = jcc(CC_E);
+  emit_exit(nextPC, count);
+  patch(skip, ptr);
+}
+
+void JitX64::emit_exit(uint32_t target, int count) {
+  mov_mi(disp(&cpu->pc), target);
+  emit_exit_dynamic(count);
+}
+
+void JitX64::emit_exit_dynamic(int count) {
+  mov_ri(RAX, count);
+  exits.push_back(jmp());
+}
+
+void JitX64::emit_call(const void *fn) {
+  mov_ri64(RAX, reinterpret_cast<uint64_t>(fn));
+  byte(0xFF);
+  modrm_r(2, RAX);
+}
+
+void JitX64::emit_slow_loads() {
+  for (auto &slow : slowLoads) {
+    fastmemSites[slow.load] = {slow.site, ptr};
+    mov_mi(disp(&cpu->pc), slow.pc);
+    emit_call(slow.fn);
+    patch(jmp(), slow.resume);
+  }
+}
+
+void JitX64::flush_regs() {
+  for (int g : cached)
+    op_rm(0x89, hostFor[g], disp_r(g));
+}
+
+void JitX64::reload_regs() {
+  for (int g : cached)
+    op_rm(0x8B, hostFor[g], disp_r(g));
+}
+
+void JitX64::load_guest(int host, int g) {
+  if (hostFor[g] >= 0)
+    op_rr(0x89, host, hostFor[g]);
+  else
+    op_rm(0x8B, host, disp_r(g));
+}
+
+void JitX64::store_guest(int g, int host) {
+  if (hostFor[g] >= 0)
+    op_rr(0x89, hostFor[g], host);
+  else
+    op_rm(0x89, host, disp_r(g));
+}
+
+void JitX64::alu_guest(int ext, int host, int g) {
+  if (hostFor[g] >= 0)
+    op_rr((ext << 3) | 0x01, host, hostFor[g]);
+  else
+    op_rm((ext << 3) | 0x03, host, disp_r(g));
+}
+
+void JitX64::unary_guest(int ext, int g) {
+  if (hostFor[g] >= 0)
+    unary_r(ext, hostFor[g]);
+  else
+    op_m(0xF7, ext, disp_r(g));
+}
+
+int32_t JitX64::disp(const volatile void *field) const {
+  return int32_t(reinterpret_cast<const volatile uint8_t *>(field) - stateBase);
+}
+
+void JitX64::byte(uint8_t b) { *ptr++ = b; }
+
+void JitX64::dword(uint32_t d) {
+  memcpy(ptr, &d, 4);
+  ptr += 4;
+}
+
+void JitX64::qword(uint64_t q) {
+  memcpy(ptr, &q, 8);
+  ptr += 8;
+}
+
+void JitX64::rex(bool w, int reg, int rm) {
+  uint8_t prefix = 0x40 | (w ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+  if (prefix != 0x40)
+    byte(prefix);
+}
+
+void JitX64::modrm_r(int reg, int rm) { byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+void JitX64::modrm_m(int reg, int base, int32_t disp) {
+  int mod = (disp == 0 && (base & 7) != RBP) ? 0 : (disp >= -128 && disp <= 127) ? 1 : 2;
+  byte((mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP)
+    byte(0x24);
+  if (mod == 1)
+    byte(disp);
+  else if (mod == 2)
+    dword(disp);
+}
+
+void JitX64::op_rr(uint8_t opc, int rm, int reg) {
+  rex(false, reg, rm);
+  byte(opc);
+  modrm_r(reg, rm);
+}
+
+void JitX64::op_rm(uint8_t opc, int reg, int32_t disp) {
+  rex(false, reg, RBX);
+  byte(opc);
+  modrm_m(reg, RBX, disp);
+}
+
+void JitX64::op_m(uint8_t opc, int ext, int32_t disp) {
+  byte(opc);
+  modrm_m(ext, RBX, disp);
+}
+
+void JitX64::alu_ri(int ext, int reg, uint32_t imm) {
+  rex(false, 0, reg);
+  if (int32_t(imm) >= -128 && int32_t(imm) <= 127) {
+    byte(0x83);
+    modrm_r(ext, reg);
+    byte(imm);
+  } else {
+    byte(0x81);
+    modrm_r(ext, reg);
+    dword(imm);
+  }
+}
+
+void JitX64::mov_ri(int reg, uint32_t imm) {
+  rex(false, 0, reg);
+  byte(0xB8 + (reg & 7));
+  dword(imm);
+}
+
+void JitX64::mov_mi(int32_t disp, uint32_t imm) {
+  op_m(0xC7, 0, disp);
+  dword(imm);
+}
+
+void JitX64::mov_ri64(int reg, uint64_t imm) {
+  rex(true, 0, reg);
+  byte(0xB8 + (reg & 7));
+  qword(imm);
+}
+
+void JitX64::shift_ri(int ext, int reg, uint8_t imm) {
+  rex(false, 0, reg);
+  byte(0xC1);
+  modrm_r(ext, reg);
+  byte(imm);
+}
+
+void JitX64::shift_rcl(int ext, int reg) {
+  rex(false, 0, reg);
+  byte(0xD3);
+  modrm_r(ext, reg);
+}
+
+void JitX64::unary_r(int ext, int reg) {
+  rex(false, 0, reg);
+  byte(0xF7);
+  modrm_r(ext, reg);
+}
+
+// movzx/movsx from the low byte or word of a legacy register
+void JitX64::ext_r(uint8_t opc, int reg, int src) {
+  rex(false, reg, src);
+  byte(0x0F);
+  byte(opc);
+  modrm_r(reg, src);
+}
+
+void JitX64::setcc(int cc, int reg) {
+  byte(0x0F);
+  byte(0x90 + cc);
+  modrm_r(0, reg);
+}
+
+void JitX64::push_r(int reg) {
+  rex(false, 0, reg);
+  byte(0x50 + (reg & 7));
+}
+
+void JitX64::pop_r(int reg) {
+  rex(false, 0, reg);
+  byte(0x58 + (reg & 7));
+}
+
+uint8_t *JitX64::jcc(int cc) {
+  byte(0x0F);
+  byte(0x80 + cc);
+  uint8_t *rel = ptr;
+  dword(0);
+  return rel;
+}
+
+uint8_t *JitX64::jmp() {
+  byte(0xE9);
+  uint8_t *rel = ptr;
+  dword(0);
+  return rel;
+}
+
+void JitX64::patch(uint8_t *rel, uint8_t *target) {
+  int32_t off = int32_t(target - (rel + 4));
+  memcpy(rel, &off, 4);
+}
+
+} // namespace Emu293
+
+#endif
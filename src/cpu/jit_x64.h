@@ -0,0 +1,128 @@
+#pragma once
+#include "cpu.h"
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define EMU293_JIT_X64
+#endif
+
+using namespace std;
+namespace Emu293 {
+
+// x86-64 translator for decoded blocks. Guest state stays in the CPU object,
+// with the most used guest registers of each block held in callee saved host
+// registers while it runs. Anything not translated natively is handed back to
+// CPU::execute.
+class JitX64 {
+public:
+  typedef int (*BlockFn)();
+
+  JitX64(CPU *cpu);
+  ~JitX64();
+
+  /**
+   * Allocate the code buffer, returns false if executable memory is unavailable
+   */
+  bool init();
+
+  /**
+   * Translate a block, returning its entry point. The native code returns the
+   * number of instructions executed, with the CPU pc set to the next one
+   */
+  void *compile(const CPU::CodeBlock &blk);
+
+  /**
+   * True when there may not be room for another block
+   */
+  bool full() const;
+
+  /**
+   * Discard all translated code. Only call when all blocks have been dropped
+   */
+  void reset();
+
+  static inline int enter(void *native) { return reinterpret_cast<BlockFn>(native)(); }
+
+  /**
+   * For a fault at rip in a fastmem load, redirect that load to its memory
+   * handler call from now on and return where to resume, otherwise nullptr
+   */
+  uint8_t *fastmem_fault(uint8_t *rip);
+
+private:
+  // PCE halves are emitted with the whole pair, which fallbacks execute
+  void emit_insn(const CPU::DecodedInsn &d, const CPU::DecodedInsn &whole, uint32_t pc, int count);
+  void emit_fallback(const CPU::DecodedInsn &d, uint32_t pc, int count, bool branch);
+  int emit_cond(uint8_t pattern);
+  void emit_flags(bool invertC, int tcs);
+  void emit_basic_flags();
+  void emit_code_check(uint32_t nextPC, int count);
+  void emit_exit(uint32_t target, int count);
+  void emit_exit_dynamic(int count);
+  void emit_call(const void *fn);
+  void emit_slow_loads();
+  void flush_regs();
+  void reload_regs();
+
+  // Guest register access through the block's register cache
+  void load_guest(int host, int g);
+  void store_guest(int g, int host);
+  void alu_guest(int ext, int host, int g);
+  void unary_guest(int ext, int g);
+
+  // Encoders, 32-bit operand size unless noted. State operands are
+  // displacements from the state base register
+  void byte(uint8_t b);
+  void dword(uint32_t d);
+  void qword(uint64_t q);
+  void rex(bool w, int reg, int rm);
+  void modrm_r(int reg, int rm);
+  void modrm_m(int reg, int base, int32_t disp);
+  void op_rr(uint8_t opc, int rm, int reg);
+  void op_rm(uint8_t opc, int reg, int32_t disp);
+  void op_m(uint8_t opc, int ext, int32_t disp);
+  void alu_ri(int ext, int reg, uint32_t imm);
+  void mov_ri(int reg, uint32_t imm);
+  void mov_mi(int32_t disp, uint32_t imm);
+  void mov_ri64(int reg, uint64_t imm);
+  void shift_ri(int ext, int reg, uint8_t imm);
+  void shift_rcl(int ext, int reg);
+  void unary_r(int ext, int reg);
+  void ext_r(uint8_t opc, int reg, int src);
+  void setcc(int cc, int reg);
+  void push_r(int reg);
+  void pop_r(int reg);
+  uint8_t *jcc(int cc);
+  uint8_t *jmp();
+  void patch(uint8_t *rel, uint8_t *target);
+
+  // Displacements of CPU fields from the state base register
+  int32_t disp(const volatile void *field) const;
+  int32_t disp_r(int g) const { return disp(&cpu->r[g]); }
+
+  CPU *cpu;
+  uint8_t *stateBase;
+  uint8_t *code = nullptr, *ptr = nullptr, *codeEnd = nullptr;
+  // Host register holding each guest register in the current block, or -1
+  int8_t hostFor[32];
+  std::vector<int> cached;
+  std::vector<uint8_t *> exits;
+
+  // Loads from RAM go straight through the fastmem mirror when there is one.
+  // Each has an out of line memory handler call, which a fault patches in
+  struct SlowLoad {
+    uint8_t *site, *load, *resume;
+    const void *fn;
+    uint32_t pc;
+  };
+  struct FastmemSite {
+    uint8_t *site, *stub;
+  };
+  uint8_t *fastmem = nullptr;
+  std::vector<SlowLoad> slowLoads;
+  // Keyed by the address of the faulting load
+  std::unordered_map<uint8_t *, FastmemSite> fastmemSites;
+};
+
+} // namespace Emu293
@@ -124,6 +124,7 @@ void apbdma_work(int chn) {
       } else {
         hooks[foundHook].ContinuousReadHandler(paddr, len, ramBuf);
       }
+      mark_dma_write(dma_regs[dma_ahb_start_a + chn], len);
     } else {
       if (check_bit(cur_setting, dma_set_addr_mode)) {
         hooks[foundHook].RegularWriteHandler(paddr, len, ramBuf);
@@ -272,5 +273,9 @@ const Peripheral APBDMAPeripheral = {"APBDMA", InitAPBDMADevice,
                                      APBDMADeviceReadHandler,
                                      APBDMADeviceWriteHandler,
                                      APBDMADeviceResetHandler,
-                                    APBDMADeviceDeviceState};
+                                    APBDMADeviceDeviceState,
+                                    nullptr,
+                                    0,
+                                    nullptr,
+                                    nullptr};
 }
@@ -167,6 +167,20 @@ static uint32_t descrambleWord(uint32_t din) {
   return result;
 }
 
+// Report the span the destination covers, descrambled copies store words
+static void MarkDestWritten() {
+  uint32_t lo, hi;
+  if (dest.blockmode) {
+    lo = dest.base + 2 * (dest.width * dest.offy + dest.offx);
+    hi = dest.base + 2 * dest.width * dest.height + 2;
+  } else {
+    lo = dest.start;
+    hi = dest.start + 2 * currentTransfer.width * currentTransfer.height + 2;
+  }
+  if (hi > lo)
+    mark_dma_write(0xA0000000 + lo, hi - lo);
+}
+
 static void blndma_worker() {
   if (!check_bit(blndma_regs[blndma_ctrl_1], blndma_ctrl1_start)) {
     blndma_workAvailable = false;
@@ -328,6 +342,8 @@ static void blndma_worker() {
     }
   } break;
   }
+  if (currentTransfer.mode != TransferInfo::Idle)
+    MarkDestWritten();
   clear_bit(blndma_regs[blndma_ctrl_1], blndma_ctrl1_start);
   clear_bit(blndma_regs[blndma_irq_ctrl], blndma_irq_status);
   if (check_bit(blndma_regs[blndma_irq_ctrl], blndma_irq_int_en)) {
@@ -428,5 +444,9 @@ const Peripheral BLNDMAPeripheral = {"BLNDMA", InitBLNDMADevice,
                                      BLNDMADeviceReadHandler,
                                      BLNDMADeviceWriteHandler,
                                      BLNDMADeviceResetHandler,
-                                     BLNDMADeviceDeviceState};
+                                     BLNDMADeviceDeviceState,
+                                     nullptr,
+                                     0,
+                                     nullptr,
+                                     nullptr};
 } // namespace Emu293
@@ -1,8 +1,14 @@
 #include "cpu/cpu.h"
+#include "cpu/hle.h"
 #include "dma/apbdma.h"
 #include "dma/blndma.h"
 #include "loadelf.h"
 #include "stor/sdcard.h"
+#include "sys/headless.h"
+#include "sys/rewind.h"
+#include "sys/runahead.h"
+#include "sys/scheduler.h"
+#include "sys/sync.h"
 #include "sys/timer.h"
 #include "video/ppu.h"
 #include "video/tve.h"
@@ -18,6 +24,10 @@
 #include <chrono>
 #include <vector>
 #include <functional>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #ifdef WIN32
 #include <io.h>
@@ -27,8 +37,10 @@
 #include <unistd.h>
 #endif
 
+#ifndef EMU293_NO_GUI
 #include <wx/msgdlg.h>
 #include <wx/wx.h>
+#endif
 
 
 using namespace Emu293;
@@ -42,6 +54,16 @@ std::string sd_card;
 std::string save_dir = "../roms";
 
 bool nor_boot;
+CPU::Engine cpu_engine = CPU::ENGINE_INTERP;
+bool idle_skip = true;
+bool use_hle = true;
+std::string aot_lib;
+std::string aot_gen_file;
+int autosave_minutes = 0;
+// Boot snapshots are kept here, taken at a frame or once PC reaches an address
+std::string boot_cache_dir;
+uint64_t boot_cache_frame = 600;
+uint32_t boot_cache_pc = 0;
 
 void null_configure() {};
 void zone3d_configure() { zone3d_pad_mode = true; }
@@ -62,7 +84,7 @@ static const std::vector<PlatformPreset> platforms = {
   {"zone3d", "Zone Interactive 3D", "zone3d.img", "", "zone_25l8006e_c22014.bin", zone3d_configure},
 };
 
-
+#ifndef EMU293_NO_GUI
 class LoadUI : public wxApp {
   bool OnInit() {
     while (true ){
@@ -139,21 +161,83 @@ void show_load_ui(int argc, char *argv[]) {
     app->MainLoop();
   }
 }
+#endif
 
 std::string state_file(int slot) {
   return stringf("%s/slot_%d.sav", save_dir.c_str(), slot);
 }
 
+// Boot snapshots are named boot_<setup>_<sd>.sav. The setup part covers the
+// boot image contents, the SD image path and the options that matter
+std::string boot_cache_setup() {
+  std::ifstream in(elf_file, std::ios::binary);
+  if (!in)
+    return "";
+  std::vector<char> image((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  std::string key = stringf("%s %d %d %d %llu %08x", sd_card.c_str(), nor_boot, use_hle,
+                            zone3d_pad_mode, (unsigned long long)boot_cache_frame, boot_cache_pc);
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef *>(image.data()), image.size());
+  crc = crc32(crc, reinterpret_cast<const Bytef *>(key.data()), key.size());
+  uint32_t adler = adler32(1, reinterpret_cast<const Bytef *>(image.data()), image.size());
+  adler = adler32(adler, reinterpret_cast<const Bytef *>(key.data()), key.size());
+  return stringf("%08x%08x", crc, adler);
 }
 
+// The SD part is its size, modification time and first and last 64KB as they
+// are now, which change whenever the guest writes to it
+std::string boot_cache_file(const std::string &setup) {
+  struct stat sd;
+  if (stat(sd_card.c_str(), &sd) != 0)
+    return "";
+#if defined(_WIN32)
+  long mtime_ns = 0;
+#elif defined(__APPLE__)
+  long mtime_ns = sd.st_mtimespec.tv_nsec;
+#else
+  long mtime_ns = sd.st_mtim.tv_nsec;
+#endif
+  std::string key = stringf("%llu %llu %ld", (unsigned long long)sd.st_size,
+                            (unsigned long long)sd.st_mtime, mtime_ns);
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef *>(key.data()), key.size());
+  std::ifstream in(sd_card, std::ios::binary);
+  std::vector<char> block(65536);
+  for (bool last : {false, true}) {
+    if (last)
+      in.seekg(-std::streamoff(std::min<uint64_t>(block.size(), sd.st_size)), std::ios::end);
+    in.read(block.data(), block.size());
+    crc = crc32(crc, reinterpret_cast<const Bytef *>(block.data()), in.gcount());
+    in.clear();
+  }
+  return stringf("%s/boot_%s_%08x.sav", boot_cache_dir.c_str(), setup.c_str(), crc);
+}
 
-int main(int argc, char *argv[]) {
-  SDL_Init(SDL_INIT_EVERYTHING);
+// Snapshots of the same setup with older SD contents can never be used again
+void boot_cache_prune(const std::string &setup, const std::string &keep) {
+  DIR *dir = opendir(boot_cache_dir.c_str());
+  if (dir == nullptr)
+    return;
+  std::string prefix = stringf("boot_%s_", setup.c_str());
+  while (struct dirent *ent = readdir(dir)) {
+    std::string name = ent->d_name;
+    std::string path = stringf("%s/%s", boot_cache_dir.c_str(), name.c_str());
+    if (name.compare(0, prefix.size(), prefix) == 0 && name.size() > 4 &&
+        name.compare(name.size() - 4, 4, ".sav") == 0 && path != keep)
+      remove(path.c_str());
+  }
+  closedir(dir);
+}
+
+}
 
+
+int main(int argc, char *argv[]) {
+#ifndef EMU293_NO_GUI
   if (argc == 1) {
-    // TODO: show selector GUI
+    SDL_Init(SDL_INIT_EVERYTHING);
     show_load_ui(argc, argv);
-  } else {
+  } else
+#endif
+  {
 
     int argidx = 1;
 
@@ -179,6 +263,118 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(argv[argidx], "-zone3d") == 0) {
           argidx++;
           zone3d_pad_mode = true;
+        } else if (strcmp(argv[argidx], "-cpu") == 0) {
+          argidx++;
+          if (argidx < argc && strcmp(argv[argidx], "interp") == 0)
+            cpu_engine = CPU::ENGINE_INTERP;
+          else if (argidx < argc && strcmp(argv[argidx], "jit") == 0)
+            cpu_engine = CPU::ENGINE_JIT;
+          else
+            goto usage;
+          argidx++;
+        } else if (strcmp(argv[argidx], "-noidle") == 0) {
+          argidx++;
+          idle_skip = false;
+        } else if (strcmp(argv[argidx], "-nohle") == 0) {
+          argidx++;
+          use_hle = false;
+        } else if (strcmp(argv[argidx], "-sync") == 0) {
+          argidx++;
+          if (argidx < argc && strcmp(argv[argidx], "audio") == 0)
+            sync_source = SYNC_AUDIO;
+          else if (argidx < argc && strcmp(argv[argidx], "video") == 0)
+            sync_source = SYNC_VIDEO;
+          else if (argidx < argc && strcmp(argv[argidx], "wall") == 0)
+            sync_source = SYNC_WALL;
+          else if (argidx < argc && strcmp(argv[argidx], "none") == 0)
+            sync_source = SYNC_NONE;
+          else
+            goto usage;
+          argidx++;
+        } else if (strcmp(argv[argidx], "-speed") == 0 || strcmp(argv[argidx], "-ffspeed") == 0) {
+          double &speed = (strcmp(argv[argidx], "-speed") == 0) ? sync_speed : sync_ff_speed;
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          speed = std::atof(argv[argidx++]);
+          if (speed < 0) {
+            printf("Speed must be a multiple of real time, or 0 for uncapped.\n");
+            return 1;
+          }
+        } else if (strcmp(argv[argidx], "-runahead") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          run_ahead_frames = std::atoi(argv[argidx++]);
+          if (run_ahead_frames < 0 || run_ahead_frames > 8) {
+            printf("Run-ahead must be between 0 and 8 frames.\n");
+            return 1;
+          }
+        } else if (strcmp(argv[argidx], "-rewind") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          rewind_seconds = std::atoi(argv[argidx++]);
+          if (rewind_seconds < 0) {
+            printf("Rewind length must be in seconds.\n");
+            return 1;
+          }
+        } else if (strcmp(argv[argidx], "-autosave") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          autosave_minutes = std::atoi(argv[argidx++]);
+        } else if (strcmp(argv[argidx], "-bootcache") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          boot_cache_dir = std::string(argv[argidx++]);
+        } else if (strcmp(argv[argidx], "-bootframe") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          boot_cache_frame = std::strtoull(argv[argidx++], nullptr, 10);
+        } else if (strcmp(argv[argidx], "-bootpc") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          boot_cache_pc = std::strtoul(argv[argidx++], nullptr, 16);
+        } else if (strcmp(argv[argidx], "-aot") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          aot_lib = std::string(argv[argidx++]);
+        } else if (strcmp(argv[argidx], "-aotgen") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          aot_gen_file = std::string(argv[argidx++]);
+        } else if (strcmp(argv[argidx], "-headless") == 0) {
+          argidx++;
+          headless = true;
+        } else if (strcmp(argv[argidx], "-frames") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          headless_frames = std::strtoull(argv[argidx++], nullptr, 10);
+        } else if (strcmp(argv[argidx], "-seconds") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          headless_seconds = std::atof(argv[argidx++]);
+        } else if (strcmp(argv[argidx], "-input") == 0) {
+          argidx++;
+          if (argidx >= argc || !HeadlessLoadInput(argv[argidx++]))
+            return 1;
+        } else if (strcmp(argv[argidx], "-dumpframes") == 0) {
+          argidx++;
+          if (argidx >= argc || !HeadlessSetDumpFrames(argv[argidx++]))
+            goto usage;
+        } else if (strcmp(argv[argidx], "-hashes") == 0) {
+          argidx++;
+          if (argidx >= argc)
+            goto usage;
+          headless_hash_file = std::string(argv[argidx++]);
         } else if (*(argv[argidx]) != '-') {
           break;
         } else {
@@ -191,12 +387,26 @@ int main(int argc, char *argv[]) {
     elf_file = argv[argidx++];
     sd_card = argv[argidx++];
 
+    if (headless && headless_frames == 0 && headless_seconds <= 0) {
+      printf("-headless needs a limit from -frames or -seconds\n");
+      goto usage;
+    }
+
     if (false) {
 usage:
-      printf("Usage: ./emu293 [-cam /dev/videoN] [-scale {1,2,3,4}] [-zone3d] [-nor] lead.sys sdcard.img\n");
+      printf("Usage: ./emu293 [-cam /dev/videoN] [-scale {1,2,3,4}] [-zone3d] [-nor] [-cpu {interp,jit}] [-noidle] [-nohle] [-sync {audio,video,wall,none}] [-speed X] [-ffspeed X] [-runahead N] [-rewind seconds] [-autosave minutes] [-bootcache dir [-bootframe N | -bootpc addr]] [-aot lib.so] [-aotgen out.cpp] lead.sys sdcard.img\n");
+      printf("       ./emu293 -headless {-frames N | -seconds S} [-input script.txt] [-dumpframes N,...] [-hashes out.txt] [options...] lead.sys sdcard.img\n");
       return 2;
     }
 
+    if (headless) {
+      // Every frame is hashed, so none can be thrown away or repeated
+      run_ahead_frames = 0;
+      rewind_seconds = 0;
+      sync_source = SYNC_NONE;
+    } else {
+      SDL_Init(SDL_INIT_EVERYTHING);
+    }
   }
 
   uint32_t entryPoint, stackAddr;
@@ -214,6 +424,7 @@ usage:
   CPU scoreCPU;
 
   scoreCPU.reset();
+  scoreCPU.set_engine(cpu_engine);
 
   //	scoreCPU.cr29 = 0x20000000;
   auto do_load_image = [&]() {
@@ -230,64 +441,93 @@ usage:
         exit(1);
       }
       printf("Loaded ELF to RAM (ep=0x%08x)!\n", entryPoint);
+      if (use_hle)
+        hle_install(scoreCPU);
     }
     scoreCPU.pc = entryPoint;
   };
   do_load_image();
 
+  if (!aot_gen_file.empty()) {
+    if (nor_boot) {
+      printf("Translation needs an ELF boot image\n");
+      exit(1);
+    }
+    // Functions are found from the symbol table, the rest by following
+    // branches from them
+    std::vector<uint32_t> entries = {entryPoint};
+    for (auto &sym : symbols_fwd)
+      entries.push_back(sym.second);
+    exit(scoreCPU.aot_generate(aot_gen_file, entries, elf_seg_start, elf_seg_end) ? 0 : 1);
+  }
+  if (!aot_lib.empty())
+    scoreCPU.load_aot(aot_lib);
+
   system_init(&scoreCPU);
+  IRGamepadInit();
+  InitSync();
   write_memU32(0xFFFFFFEC, 1);
-  int icount = 0;
+  // Start from where a previous run had already booted to, if it can
+  std::string boot_setup;
+  uint64_t boot_cache_tried = UINT64_MAX;
+  if (!boot_cache_dir.empty()) {
+    boot_setup = boot_cache_setup();
+    std::string file = boot_setup.empty() ? "" : boot_cache_file(boot_setup);
+    if (!file.empty() && access(file.c_str(), F_OK) == 0 && system_load_state(file)) {
+      printf("Restored boot snapshot %s\n", file.c_str());
+      boot_setup.clear();
+    } else if (boot_cache_pc != 0) {
+      scoreCPU.set_stop_pc(boot_cache_pc);
+    }
+  }
+  uint64_t last_host = sched_now(), last_report = sched_now(), last_autosave = sched_now();
   auto start = std::chrono::steady_clock::now();
-  int64_t t32k_rate = 1000000000/32768;
-  int64_t t32k_next = std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count()
-    + t32k_rate;
+  if (headless)
+    HeadlessBegin();
 
   while (1) {
-    scoreCPU.step();
-    icount++;
-
-    if ((icount % 4) == 0) {
-      TimerTick(false); // main PCLK/2
-      // SDL_Delay(1);
-    }
-
-    if ((icount % 320) == 0) {
-      IRGamepadTick();
-    }
-
-    if ((icount % 200) == 0) {
-      SPUUpdate();
-    }
-
-
-    if ((icount % 2000) == 1000) {
-      PPUTick();
-
-      // SDL_Delay(1);
+    if (rewind_held && rewind_seconds > 0) {
+      // Emulation stands still, showing each step back
+      if (RewindStep())
+        PPUPresent();
+      PPUPollEvents();
+      std::this_thread::sleep_for(std::chrono::milliseconds(RewindStepMs()));
+      if (shutdown_flag)
+        break;
+      continue;
     }
-
-    if ((icount % 2000) == 1500) {
-      TVETick();
-
-      // SDL_Delay(1);
+    // Peripherals are driven by their own events, see sys/scheduler.h
+    sched_run(scoreCPU, 1000, idle_skip);
+    // The CPU stops at -bootpc, so this sees it. If another save is still being
+    // written, try again next frame
+    if (!boot_setup.empty() && ppu_frame_count != boot_cache_tried &&
+        (boot_cache_pc != 0 ? (scoreCPU.pc == boot_cache_pc) : (ppu_frame_count >= boot_cache_frame))) {
+      boot_cache_tried = ppu_frame_count;
+      std::string file = boot_cache_file(boot_setup);
+      if (file.empty() || system_save_state_async(file)) {
+        if (!file.empty())
+          boot_cache_prune(boot_setup, file);
+        boot_setup.clear();
+        scoreCPU.set_stop_pc(0);
+      }
     }
+    if (run_ahead_frames > 0)
+      RunAheadStep(scoreCPU, idle_skip);
+    RewindUpdate();
 
-    if ((icount % 100) == 0) {
+    if ((sched_now() - last_host) >= 100) {
+      last_host = sched_now();
       fflush(stdout);
       auto t = std::chrono::steady_clock::now();
-      int64_t t_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
       auto delta = std::chrono::duration<float>(t - start).count();
 
-      if (t_ns >= t32k_next) {
-        TimerTick(true); // 32kHz
-        t32k_next = std::max(t_ns+t32k_rate/2, t32k_next+t32k_rate);
-      }
-
-      if (delta > 1) {
-        printf("%.02fMIPS\n", (icount / 1000000.0) /
+      if (headless) {
+        if (HeadlessDone())
+          break;
+      } else if (delta > 1) {
+        printf("%.02fMHz\n", ((sched_now() - last_report) / 1000000.0) /
                                   delta);
-        icount = 0;
+        last_report = sched_now();
         start = t;
         printf("PC=0x%08x\n", scoreCPU.pc);
       }
@@ -299,23 +539,29 @@ usage:
       if (shutdown_flag) {
         break;
       }
-      if (savestate_flag != -1 || loadstate_flag != -1) {
-        bool is_save = (savestate_flag != -1);
-        auto file = state_file(is_save ? savestate_flag : loadstate_flag);
-        SaveStater ss; 
-        if(is_save ? ss.begin_save(file) : ss.begin_load(file)) {
-          ss.i(icount);
-          system_state(ss);
-          ss.finalise();
-          printf("%s state %s slot %d\n", (is_save ? "Saved" : "Loaded"), (is_save ? "to" : "from"),
-            is_save ? savestate_flag : loadstate_flag);
+      if (autosave_minutes > 0 &&
+          (sched_now() - last_autosave) >= uint64_t(autosave_minutes) * 60 * MASTER_CLOCK_HZ) {
+        last_autosave = sched_now();
+        system_save_state_async(stringf("%s/autosave.sav", save_dir.c_str()));
+      }
+      if (savestate_flag != -1) {
+        // Written out in the background, which reports when done
+        if (system_save_state_async(state_file(savestate_flag)))
+          printf("Saving state to slot %d\n", savestate_flag);
+      } else if (loadstate_flag != -1) {
+        if (system_load_state(state_file(loadstate_flag))) {
+          last_host = last_report = last_autosave = sched_now();
+          printf("Loaded state from slot %d\n", loadstate_flag);
         }
-        savestate_flag = -1;
-        loadstate_flag = -1;
       }
+      savestate_flag = -1;
+      loadstate_flag = -1;
     }
     // SDL_Delay(1);
   }
+  if (headless)
+    HeadlessReport();
+  system_save_state_wait();
   ShutdownCSI();
   ShutdownSPU();
   webcam_stop();
@@ -0,0 +1,75 @@
+#include "guestmem.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace Emu293 {
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// A normal page is left mapped past the end, as accesses straddling the end of
+// a region read or write a few bytes beyond it
+#define GUARD_SIZE 4096
+
+#ifdef _WIN32
+// Committed pages are still only backed on first touch
+uint8_t *guest_alloc(size_t size) {
+  void *mem = VirtualAlloc(nullptr, size + GUARD_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (mem == nullptr) {
+    printf("Failed to allocate %uMB of guest memory\n", unsigned(size >> 20));
+    exit(1);
+  }
+  return static_cast<uint8_t *>(mem);
+}
+
+void guest_free(uint8_t *ptr, size_t size) { VirtualFree(ptr, 0, MEM_RELEASE); }
+
+void guest_advise_huge(uint8_t *ptr, size_t size) {}
+#else
+uint8_t *guest_alloc(size_t size) {
+  // Over allocate so the block starts on a huge page boundary, which
+  // transparent huge pages need
+  size_t padded = size + HUGE_PAGE_SIZE;
+  void *mem = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    printf("Failed to allocate %uMB of guest memory\n", unsigned(size >> 20));
+    exit(1);
+  }
+  uint8_t *base = static_cast<uint8_t *>(mem);
+  uint8_t *aligned = reinterpret_cast<uint8_t *>(
+      (reinterpret_cast<uintptr_t>(base) + HUGE_PAGE_SIZE - 1) & ~uintptr_t(HUGE_PAGE_SIZE - 1));
+  if (aligned != base)
+    munmap(base, aligned - base);
+  if ((base + padded) != (aligned + size + GUARD_SIZE))
+    munmap(aligned + size + GUARD_SIZE, (base + padded) - (aligned + size + GUARD_SIZE));
+#ifdef MAP_HUGETLB
+  // Only succeeds if the admin has set aside a huge page pool for us
+  if ((size % HUGE_PAGE_SIZE) == 0) {
+    if (mmap(aligned, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED)
+      return aligned;
+    if (mmap(aligned, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+      printf("Failed to allocate %uMB of guest memory\n", unsigned(size >> 20));
+      exit(1);
+    }
+  }
+#endif
+  guest_advise_huge(aligned, size);
+  return aligned;
+}
+
+void guest_free(uint8_t *ptr, size_t size) { munmap(ptr, size + GUARD_SIZE); }
+
+void guest_advise_huge(uint8_t *ptr, size_t size) {
+#ifdef MADV_HUGEPAGE
+  madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+}
+#endif
+} // namespace Emu293
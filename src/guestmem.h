@@ -0,0 +1,14 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace Emu293 {
+// Zeroed memory for large guest regions. Pages are only backed once touched,
+// and huge pages are used where the host has them so guest accesses spread
+// over RAM don't thrash the TLB. Exits on failure, as nothing can run without
+uint8_t *guest_alloc(size_t size);
+void guest_free(uint8_t *ptr, size_t size);
+
+// Asks for huge pages over an existing mapping, where supported
+void guest_advise_huge(uint8_t *ptr, size_t size);
+} // namespace Emu293
@@ -116,16 +116,54 @@ namespace Emu293 {
         tag("SAVESTATE_00000");
         return true;
     }
+    void SaveStater::begin_load(std::vector<uint8_t> &data) {
+        is_load = true;
+        buf = &data;
+        pos = 0;
+        tag("SAVESTATE_00000");
+    }
+    void SaveStater::begin_save(std::vector<uint8_t> &data) {
+        is_load = false;
+        buf = &data;
+        buf->clear();
+        tag("SAVESTATE_00000");
+    }
     void SaveStater::finalise() {
-        gzclose(f);
+        if (f)
+            gzclose(f);
+        f = nullptr;
+        buf = nullptr;
     }
 
     bool is_load = false;
     uint8_t SaveStater::raw_r() {
+        if (buf)
+            return (pos < buf->size()) ? (*buf)[pos++] : 0;
         return gzgetc(f);
     }
     void SaveStater::raw_w(uint8_t b) {
-        gzputc(f, b);
+        if (buf)
+            buf->push_back(b);
+        else
+            gzputc(f, b);
+    }
+    void SaveStater::raw_r(uint8_t *data, size_t len) {
+        if (buf) {
+            size_t avail = (pos < buf->size()) ? min(len, buf->size() - pos) : 0;
+            if (avail)
+                copy(buf->begin() + pos, buf->begin() + pos + avail, data);
+            fill(data + avail, data + len, 0);
+            pos += len;
+        } else {
+            int got = gzread(f, data, len);
+            fill(data + max(got, 0), data + len, 0);
+        }
+    }
+    void SaveStater::raw_w(const uint8_t *data, size_t len) {
+        if (buf)
+            buf->insert(buf->end(), data, data + len);
+        else
+            gzwrite(f, data, len);
     }
     void SaveStater::tag(const std::string &tag) {
         if (is_load) {
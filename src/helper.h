@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <string>
 #include <fstream>
+#include <type_traits>
+#include <vector>
 using namespace std;
 
 //Useful macros
@@ -66,6 +68,20 @@ namespace Emu293 {
 		return (val >> (byte * 8)) & 0xFF;
 	}
 
+	//index of the lowest set bit, val must not be zero
+	inline int ctz64(uint64_t val) {
+	#if defined(__GNUC__)
+		return __builtin_ctzll(val);
+	#else
+		int idx = 0;
+		while (!(val & 1)) {
+			val >>= 1;
+			idx++;
+		}
+		return idx;
+	#endif
+	}
+
 	inline uint32_t swap_endian(uint32_t val) {
 		uint32_t result = 0;
 		result |= (val >> 24) & 0xFF;
@@ -79,14 +95,23 @@ namespace Emu293 {
 	void write_bmp(std::string filename, int width, int height, uint32_t *data);
 
 	struct SaveStater {
-		gzFile f;
+		gzFile f = nullptr;
 		bool begin_load(const std::string &file);
 		bool begin_save(const std::string &file);
+		// To and from memory instead of a file
+		std::vector<uint8_t> *buf = nullptr;
+		size_t pos = 0;
+		void begin_load(std::vector<uint8_t> &data);
+		void begin_save(std::vector<uint8_t> &data);
 		void finalise();
 
 		bool is_load = false;
+		// Loading a snapshot that has already dropped any code it changed
+		bool keep_code = false;
 		uint8_t raw_r();
 		void raw_w(uint8_t b);
+		void raw_r(uint8_t *data, size_t len);
+		void raw_w(const uint8_t *data, size_t len);
 
 		void tag(const std::string &tag);
 		template <typename T> void i(T& value) {
@@ -112,6 +137,14 @@ namespace Emu293 {
 			}
 		}
 		template <typename T, size_t N> void a(T(&value)[N]) {
+			// Already in the little endian order i() uses
+			if (std::is_integral<T>::value) {
+				if (is_load)
+					raw_r(reinterpret_cast<uint8_t *>(value), sizeof(value));
+				else
+					raw_w(reinterpret_cast<const uint8_t *>(value), sizeof(value));
+				return;
+			}
 			for (unsigned idx = 0; idx < N; idx++) {
 				i(value[idx]);
 			}
@@ -1,6 +1,7 @@
 #include "ir_gamepad.h"
 #include "../system.h"
 #include "../sys/gpio.h"
+#include "../sys/scheduler.h"
 
 #include <cstdio>
 #include <map>
@@ -11,8 +12,9 @@ using namespace std;
 namespace Emu293 {
   static int count = 0;
 
-  // ratio between IRGamepadTick call frequency and timer frequency
+  // ratio between IR tick frequency and timer frequency
   static int tick_ratio = 10;
+  static const int ir_tick_cycles = 320;
 
   bool softreset_flag = false;
   bool zone3d_pad_mode = false;
@@ -62,10 +64,11 @@ namespace Emu293 {
     return ~result;
   }
 
+  static bool last_clk = false;
+  static bool last_latch = false;
+  static uint16_t shiftreg[2] = {0};
+
   static void tick_zone3d() {
-    static bool last_clk = false;
-    static bool last_latch = false;
-    static uint16_t shiftreg[2] = {0};
     bool curr_latch = GetGPIOState(GPIO_PORT_I, 1) == GPIO_HIGH;
     bool curr_clk = GetGPIOState(GPIO_PORT_I, 0) == GPIO_HIGH;
 
@@ -125,14 +128,29 @@ namespace Emu293 {
     }
   }
 
-  void IRGamepadTick() {
+  static void ir_event(uint64_t when) {
     if (zone3d_pad_mode) {
       tick_zone3d();
-    } else {
-      tick_subor();
+      sched_set(EVT_IR, when + ir_tick_cycles);
+      return;
+    }
+    tick_subor();
+    // Nothing happens until the countdown to the next edge runs out, and
+    // nothing at all while there is nothing to send
+    if (active) {
+      sched_set(EVT_IR, when + ir_tick_cycles * (timer + 1));
+      timer = 0;
+    } else if (!packets.empty()) {
+      sched_set(EVT_IR, when + ir_tick_cycles);
     }
   }
 
+  void IRGamepadInit() {
+    sched_register(EVT_IR, ir_event);
+    if (zone3d_pad_mode)
+      sched_set(EVT_IR, sched_now() + ir_tick_cycles);
+  }
+
   static uint16_t add_checksum(uint16_t send) {
     uint8_t cksum = 0;
     for (int i = 1; i < 4; i++) { // upper 4 nibbles
@@ -144,6 +162,8 @@ namespace Emu293 {
 
   static void do_send(uint16_t data) {
     packets.push(add_checksum(data));
+    if (!sched_pending(EVT_IR))
+      sched_set(EVT_IR, sched_now() + ir_tick_cycles);
   }
 
   void IRGamepadUpdate(int player, uint16_t state) {
@@ -155,6 +175,49 @@ namespace Emu293 {
     }
   }
 
+  void IRGamepadState(SaveStater &s) {
+    s.tag("IRPAD");
+    s.i(timer);
+    s.i(bits);
+    s.i(sr);
+    s.i(active);
+    s.a(player_state);
+    s.i(last_clk);
+    s.i(last_latch);
+    s.a(shiftreg);
+    uint32_t queued = packets.size();
+    s.i(queued);
+    if (s.is_load) {
+      packets = std::queue<uint16_t>();
+      for (uint32_t i = 0; i < queued; i++) {
+        uint16_t data = 0;
+        s.i(data);
+        packets.push(data);
+      }
+    } else {
+      // Only front and back are accessible, so cycle through
+      for (uint32_t i = 0; i < queued; i++) {
+        uint16_t data = packets.front();
+        packets.pop();
+        s.i(data);
+        packets.push(data);
+      }
+    }
+  }
+
+  void IRGamepadSet(int player, uint16_t state) {
+    player_state[player - 1] = state;
+    IRGamepadUpdate(player, state);
+  }
+
+  uint16_t IRGamepadButton(const std::string &name) {
+    static const map<string, uint16_t> names = {
+      {"a", BTN_A}, {"b", BTN_B}, {"m", BTN_M}, {"start", BTN_START}, {"select", BTN_SELECT},
+      {"up", BTN_UP}, {"down", BTN_DOWN}, {"left", BTN_LEFT}, {"right", BTN_RIGHT}
+    };
+    auto found = names.find(name);
+    return (found == names.end()) ? 0 : found->second;
+  }
 
 
   static const map<SDL_Scancode, int> player_keys[2] = {
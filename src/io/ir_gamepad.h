@@ -4,9 +4,14 @@
 #include "SDL2/SDL.h"
 namespace Emu293 {
 
-	void IRGamepadTick();
+	void IRGamepadInit();
 	void IRGamepadUpdate(int player, uint16_t state);
 	void IRGamepadEvent(SDL_Event *ev);
+	void IRGamepadState(SaveStater &s);
+	// Sets every button for player 1 or 2, as if from the keyboard
+	void IRGamepadSet(int player, uint16_t state);
+	// Button mask from a name such as "start" or "left", or 0 if unknown
+	uint16_t IRGamepadButton(const std::string &name);
 	extern bool softreset_flag;
 	extern bool zone3d_pad_mode;
 }
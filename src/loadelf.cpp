@@ -7,6 +7,7 @@ namespace Emu293 {
 
 	std::unordered_map<std::string, uint32_t> symbols_fwd;
 	std::unordered_map<uint32_t, std::string> symbols_bwd;
+	uint32_t elf_seg_start, elf_seg_end;
 
 	uint32_t LoadElfToRAM(const char *filename) {
 		FILE  *elfFile;
@@ -64,6 +65,8 @@ namespace Emu293 {
 			write_memU8(segVaddr + i,tmpBuf[i]);
 		}
 		delete[] tmpBuf;
+		elf_seg_start = segVaddr;
+		elf_seg_end = segVaddr + segMemSz;
 
 		std::vector<char> strtab;
 		for (int i = 0; i < shNum; i++) {
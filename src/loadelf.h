@@ -12,5 +12,7 @@ namespace Emu293 {
 	bool LoadNORToRAM(const char *filename, uint32_t &entryPoint, uint32_t &stackPtr);
 	extern std::unordered_map<std::string, uint32_t> symbols_fwd;
 	extern std::unordered_map<uint32_t, std::string> symbols_bwd;
+	//Address range of the segment loaded by LoadElfToRAM
+	extern uint32_t elf_seg_start, elf_seg_end;
 
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include "helper.h"
 #include "cpu/cpu.h"
+#include <initializer_list>
 namespace Emu293 {
 //Info passed to peripheral when initialising
 struct PeripheralInitInfo {
@@ -22,6 +23,26 @@ struct Peripheral {
 	WriteHandler regWrite;
 	ResetHandler reset;
 	StateHandler state;
+	//Optional register file: 32-bit accesses to regs[0, regCount) read and
+	//write it directly, only registers set in the side effect bitmaps (nullptr
+	//for none) go through the handlers
+	uint32_t *regs;
+	uint32_t regCount;
+	const uint64_t *readSideEffects;
+	const uint64_t *writeSideEffects;
 };
 
+//Side effect bitmap over a register file of N registers
+template <size_t N> struct RegBitmap {
+	uint64_t bits[(N + 63) / 64] = {};
+	RegBitmap(std::initializer_list<uint32_t> regs) {
+		for (uint32_t reg : regs)
+			bits[reg / 64] |= 1ULL << (reg % 64);
+	}
+};
+
+static inline bool has_side_effect(const uint64_t *bitmap, uint32_t reg) {
+	return bitmap && ((bitmap[reg / 64] >> (reg % 64)) & 1);
+}
+
 }
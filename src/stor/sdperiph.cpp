@@ -311,5 +311,5 @@ void SDDeviceState(SaveStater &s) {
 
 const Peripheral SDPeripheral = {"SD", InitSDDevice, SDDeviceReadHandler,
                                  SDDeviceWriteHandler, SDDeviceResetHandler,
-                                 SDDeviceState};
+                                 SDDeviceState, nullptr, 0, nullptr, nullptr};
 }
@@ -108,5 +108,9 @@ const Peripheral BUFCTLPeripheral = {"BUFCTL", InitBUFCTLDevice,
                                      BUFCTLDeviceReadHandler,
                                      BUFCTLDeviceWriteHandler,
                                      BUFCTLDeviceResetHandler,
-                                     BUFCTLState};
+                                     BUFCTLState,
+                                     bufctl_regs,
+                                     bufctl_nreg,
+                                     nullptr,
+                                     nullptr};
 }
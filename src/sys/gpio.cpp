@@ -240,6 +240,10 @@ namespace Emu293 {
 			GPIODeviceReadHandler,
 			GPIODeviceWriteHandler,
 			GPIODeviceResetHandler,
-			GPIODeviceState
+			GPIODeviceState,
+			nullptr,
+			0,
+			nullptr,
+			nullptr
 	};
 }
@@ -0,0 +1,172 @@
+#include "headless.h"
+#include "scheduler.h"
+#include "../io/ir_gamepad.h"
+#include <zlib.h>
+#include <chrono>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <vector>
+using namespace std;
+
+namespace Emu293 {
+bool headless = false;
+uint64_t headless_frames = 0;
+double headless_seconds = 0;
+std::string headless_hash_file;
+
+struct InputStep {
+  uint64_t frame;
+  int player;
+  uint16_t buttons;
+};
+static vector<InputStep> input_script;
+static size_t input_next = 0;
+
+static set<uint64_t> dump_frames;
+
+static uint64_t frame_count = 0;
+static vector<uint32_t> frame_crcs;
+
+// Samples are hashed in batches
+static uint8_t audio_buf[4096];
+static size_t audio_len = 0;
+static uint32_t audio_crc = 0;
+static uint64_t audio_samples = 0;
+
+static chrono::steady_clock::time_point start_time;
+// Emulated time when the run started, which a restored state leaves non-zero
+static uint64_t start_cycles = 0;
+
+bool HeadlessLoadInput(const std::string &file) {
+  ifstream in(file);
+  if (!in) {
+    printf("Failed to open input script %s\n", file.c_str());
+    return false;
+  }
+  string line;
+  int lineno = 0;
+  while (getline(in, line)) {
+    ++lineno;
+    if (line.empty() || line[0] == '#')
+      continue;
+    istringstream ls(line);
+    InputStep step;
+    string buttons;
+    if (!(ls >> step.frame >> step.player >> buttons) || step.player < 1 || step.player > 2) {
+      printf("%s:%d: expected <frame> <player> <buttons>\n", file.c_str(), lineno);
+      return false;
+    }
+    step.buttons = 0;
+    if (buttons != "none") {
+      istringstream bs(buttons);
+      string name;
+      while (getline(bs, name, '+')) {
+        uint16_t btn = IRGamepadButton(name);
+        if (btn == 0) {
+          printf("%s:%d: unknown button %s\n", file.c_str(), lineno, name.c_str());
+          return false;
+        }
+        step.buttons |= btn;
+      }
+    }
+    if (!input_script.empty() && step.frame < input_script.back().frame) {
+      printf("%s:%d: frames must be in order\n", file.c_str(), lineno);
+      return false;
+    }
+    input_script.push_back(step);
+  }
+  return true;
+}
+
+bool HeadlessSetDumpFrames(const std::string &list) {
+  istringstream ls(list);
+  string item;
+  while (getline(ls, item, ',')) {
+    char *end;
+    unsigned long long frame = strtoull(item.c_str(), &end, 10);
+    if (item.empty() || *end != '\0')
+      return false;
+    dump_frames.insert(frame);
+  }
+  return true;
+}
+
+// Input for the frame about to start
+static void apply_input() {
+  while (input_next < input_script.size() && input_script[input_next].frame <= frame_count) {
+    auto &step = input_script[input_next++];
+    IRGamepadSet(step.player, step.buttons);
+  }
+}
+
+void HeadlessBegin() {
+  start_time = chrono::steady_clock::now();
+  start_cycles = sched_now();
+  apply_input();
+}
+
+static void dump_frame(const uint16_t *pixels, int width, int height) {
+  vector<uint32_t> argb(width * height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      uint16_t p = pixels[y * 640 + x];
+      uint32_t r = (p >> 11) & 0x1F, g = (p >> 5) & 0x3F, b = p & 0x1F;
+      argb[y * width + x] = 0xFF000000 | (((r << 3) | (r >> 2)) << 16) |
+                            (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+    }
+  }
+  write_bmp(stringf("frame_%llu.bmp", (unsigned long long)frame_count), width, height, argb.data());
+}
+
+void HeadlessFrame(const uint16_t *pixels, int width, int height) {
+  frame_crcs.push_back(crc32(0, reinterpret_cast<const Bytef *>(pixels), 640 * 480 * sizeof(uint16_t)));
+  if (dump_frames.count(frame_count))
+    dump_frame(pixels, width, height);
+  ++frame_count;
+  apply_input();
+}
+
+static void flush_audio() {
+  audio_crc = crc32(audio_crc, audio_buf, audio_len);
+  audio_len = 0;
+}
+
+void HeadlessAudio(int16_t l, int16_t r) {
+  set_uint16le(audio_buf + audio_len, l);
+  set_uint16le(audio_buf + audio_len + 2, r);
+  audio_len += 4;
+  ++audio_samples;
+  if (audio_len == sizeof(audio_buf))
+    flush_audio();
+}
+
+bool HeadlessDone() {
+  if (headless_frames != 0 && frame_count >= headless_frames)
+    return true;
+  if (headless_seconds != 0 && (sched_now() - start_cycles) >= uint64_t(headless_seconds * MASTER_CLOCK_HZ))
+    return true;
+  return false;
+}
+
+void HeadlessReport() {
+  flush_audio();
+  double host = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+  double emulated = double(sched_now() - start_cycles) / MASTER_CLOCK_HZ;
+  FILE *out = stdout;
+  if (!headless_hash_file.empty()) {
+    out = fopen(headless_hash_file.c_str(), "w");
+    if (out == nullptr) {
+      printf("Failed to open %s for writing\n", headless_hash_file.c_str());
+      out = stdout;
+    }
+  }
+  for (size_t i = 0; i < frame_crcs.size(); i++)
+    fprintf(out, "frame %zu %08x\n", i, frame_crcs[i]);
+  fprintf(out, "audio %llu %08x\n", (unsigned long long)audio_samples, audio_crc);
+  if (out != stdout)
+    fclose(out);
+  printf("%llu frames, %.02fs emulated in %.02fs (%.02fMHz)\n", (unsigned long long)frame_count,
+         emulated, host, host > 0 ? ((sched_now() - start_cycles) / 1000000.0) / host : 0.0);
+}
+}
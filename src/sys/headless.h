@@ -0,0 +1,28 @@
+// Running without a window, audio device or GUI, for benchmarks and
+// regression runs on machines with no display
+#pragma once
+#include "../helper.h"
+#include <string>
+namespace Emu293 {
+extern bool headless;
+
+// Stop after this many frames or emulated seconds, whichever comes first
+extern uint64_t headless_frames;
+extern double headless_seconds;
+// Frame and audio hashes are written here at exit, or to stdout if empty
+extern std::string headless_hash_file;
+
+// Script of "<frame> <player> <buttons>" lines, buttons joined with '+' or
+// "none", applied at the start of that frame
+bool HeadlessLoadInput(const std::string &file);
+// Comma separated frame numbers to write out as frame_N.bmp
+bool HeadlessSetDumpFrames(const std::string &list);
+
+// Starts timing the run
+void HeadlessBegin();
+// Called with each finished frame, pixels are RGB565 with a stride of 640
+void HeadlessFrame(const uint16_t *pixels, int width, int height);
+void HeadlessAudio(int16_t l, int16_t r);
+bool HeadlessDone();
+void HeadlessReport();
+}
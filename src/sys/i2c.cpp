@@ -63,10 +63,16 @@ void I2CState(SaveStater &s) {
 
 void InitI2CDevice(PeripheralInitInfo initInfo) {}
 
+static const RegBitmap<i2c_nreg> i2c_read_side = {i2c_intr};
+
 const Peripheral I2CPeripheral = {"I2C", InitI2CDevice,
                                      I2CDeviceReadHandler,
                                      I2CDeviceWriteHandler,
                                      I2CDeviceResetHandler,
-                                     I2CState};
+                                     I2CState,
+                                     i2c_regs,
+                                     i2c_nreg,
+                                     i2c_read_side.bits,
+                                     nullptr};
 }
  
\ No newline at end of file
@@ -1,6 +1,5 @@
 #include "irq.h"
 #include "irq_if.h"
-#include <bitset>
 #include <cstdio>
 using namespace std;
 
@@ -19,33 +18,47 @@ namespace Emu293 {
 static uint32_t int_regs[INT_REGS_SIZE] = {0};
 static CPU *currentCPU;
 static bool interruptsEnabled = true;
-static bitset<64> intsFired;
+// PNDL/MASKL in the low word and PNDH/MASKH in the high word, so that bit b
+// is IRQ 63 - b throughout and the lowest set bit is the highest IRQ
+static inline uint64_t combine(uint32_t l, uint32_t h) {
+  return (uint64_t(h) << 32) | l;
+}
+static inline uint8_t bit_irq(int b) { return 63 - b; }
+static uint64_t intsFired = 0;
+// IRQs in each priority group, in the combined layout. Each SG register is
+// assumed to hold 2 bits per IRQ, IRQ n at SG[n / 16] bits (n % 16) * 2
+static uint64_t groupMask[4] = {~0ULL, 0, 0, 0};
+static void UpdatePriorityGroups() {
+  for (auto &g : groupMask)
+    g = 0;
+  for (int irq = 0; irq < 64; irq++) {
+    int group = (int_regs[INT_PRIORITY_SG0 + irq / 16] >> ((irq % 16) * 2)) & 0x3;
+    groupMask[group] |= 1ULL << (63 - irq);
+  }
+}
 void InitIRQDevice(PeripheralInitInfo initInfo) {
   currentCPU = initInfo.currentCPU;
 }
 void ProcessInterrupts() {
-  if (interruptsEnabled) {
-    // TODO: interrupt priorities (although the standard D99+ firmware does not
-    // use them)
-    for (int i = 0; i < 32; i++) {
-      if (check_bit(int_regs[INT_PNDL], i) &&
-          !check_bit(int_regs[INT_MASKL], i) && !intsFired[63 - i]) {
-        // printf("INT %d!\n",63 - i);
-        currentCPU->interrupt(63 - i);
-        intsFired[63 - i] = true;
-        return;
-      }
-    }
-    for (int i = 0; i < 32; i++) {
-      if (check_bit(int_regs[INT_PNDH], i) &&
-          !check_bit(int_regs[INT_MASKH], i) && !intsFired[31 - i]) {
-        // printf("INT %d!\n",31 - i);
-        currentCPU->interrupt(31 - i);
-        intsFired[31 - i] = true;
-        return;
+  if (!interruptsEnabled)
+    return;
+  uint64_t ready = combine(int_regs[INT_PNDL], int_regs[INT_PNDH]) &
+                   ~combine(int_regs[INT_MASKL], int_regs[INT_MASKH]) & ~intsFired;
+  if (ready == 0)
+    return;
+  if (int_regs[INT_PRIORITY_M] & 0x1) {
+    // Lowest group with anything ready goes first
+    for (auto g : groupMask) {
+      if (ready & g) {
+        ready &= g;
+        break;
       }
     }
   }
+  int b = ctz64(ready);
+  // printf("INT %d!\n", bit_irq(b));
+  currentCPU->interrupt(bit_irq(b));
+  intsFired |= 1ULL << b;
 }
 uint32_t IRQDeviceReadHandler(uint16_t addr) {
   uint16_t addr32 = addr / 4;
@@ -63,7 +76,9 @@ void IRQDeviceWriteHandler(uint16_t addr, uint32_t val) {
     return;
   } else {
     int_regs[addr32] = val;
-    if ((addr32 == INT_MASKL) || (addr32 == INT_MASKH)) {
+    if ((addr32 >= INT_PRIORITY_SG0) && (addr32 <= INT_PRIORITY_SG3)) {
+      UpdatePriorityGroups();
+    } else if ((addr32 == INT_MASKL) || (addr32 == INT_MASKH) || (addr32 == INT_PRIORITY_M)) {
       ProcessInterrupts();
     }
   }
@@ -71,27 +86,20 @@ void IRQDeviceWriteHandler(uint16_t addr, uint32_t val) {
 void IRQDeviceResetHandler() {
   for (auto &r : int_regs)
     r = 0;
+  UpdatePriorityGroups();
 }
 void SetIRQState(uint8_t IRQ, bool value) {
   // printf("IRQ %d = %d\n", IRQ, value);
   if (IRQ >= 64)
     return;
-  if (IRQ >= 32) {
-    if (value) {
-      set_bit(int_regs[INT_PNDL], 63 - IRQ);
-      ProcessInterrupts();
-    } else {
-      clear_bit(int_regs[INT_PNDL], 63 - IRQ);
-      intsFired[IRQ] = false;
-    }
+  uint32_t &pnd = (IRQ >= 32) ? int_regs[INT_PNDL] : int_regs[INT_PNDH];
+  int pos = (IRQ >= 32) ? (63 - IRQ) : (31 - IRQ);
+  if (value) {
+    set_bit(pnd, pos);
+    ProcessInterrupts();
   } else {
-    if (value) {
-      set_bit(int_regs[INT_PNDH], 31 - IRQ);
-      ProcessInterrupts();
-    } else {
-      clear_bit(int_regs[INT_PNDH], 31 - IRQ);
-      intsFired[IRQ] = false;
-    }
+    clear_bit(pnd, pos);
+    intsFired &= ~(1ULL << (63 - IRQ));
   }
 }
 void SetInterruptsEnabled(bool enable) {
@@ -104,15 +112,23 @@ void InterruptState(SaveStater &s) {
   s.tag("INT");
   s.a(int_regs);
   s.i(interruptsEnabled);
+  // Stored indexed by IRQ number
   uint64_t tmp = 0;
   if (s.is_load) {
     s.i(tmp);
-    intsFired = std::bitset<64>(tmp);
+    intsFired = 0;
+    for (int b = 0; b < 64; b++)
+      if (tmp & (1ULL << bit_irq(b)))
+        intsFired |= 1ULL << b;
+    UpdatePriorityGroups();
   } else {
-    tmp = intsFired.to_ullong();
+    for (int b = 0; b < 64; b++)
+      if (intsFired & (1ULL << b))
+        tmp |= 1ULL << bit_irq(b);
     s.i(tmp);
   }
 }
 const Peripheral IRQPeripheral = {"PIC", InitIRQDevice, IRQDeviceReadHandler,
-                                  IRQDeviceWriteHandler, IRQDeviceResetHandler, InterruptState};
+                                  IRQDeviceWriteHandler, IRQDeviceResetHandler, InterruptState,
+                                  nullptr, 0, nullptr, nullptr};
 }
@@ -42,5 +42,6 @@ void MIUDeviceState(SaveStater &s) {
 void InitMIUDevice(PeripheralInitInfo initInfo) {}
 
 const Peripheral MIUPeripheral = {"MIU", InitMIUDevice, MIUDeviceReadHandler,
-                                  MIUDeviceWriteHandler, MIUDeviceResetHandler, MIUDeviceState};
+                                  MIUDeviceWriteHandler, MIUDeviceResetHandler, MIUDeviceState,
+                                  miu_regs, miu_regs_size, nullptr, nullptr};
 }
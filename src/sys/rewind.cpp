@@ -0,0 +1,216 @@
+#include "rewind.h"
+#include "../guestmem.h"
+#include "../system.h"
+#include "../video/ppu.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <vector>
+using namespace std;
+
+namespace Emu293 {
+int rewind_seconds = 0;
+bool rewind_held = false;
+
+// A snapshot every few frames, and never more than this much held
+#define REWIND_INTERVAL_FRAMES 4
+#define REWIND_MAX_BYTES (256 * 1024 * 1024)
+
+// Undoes a snapshot, taking the one before it to the previous
+struct RewindEntry {
+  vector<uint32_t> pages, imem_pages;
+  vector<uint8_t> ram_delta, imem_delta, dev_delta;
+  size_t prev_dev_len = 0;
+  size_t bytes() const {
+    return (pages.size() + imem_pages.size()) * sizeof(uint32_t) + ram_delta.size() +
+           imem_delta.size() + dev_delta.size();
+  }
+};
+
+static deque<RewindEntry> ring;
+static size_t ring_bytes = 0;
+// The newest snapshot in full. RAM and imem are only ever written where they
+// differ from the machine, as of epoch
+static uint8_t *cur_ram = nullptr, *cur_imem = nullptr;
+static vector<uint8_t> cur_dev;
+static uint32_t epoch = 0;
+static uint64_t last_frame = 0;
+static vector<uint32_t> dirty;
+static vector<uint8_t> dev;
+
+// Appends a ^ b as runs of (zero count, literal count, literals). Unchanged
+// data is the common case, so zeros are skipped 8 bytes at a time
+static void xor_encode(const uint8_t *a, const uint8_t *b, size_t len, vector<uint8_t> &out) {
+  auto put32 = [&](uint32_t v) {
+    uint8_t bytes[4];
+    set_uint32le(bytes, v);
+    out.insert(out.end(), bytes, bytes + 4);
+  };
+  size_t i = 0;
+  while (i < len) {
+    size_t start = i;
+    while ((i + 8) <= len && get_uint32le(a + i) == get_uint32le(b + i) &&
+           get_uint32le(a + i + 4) == get_uint32le(b + i + 4))
+      i += 8;
+    while (i < len && a[i] == b[i])
+      i++;
+    size_t zeros = i - start;
+    start = i;
+    while (i < len && a[i] != b[i])
+      i++;
+    put32(zeros);
+    put32(i - start);
+    for (size_t j = start; j < i; j++)
+      out.push_back(a[j] ^ b[j]);
+  }
+}
+
+// XORs an xor_encode()d delta into len bytes of each of dst, returning where it ends
+static size_t xor_decode(const vector<uint8_t> &in, size_t pos, size_t len, uint8_t *dst0, uint8_t *dst1) {
+  size_t i = 0;
+  while (i < len) {
+    i += get_uint32le(&in[pos]);
+    uint32_t lits = get_uint32le(&in[pos + 4]);
+    pos += 8;
+    for (uint32_t j = 0; j < lits; j++, i++) {
+      dst0[i] ^= in[pos + j];
+      if (dst1)
+        dst1[i] ^= in[pos + j];
+    }
+    pos += lits;
+  }
+  return pos;
+}
+
+static void dev_save(vector<uint8_t> &out) {
+  SaveStater s;
+  s.begin_save(out);
+  system_device_state(s);
+  s.finalise();
+}
+
+static void dev_load(vector<uint8_t> &in) {
+  SaveStater s;
+  // RAM is put back through mark_dma_write, which drops stale code
+  s.keep_code = true;
+  s.begin_load(in);
+  system_device_state(s);
+  s.finalise();
+}
+
+// Records the pages that really changed, bringing cur up to date
+static void encode_pages(const vector<uint32_t> &pages, uint8_t *cur, const uint8_t *mem,
+                         vector<uint32_t> &changed, vector<uint8_t> &delta) {
+  for (uint32_t p : pages) {
+    uint32_t off = p * DIRTY_PAGE_SIZE;
+    if (memcmp(cur + off, mem + off, DIRTY_PAGE_SIZE) == 0)
+      continue;
+    changed.push_back(p);
+    xor_encode(cur + off, mem + off, DIRTY_PAGE_SIZE, delta);
+    memcpy(cur + off, mem + off, DIRTY_PAGE_SIZE);
+  }
+}
+
+// XORs the deltas of pages back into cur and mem, and drops stale code
+static void decode_pages(const vector<uint32_t> &pages, const vector<uint8_t> &delta, uint8_t *cur,
+                         uint8_t *mem, uint32_t base) {
+  size_t pos = 0;
+  for (uint32_t p : pages) {
+    pos = xor_decode(delta, pos, DIRTY_PAGE_SIZE, cur + p * DIRTY_PAGE_SIZE, mem + p * DIRTY_PAGE_SIZE);
+    mark_dma_write(base + p * DIRTY_PAGE_SIZE, DIRTY_PAGE_SIZE);
+  }
+}
+
+// Puts back pages from cur
+static void restore_pages(const vector<uint32_t> &pages, const uint8_t *cur, uint8_t *mem, uint32_t base) {
+  for (uint32_t p : pages) {
+    memcpy(mem + p * DIRTY_PAGE_SIZE, cur + p * DIRTY_PAGE_SIZE, DIRTY_PAGE_SIZE);
+    mark_dma_write(base + p * DIRTY_PAGE_SIZE, DIRTY_PAGE_SIZE);
+  }
+}
+
+static void capture() {
+  uint8_t *ram = get_dma_ptr(0xA0000000), *imem = get_dma_ptr(0x9F000000);
+  if (cur_ram == nullptr) {
+    cur_ram = guest_alloc(RAM_SIZE);
+    cur_imem = guest_alloc(IMEM_SIZE);
+  }
+  RewindEntry e;
+  ram_dirty_pages(epoch, dirty);
+  encode_pages(dirty, cur_ram, ram, e.pages, e.ram_delta);
+  imem_dirty_pages(epoch, dirty);
+  encode_pages(dirty, cur_imem, imem, e.imem_pages, e.imem_delta);
+  epoch = dirty_epoch_begin();
+
+  // Encoded over the longer of the two, padded with zeros
+  dev_save(dev);
+  size_t dev_len = dev.size(), len = max(dev_len, cur_dev.size());
+  e.prev_dev_len = cur_dev.size();
+  cur_dev.resize(len);
+  dev.resize(len);
+  xor_encode(cur_dev.data(), dev.data(), len, e.dev_delta);
+  cur_dev.swap(dev);
+  cur_dev.resize(dev_len);
+
+  // The first snapshot has nothing before it to go back to
+  if (ring.empty())
+    e = RewindEntry();
+  ring_bytes += e.bytes();
+  ring.push_back(std::move(e));
+  // The oldest is then only a base to step back to
+  size_t max_entries = (size_t(rewind_seconds) * 60) / REWIND_INTERVAL_FRAMES + 1;
+  while (ring.size() > 1 && (ring.size() > max_entries || ring_bytes > REWIND_MAX_BYTES)) {
+    ring_bytes -= ring.front().bytes();
+    ring.pop_front();
+    ring_bytes -= ring.front().bytes();
+    ring.front() = RewindEntry();
+  }
+}
+
+void RewindUpdate() {
+  if (rewind_seconds <= 0 || (ppu_frame_count - last_frame) < REWIND_INTERVAL_FRAMES)
+    return;
+  last_frame = ppu_frame_count;
+  capture();
+}
+
+// Back to the newest snapshot, dropping whatever ran since
+static void restore() {
+  uint8_t *ram = get_dma_ptr(0xA0000000), *imem = get_dma_ptr(0x9F000000);
+  ram_dirty_pages(epoch, dirty);
+  restore_pages(dirty, cur_ram, ram, 0xA0000000);
+  imem_dirty_pages(epoch, dirty);
+  restore_pages(dirty, cur_imem, imem, 0x9F000000);
+  epoch = dirty_epoch_begin();
+  dev_load(cur_dev);
+  last_frame = ppu_frame_count;
+}
+
+bool RewindStep() {
+  if (ring.empty())
+    return false;
+  // First back to the newest snapshot, if anything has run since
+  if (ppu_frame_count != last_frame) {
+    restore();
+    return true;
+  }
+  if (ring.size() < 2)
+    return false;
+  uint8_t *ram = get_dma_ptr(0xA0000000), *imem = get_dma_ptr(0x9F000000);
+  restore();
+  // Then undo the newest snapshot, applying the same to the machine
+  RewindEntry &e = ring.back();
+  decode_pages(e.pages, e.ram_delta, cur_ram, ram, 0xA0000000);
+  decode_pages(e.imem_pages, e.imem_delta, cur_imem, imem, 0x9F000000);
+  cur_dev.resize(max(cur_dev.size(), e.prev_dev_len));
+  xor_decode(e.dev_delta, 0, cur_dev.size(), cur_dev.data(), nullptr);
+  cur_dev.resize(e.prev_dev_len);
+  ring_bytes -= e.bytes();
+  ring.pop_back();
+  epoch = dirty_epoch_begin();
+  dev_load(cur_dev);
+  return true;
+}
+
+int RewindStepMs() { return (1000 * REWIND_INTERVAL_FRAMES) / 60; }
+}
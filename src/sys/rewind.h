@@ -0,0 +1,18 @@
+// Rewind: a ring of snapshots every few frames, that can be stepped back
+// through while the hotkey is held. Each one only holds what changed since the
+// one before, XORed with it and run length encoded
+#pragma once
+#include "../helper.h"
+namespace Emu293 {
+// How far back to keep, 0 for off
+extern int rewind_seconds;
+// Set while the hotkey is held
+extern bool rewind_held;
+
+// Called from the main loop between slices, takes a snapshot when due
+void RewindUpdate();
+// Goes back one snapshot, returns false when there is nothing further back
+bool RewindStep();
+// Host time between steps while rewinding
+int RewindStepMs();
+}
@@ -0,0 +1,37 @@
+#include "runahead.h"
+#include "scheduler.h"
+#include "../system.h"
+#include "../video/ppu.h"
+
+namespace Emu293 {
+int run_ahead_frames = 0;
+
+static bool active = false;
+static bool frame_done = false;
+static int frames_ahead = 0;
+static SystemSnapshot snapshot;
+
+RunAheadFrame RunAheadFrameDone() {
+  if (!active) {
+    frame_done = true;
+    return RA_REAL;
+  }
+  ++frames_ahead;
+  return (frames_ahead == run_ahead_frames) ? RA_SHOWN : RA_HIDDEN;
+}
+
+bool RunAheadActive() { return active; }
+
+void RunAheadStep(CPU &cpu, bool idle_skip) {
+  if (!frame_done)
+    return;
+  frame_done = false;
+  system_snapshot_save(snapshot);
+  active = true;
+  frames_ahead = 0;
+  while (frames_ahead < run_ahead_frames && !shutdown_flag)
+    sched_run(cpu, 1000, idle_skip);
+  active = false;
+  system_snapshot_load(snapshot);
+}
+}
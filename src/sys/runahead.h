@@ -0,0 +1,23 @@
+// Run-ahead: after each frame the machine is saved, run on for a few frames
+// with the current input so the last of those can be shown, then put back.
+// This hides the latency of the IR remote and the game's own input handling
+#pragma once
+#include "../helper.h"
+#include "../cpu/cpu.h"
+namespace Emu293 {
+// Frames to run ahead, 0 for off
+extern int run_ahead_frames;
+
+enum RunAheadFrame {
+  RA_REAL,   // from the real timeline, input goes here but it isn't shown
+  RA_HIDDEN, // run ahead and thrown away
+  RA_SHOWN,  // the last frame run ahead, to present
+};
+
+// Called by the PPU as each frame completes
+RunAheadFrame RunAheadFrameDone();
+// Whether the machine is running ahead, when audio and pacing are skipped
+bool RunAheadActive();
+// Called after each scheduler slice, runs ahead once a real frame has completed
+void RunAheadStep(CPU &cpu, bool idle_skip);
+}
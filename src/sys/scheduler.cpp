@@ -0,0 +1,147 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <cstdio>
+using namespace std;
+
+namespace Emu293 {
+static const uint64_t NEVER = UINT64_MAX;
+
+static uint64_t now_cycles = 0;
+static uint64_t deadline[EVT_COUNT] = {0};
+static EventHandler handlers[EVT_COUNT] = {nullptr};
+
+// Binary min-heap of pending events
+static int heap[EVT_COUNT];
+static int heap_pos[EVT_COUNT];
+static int heap_size = 0;
+
+// CPU currently in sched_run, its cycle count when the slice started and the
+// end of the slice
+static CPU *running = nullptr;
+static uint64_t slice_cycles = 0;
+static uint64_t slice_end = NEVER;
+
+static inline bool before(int a, int b) {
+  return (deadline[a] < deadline[b]) || ((deadline[a] == deadline[b]) && (a < b));
+}
+
+static void heap_swap(int i, int j) {
+  swap(heap[i], heap[j]);
+  heap_pos[heap[i]] = i;
+  heap_pos[heap[j]] = j;
+}
+
+static void sift_up(int i) {
+  while (i > 0 && before(heap[i], heap[(i - 1) / 2])) {
+    heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void sift_down(int i) {
+  while (true) {
+    int min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < heap_size && before(heap[l], heap[min]))
+      min = l;
+    if (r < heap_size && before(heap[r], heap[min]))
+      min = r;
+    if (min == i)
+      return;
+    heap_swap(i, min);
+    i = min;
+  }
+}
+
+static void heap_remove(int ev) {
+  int i = heap_pos[ev];
+  heap_pos[ev] = -1;
+  deadline[ev] = NEVER;
+  if (i != --heap_size) {
+    int moved = heap[heap_size];
+    heap[i] = moved;
+    heap_pos[moved] = i;
+    sift_up(i);
+    sift_down(heap_pos[moved]);
+  }
+}
+
+static bool init_sched() {
+  for (int ev = 0; ev < EVT_COUNT; ev++) {
+    deadline[ev] = NEVER;
+    heap_pos[ev] = -1;
+  }
+  return true;
+}
+
+static bool sched_init = init_sched();
+
+void sched_register(SchedEvent ev, EventHandler handler) { handlers[ev] = handler; }
+
+uint64_t sched_now() {
+  if (running)
+    return now_cycles + (running->cycles() - slice_cycles);
+  return now_cycles;
+}
+
+void sched_set(SchedEvent ev, uint64_t when) {
+  deadline[ev] = when;
+  if (heap_pos[ev] == -1) {
+    heap_pos[ev] = heap_size;
+    heap[heap_size++] = ev;
+  }
+  sift_up(heap_pos[ev]);
+  sift_down(heap_pos[ev]);
+  // Cut the running slice short if this is due before it ends
+  if (running && when < slice_end) {
+    slice_end = when;
+    running->stop_run();
+  }
+}
+
+void sched_cancel(SchedEvent ev) {
+  if (heap_pos[ev] != -1)
+    heap_remove(ev);
+}
+
+bool sched_pending(SchedEvent ev) { return heap_pos[ev] != -1; }
+
+void sched_run(CPU &cpu, int64_t max_cycles, bool idle_skip) {
+  uint64_t next = heap_size ? deadline[heap[0]] : NEVER;
+  int64_t budget = (next <= now_cycles) ? 0 : int64_t(min<uint64_t>(next - now_cycles, max_cycles));
+  int64_t ran = 0;
+  if (budget > 0) {
+    running = &cpu;
+    slice_cycles = cpu.cycles();
+    slice_end = now_cycles + budget;
+    ran = cpu.run(budget);
+    running = nullptr;
+    // If the guest is polling, nothing happens until the deadline anyway
+    if (idle_skip && cpu.is_idle())
+      ran = max<int64_t>(ran, slice_end - now_cycles);
+  }
+  uint64_t target = now_cycles + ran;
+  while (heap_size && deadline[heap[0]] <= target) {
+    int ev = heap[0];
+    uint64_t when = deadline[ev];
+    heap_remove(ev);
+    now_cycles = max(now_cycles, when);
+    if (handlers[ev])
+      handlers[ev](when);
+  }
+  now_cycles = target;
+}
+
+void sched_state(SaveStater &s) {
+  s.tag("SCHED");
+  s.i(now_cycles);
+  for (int ev = 0; ev < EVT_COUNT; ev++) {
+    uint64_t when = deadline[ev];
+    s.i(when);
+    if (s.is_load) {
+      sched_cancel(SchedEvent(ev));
+      if (when != NEVER)
+        sched_set(SchedEvent(ev), when);
+    }
+  }
+}
+}
@@ -0,0 +1,42 @@
+// Event scheduler on emulated time, counted in CPU cycles
+#pragma once
+#include "../helper.h"
+#include "../cpu/cpu.h"
+namespace Emu293 {
+// Every subsystem counts time from this. The PPU's 800 lines of 2000 cycles
+// then make 60 frames a second, and there are 2000 cycles per 48kHz sample
+#define MASTER_CLOCK_HZ 96000000
+
+// One pending deadline per event, events due at the same time run in this order
+enum SchedEvent {
+  EVT_TIMER,
+  EVT_TIMER_32K,
+  EVT_IR,
+  EVT_SPU,
+  EVT_PPU_LINE,
+  EVT_TVE_LINE,
+  EVT_SYNC,
+  EVT_COUNT
+};
+
+// Called with the deadline it was scheduled for, which periodic events should
+// count from rather than sched_now() so they don't drift
+typedef void (*EventHandler)(uint64_t when);
+
+void sched_register(SchedEvent ev, EventHandler handler);
+
+// Emulated time. While an event runs, this is its deadline
+uint64_t sched_now();
+
+// Sets the deadline of an event, replacing any pending one
+void sched_set(SchedEvent ev, uint64_t when);
+void sched_cancel(SchedEvent ev);
+bool sched_pending(SchedEvent ev);
+
+// Runs the CPU until the next deadline, or for at most max_cycles, then runs
+// every event that is due. With idle_skip, time jumps straight to the
+// deadline if the guest is idling
+void sched_run(CPU &cpu, int64_t max_cycles, bool idle_skip);
+
+void sched_state(SaveStater &s);
+}
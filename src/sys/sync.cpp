@@ -0,0 +1,118 @@
+#include "sync.h"
+#include "runahead.h"
+#include "scheduler.h"
+#include "../audio/spu.h"
+#include <chrono>
+#include <thread>
+using namespace std;
+
+namespace Emu293 {
+SyncSource sync_source = SYNC_AUDIO;
+double sync_speed = 1;
+double sync_ff_speed = 0;
+bool fast_forward = false;
+
+// How often the host is checked, and how far apart the clocks may drift (the
+// host falling behind, or a savestate load) before we start again from here
+#define SYNC_PERIOD_CYCLES (MASTER_CLOCK_HZ / 1000)
+#define SYNC_MAX_DRIFT_NS 100000000
+
+// Enough queued audio to ride out scheduling hiccups
+#define SYNC_AUDIO_TARGET 1024
+// Below this, or this far behind the host clock, frames start to be skipped
+#define SYNC_AUDIO_LOW 256
+#define SYNC_BEHIND_NS 5000000
+// Frames shown while fast forwarding, and the most skipped in a row otherwise
+#define SYNC_FF_FRAME_NS (1000000000 / 60)
+#define SYNC_MAX_SKIP 4
+
+static int64_t anchor_ns;
+static uint64_t anchor_cycles;
+// Speed the anchor was taken at
+static double paced_speed = 1;
+static bool behind = false;
+
+static double current_speed() {
+  return fast_forward ? sync_ff_speed : sync_speed;
+}
+
+static int64_t host_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void sync_anchor(uint64_t when) {
+  anchor_ns = host_ns();
+  anchor_cycles = when;
+}
+
+static void SyncEvent(uint64_t when) {
+  sched_set(EVT_SYNC, when + SYNC_PERIOD_CYCLES);
+  // Time run ahead is taken back afterwards
+  if (RunAheadActive())
+    return;
+  double speed = current_speed();
+  if (speed != paced_speed) {
+    paced_speed = speed;
+    sync_anchor(when);
+  }
+  behind = false;
+  if (speed == 0 || sync_source == SYNC_NONE)
+    return;
+  if (sync_source == SYNC_AUDIO && speed == 1) {
+    // The device drains the queue at its own rate
+    size_t queued = SPUQueuedSamples();
+    if (queued > SYNC_AUDIO_TARGET)
+      this_thread::sleep_for(chrono::microseconds((queued - SYNC_AUDIO_TARGET) * 1000000 / 48000));
+    behind = queued < SYNC_AUDIO_LOW;
+  } else if (sync_source == SYNC_WALL || speed != 1) {
+    int64_t due_ns = anchor_ns + int64_t(int64_t(when - anchor_cycles) * (1000000000.0 / MASTER_CLOCK_HZ / speed));
+    int64_t ahead_ns = due_ns - host_ns();
+    if (ahead_ns > SYNC_MAX_DRIFT_NS || ahead_ns < -SYNC_MAX_DRIFT_NS)
+      sync_anchor(when);
+    else if (ahead_ns > 0)
+      this_thread::sleep_for(chrono::nanoseconds(ahead_ns));
+    behind = ahead_ns < -SYNC_BEHIND_NS;
+  }
+  // With video sync, presenting the frame blocks until the display refresh
+}
+
+bool SyncSkipFrame() {
+  static int64_t last_shown_ns = 0;
+  static int skipped = 0;
+  int64_t now = host_ns();
+  bool skip;
+  if (current_speed() != 1)
+    // No more frames than the display can show
+    skip = (now - last_shown_ns) < SYNC_FF_FRAME_NS;
+  else
+    // Catch up at the cost of smoothness, keeping audio fed
+    skip = behind && skipped < SYNC_MAX_SKIP;
+  if (skip) {
+    ++skipped;
+  } else {
+    skipped = 0;
+    last_shown_ns = now;
+  }
+  return skip;
+}
+
+int SyncSampleCount() {
+  static double owed = 0;
+  double speed = current_speed();
+  if (speed == 0 || RunAheadActive())
+    return 0;
+  if (speed == 1)
+    return 1;
+  // Each sample stands for 1 / speed samples of host time
+  owed += 1.0 / speed;
+  int count = int(owed);
+  owed -= count;
+  return count;
+}
+
+void InitSync() {
+  sched_register(EVT_SYNC, SyncEvent);
+  sync_anchor(sched_now());
+  sched_set(EVT_SYNC, sched_now() + SYNC_PERIOD_CYCLES);
+}
+}
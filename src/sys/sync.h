@@ -0,0 +1,30 @@
+// Keeps emulated time in step with the host
+#pragma once
+#include "../helper.h"
+namespace Emu293 {
+enum SyncSource {
+  SYNC_AUDIO, // keep the audio device fed without running ahead of it
+  SYNC_VIDEO, // present frames with vsync, so the display refresh paces us
+  SYNC_WALL,  // follow the host clock
+  SYNC_NONE,  // run as fast as possible
+};
+
+extern SyncSource sync_source;
+
+// Multiple of real time to run at, 0 for as fast as possible. Anything other
+// than 1 is paced by the host clock
+extern double sync_speed;
+// Used instead while fast forwarding
+extern double sync_ff_speed;
+extern bool fast_forward;
+
+// Starts pacing from the current emulated time
+void InitSync();
+// Whether to skip rendering the frame about to start, when fast forwarding or
+// to catch up when the host can't keep up
+bool SyncSkipFrame();
+// How many times to queue the next audio sample, so audio keeps up with the
+// host: some are dropped when running faster than real time, repeated when
+// slower, and all are when uncapped
+int SyncSampleCount();
+}
@@ -1,5 +1,7 @@
 #include "timer.h"
 #include "irq_if.h"
+#include "scheduler.h"
+#include <algorithm>
 #include <cstdio>
 using namespace std;
 
@@ -25,9 +27,17 @@ namespace Emu293 {
 	// CKG sits here because we do frequency stuff here; maybe not the wright place though?
 	uint32_t ckg_regs[CKG_NREGS] = {0};
 
+	static void timer_sync();
+	static void timer_schedule();
+
 	void CKGDeviceWriteHandler(uint16_t addr, uint32_t val) {
 	  addr /= 4;
-	  if (addr < CKG_NREGS) {
+	  if (addr == CKG_TMR_CLKSEL) {
+		// Timers count at the old rate up to now
+		timer_sync();
+		ckg_regs[addr] = val;
+		timer_schedule();
+	  } else if (addr < CKG_NREGS) {
 		ckg_regs[addr] = val;
 	  } else {
 		printf("CKG write error: address 0x%04x out of range, dat=0x%08x\n",
@@ -65,45 +75,104 @@ namespace Emu293 {
 										 CKGDeviceReadHandler,
 										 CKGDeviceWriteHandler,
 										 CKGDeviceResetHandler,
-										 CKGDeviceState};
+										 CKGDeviceState,
+										 nullptr,
+										 0,
+										 nullptr,
+										 nullptr};
 
 	uint32_t timer_regs[NTIMERS][TIMER_NREGS] = {0};
 
-	void InitTimerDevice(PeripheralInitInfo initInfo) {
+	// Timers on the main clock are modelled rather than stepped: counts are
+	// brought up to date when accessed, and an event is set for the next
+	// overflow that raises an interrupt
+	static uint64_t synced_at = 0;
+	// Cycles into the current main clock timer tick
+	static uint32_t tick_cycles = 0;
 
+	// Main clock timers tick at PCLK/2 through the CKG divider
+	static uint32_t tick_period() {
+		return 4 * max<uint32_t>(ckg_regs[CKG_TMR_CLKSEL] & 0xff, 1);
 	}
 
-	int div_count = 0; 
+	static bool timer_running(int i, bool is_32khz) {
+		return (check_bit(ckg_regs[CKG_TMR_CLKSEL], 8 + i) == is_32khz) &&
+			check_bit(timer_regs[i][TIMER_CTRL],TIMER_CTRL_EN) &&
+			(check_bit(timer_regs[i][TIMER_CTRL_CCP],31)==check_bit(timer_regs[i][TIMER_CTRL_CCP],30));
+	}
 
-	void TimerTick(bool is_32khz) {
-		if (!is_32khz) {
-			// clock divider
-			++div_count;
-			if (div_count < (ckg_regs[CKG_TMR_CLKSEL] & 0xff))
-				return;
-			else
-				div_count = 0;
+	// Ticks until the count next reloads from the preload value
+	static uint32_t ticks_to_reload(uint32_t count) {
+		return (count <= 0xFFFF) ? (0x10000 - count + 1) : 1;
+	}
+
+	// Counts up to 0x10000, then reloads on the next tick
+	static void timer_advance(int i, uint64_t ticks) {
+		uint32_t &count = timer_regs[i][TIMER_UPCOUNT];
+		uint32_t preload = timer_regs[i][TIMER_PRELOAD];
+		uint32_t first = ticks_to_reload(count);
+		if (ticks < first) {
+			count += ticks;
+			return;
 		}
-		for(int i = 0; i < NTIMERS; i++) {
-			//printf("tmr%d st = 0x%08x\n",i,timer_regs[i][TIMER_CTRL]);
-			// check which clock this timer runs on
-			if (check_bit(ckg_regs[CKG_TMR_CLKSEL], 8 + i) != is_32khz)
-				continue;
-			if(check_bit(timer_regs[i][TIMER_CTRL],TIMER_CTRL_EN) && (check_bit(timer_regs[i][TIMER_CTRL_CCP],31)==check_bit(timer_regs[i][TIMER_CTRL_CCP],30))) {
-				//printf("tck tmr%d\n",i);
-				if(timer_regs[i][TIMER_UPCOUNT] <= 0xFFFF) {
-					timer_regs[i][TIMER_UPCOUNT]++;
-				} else {
-					//printf("ovf tmr%d\n",i);
-					timer_regs[i][TIMER_UPCOUNT] = timer_regs[i][TIMER_PRELOAD];
-					if(check_bit(timer_regs[i][TIMER_CTRL],TIMER_CTRL_IRQ_EN)) {
-						SetIRQState(56, true);
-						set_bit(timer_regs[i][TIMER_CTRL],TIMER_CTRL_IRQ_FLAG);
-					}
-				}
-			}
+		ticks = (ticks - first) % ticks_to_reload(preload);
+		count = preload + ticks;
+		if(check_bit(timer_regs[i][TIMER_CTRL],TIMER_CTRL_IRQ_EN)) {
+			SetIRQState(56, true);
+			set_bit(timer_regs[i][TIMER_CTRL],TIMER_CTRL_IRQ_FLAG);
 		}
 	}
+
+	static void timer_sync() {
+		uint64_t now = sched_now();
+		uint32_t period = tick_period();
+		uint64_t elapsed = (now - synced_at) + tick_cycles;
+		synced_at = now;
+		tick_cycles = elapsed % period;
+		if (elapsed < period)
+			return;
+		for(int i = 0; i < NTIMERS; i++)
+			if (timer_running(i, false))
+				timer_advance(i, elapsed / period);
+	}
+
+	static void timer_schedule() {
+		uint64_t ticks = UINT64_MAX;
+		for(int i = 0; i < NTIMERS; i++)
+			if (timer_running(i, false) && check_bit(timer_regs[i][TIMER_CTRL],TIMER_CTRL_IRQ_EN))
+				ticks = min<uint64_t>(ticks, ticks_to_reload(timer_regs[i][TIMER_UPCOUNT]));
+		if (ticks == UINT64_MAX)
+			sched_cancel(EVT_TIMER);
+		else
+			sched_set(EVT_TIMER, synced_at + ticks * tick_period() - tick_cycles);
+	}
+
+	static void TimerEvent(uint64_t when) {
+		timer_sync();
+		timer_schedule();
+	}
+
+	// The 32kHz period isn't a whole number of cycles, the remainder is
+	// carried in 32768ths of a cycle
+	static uint32_t t32k_frac = 0;
+
+	static void Timer32kEvent(uint64_t when) {
+		for(int i = 0; i < NTIMERS; i++)
+			if (timer_running(i, true))
+				timer_advance(i, 1);
+		t32k_frac += MASTER_CLOCK_HZ % 32768;
+		uint64_t period = MASTER_CLOCK_HZ / 32768 + (t32k_frac / 32768);
+		t32k_frac %= 32768;
+		sched_set(EVT_TIMER_32K, when + period);
+	}
+
+	void InitTimerDevice(PeripheralInitInfo initInfo) {
+		sched_register(EVT_TIMER, TimerEvent);
+		sched_register(EVT_TIMER_32K, Timer32kEvent);
+		sched_set(EVT_TIMER_32K, sched_now() + MASTER_CLOCK_HZ / 32768);
+		synced_at = sched_now();
+	}
+
 	uint32_t TimerDeviceReadHandler(uint16_t addr) {
 		uint32_t tmr = (addr >> 12) & 0x0F;
 		if(tmr >= NTIMERS) {
@@ -115,6 +184,7 @@ namespace Emu293 {
 				printf("TMR device read error: address 0x%04x out of bounds\n",addr);
 				return 0;
 			} else {
+				timer_sync();
 				return timer_regs[tmr][addr32];
 			}
 		}
@@ -130,6 +200,7 @@ namespace Emu293 {
 			} else {
 			//	printf("TMR%d Write 0x%08x to 0x%02x!\n",tmr, val,addr32);
 
+				timer_sync();
 				timer_regs[tmr][addr32] = val;
 				if(addr32 == TIMER_CTRL) {
 					if(check_bit(val,TIMER_CTRL_IRQ_FLAG) || (!check_bit(val,TIMER_CTRL_EN)) || (!check_bit(val,TIMER_CTRL_IRQ_EN))) {
@@ -140,6 +211,7 @@ namespace Emu293 {
 				if(addr32 == TIMER_PRELOAD) {
 					timer_regs[tmr][TIMER_UPCOUNT] = val;
 				}
+				timer_schedule();
 			}
 		}
 
@@ -149,11 +221,18 @@ namespace Emu293 {
 		for (auto &t : timer_regs)
 			for (auto &r : t)
 				r = 0;
+		synced_at = sched_now();
+		tick_cycles = 0;
+		sched_cancel(EVT_TIMER);
 	}
 
 	void TimerDeviceState(SaveStater &s) {
 		s.tag("TIMER");
-		s.i(div_count);
+		if (!s.is_load)
+			timer_sync();
+		s.i(synced_at);
+		s.i(tick_cycles);
+		s.i(t32k_frac);
 		for (int i = 0; i < NTIMERS; i++)
 			s.a(timer_regs[i]);
 	}
@@ -164,6 +243,10 @@ namespace Emu293 {
 			TimerDeviceReadHandler,
 			TimerDeviceWriteHandler,
 			TimerDeviceResetHandler,
-			TimerDeviceState
+			TimerDeviceState,
+			nullptr,
+			0,
+			nullptr,
+			nullptr
 	};
 }
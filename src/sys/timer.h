@@ -5,7 +5,6 @@
 namespace Emu293 {
 	extern const Peripheral CKGPeripheral;
 	extern const Peripheral TimerPeripheral;
-	void TimerTick(bool is_32khz);
 	bool get_clock_enable(uint32_t offset);
 }
 
@@ -1,13 +1,16 @@
 // Subor D99+ system definition
 #include "dma/apbdma.h"
 #include "dma/blndma.h"
+#include "guestmem.h"
 #include "helper.h"
+#include "io/ir_gamepad.h"
 #include "peripheral.h"
 #include "stor/sdperiph.h"
 #include "sys/bufctl.h"
 #include "sys/gpio.h"
 #include "sys/irq.h"
 #include "sys/miu.h"
+#include "sys/scheduler.h"
 #include "sys/timer.h"
 #include "sys/i2c.h"
 
@@ -18,13 +21,28 @@
 #include "video/tve.h"
 #include "video/csi.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <zlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__) && defined(__x86_64__)
+#define EMU293_FASTMEM
+#endif
 using namespace std;
 
 namespace Emu293 {
 #define RAM_START 0xA0000000
-#define RAM_SIZE (64 * 1024 * 1024) // not sure about this
 
 #define RAM_START_ALIAS 0x80000000 // different caching config
 
@@ -34,29 +52,111 @@ namespace Emu293 {
 
 #define IMEM_START 0x9F000000
 #define IMEM_START_ALT 0xBF000000
-#define IMEM_SIZE 0x01000000
 
-uint8_t ram[RAM_SIZE];
-bool ram_active[RAM_SIZE];
-uint8_t imem[IMEM_SIZE];
+// Only pages the guest touches take host memory
+uint8_t *ram = guest_alloc(RAM_SIZE);
+uint8_t *imem = guest_alloc(IMEM_SIZE);
 
 const Peripheral *peripherals[256] = {NULL};
 
 CPU *currentCPU;
 
+#ifdef EMU293_TRACK_UNINIT
+// One bit per RAM byte, set once written, to catch reads of uninitialised memory
+static uint8_t *ram_shadow = guest_alloc(RAM_SIZE / 8);
+
+static void shadow_init(uint32_t start, uint32_t end) {
+  for (uint32_t i = start; i < end; i++)
+    ram_shadow[i >> 3] |= 1 << (i & 7);
+}
+
+static inline void shadow_check(const uint8_t *ptr, uint32_t len, uint32_t addr) {
+  uint32_t off = ptr - ram;
+  for (uint32_t i = off; i < off + len; i++) {
+    if (!(ram_shadow[i >> 3] & (1 << (i & 7)))) {
+      printf("Read%d from uninit memory location 0x%08x at 0x%08x\n", len * 8, addr, currentCPU->pc);
+      return;
+    }
+  }
+}
+#endif
+
+// Dirty page tracking: each 4KB page of RAM, then of imem, holds the epoch it
+// was last written in, and each group of pages the newest epoch of any of them
+// so scans can skip clean regions. Relaxed atomics as the camera thread writes
+// RAM too
+#define DIRTY_PAGES (RAM_SIZE >> DIRTY_PAGE_SHIFT)
+#define IMEM_DIRTY_PAGES (IMEM_SIZE >> DIRTY_PAGE_SHIFT)
+#define DIRTY_GROUP_SHIFT 6
+static atomic<uint32_t> dirtyEpoch{1};
+static atomic<uint32_t> pageEpoch[DIRTY_PAGES + IMEM_DIRTY_PAGES];
+static atomic<uint32_t> groupEpoch[(DIRTY_PAGES + IMEM_DIRTY_PAGES) >> DIRTY_GROUP_SHIFT];
+
+static inline void page_dirty(uint32_t page, uint32_t epoch) {
+  pageEpoch[page].store(epoch, memory_order_relaxed);
+  groupEpoch[page >> DIRTY_GROUP_SHIFT].store(epoch, memory_order_relaxed);
+}
+
+// Drop cached code covering a write of len bytes at offset into RAM/imem
+static inline void ram_written(uint32_t offset, uint32_t len) {
+#ifdef EMU293_TRACK_UNINIT
+  shadow_init(offset, offset + len);
+#endif
+  uint32_t epoch = dirtyEpoch.load(memory_order_relaxed);
+  page_dirty(offset >> DIRTY_PAGE_SHIFT, epoch);
+  page_dirty(((offset + len - 1) & (RAM_SIZE - 1)) >> DIRTY_PAGE_SHIFT, epoch);
+  if (currentCPU) {
+    currentCPU->code_written(offset >> CPU::CODE_PAGE_SHIFT);
+    currentCPU->code_written(((offset + len - 1) & (RAM_SIZE - 1)) >> CPU::CODE_PAGE_SHIFT);
+  }
+}
+
+static inline void imem_written(uint32_t offset, uint32_t len) {
+  uint32_t epoch = dirtyEpoch.load(memory_order_relaxed);
+  page_dirty(DIRTY_PAGES + (offset >> DIRTY_PAGE_SHIFT), epoch);
+  page_dirty(DIRTY_PAGES + (((offset + len - 1) & (IMEM_SIZE - 1)) >> DIRTY_PAGE_SHIFT), epoch);
+  if (currentCPU) {
+    currentCPU->code_written(CPU::RAM_CODE_PAGES + (offset >> CPU::CODE_PAGE_SHIFT));
+    currentCPU->code_written(CPU::RAM_CODE_PAGES + (((offset + len - 1) & (IMEM_SIZE - 1)) >> CPU::CODE_PAGE_SHIFT));
+  }
+}
+
 void registerPeripheral(const Peripheral *periph, uint8_t addr) {
   peripherals[addr] = periph;
   PeripheralInitInfo initInfo = {PERIPH_START + (addr << 16), currentCPU};
   periph->initPeriph(initInfo);
 }
 
+// Guest address space in 64KB pages. RAM pages, which behave the same for
+// every access size, map straight to host memory; everything else is nullptr
+// and goes through the address decode below
+#define MEM_PAGE_SHIFT 16
+#define MEM_PAGE_MASK ((1 << MEM_PAGE_SHIFT) - 1)
+
+static uint8_t *mem_pages[1 << (32 - MEM_PAGE_SHIFT)];
+
+static bool init_mem_pages() {
+  for (uint32_t off = 0; off < RAM_SIZE; off += (1 << MEM_PAGE_SHIFT)) {
+    mem_pages[(RAM_START + off) >> MEM_PAGE_SHIFT] = &(ram[off]);
+    mem_pages[(RAM_START_ALIAS + off) >> MEM_PAGE_SHIFT] = &(ram[off]);
+  }
+  return true;
+}
+
+static bool mem_pages_init = init_mem_pages();
+
+static inline uint8_t *mem_page_ptr(uint32_t addr) {
+  uint8_t *page = mem_pages[addr >> MEM_PAGE_SHIFT];
+  return page ? (page + (addr & MEM_PAGE_MASK)) : nullptr;
+}
+
 uint8_t read_memU8(uint32_t addr) {
-  if ((addr >= RAM_START) && (addr < (RAM_START + RAM_SIZE))) {
-    // if (!ram_active[addr - RAM_START])
-      // printf("Read8 from uninit memory location 0x%08x\n", addr);
-    return ram[addr - RAM_START];
-  } else if ((addr >= RAM_START_ALIAS) && (addr < (RAM_START_ALIAS + RAM_SIZE))) {
-    return ram[addr - RAM_START_ALIAS];
+  uint8_t *ptr = mem_page_ptr(addr);
+  if (ptr != nullptr) {
+#ifdef EMU293_TRACK_UNINIT
+    shadow_check(ptr, 1, addr);
+#endif
+    return *ptr;
   } else {
     printf("Read8 from unmapped memory location 0x%08x at %08x\n", addr, currentCPU->pc);
     // currentCPU->debugDump();
@@ -65,13 +165,13 @@ uint8_t read_memU8(uint32_t addr) {
   }
 }
 void write_memU8(uint32_t addr, uint8_t val) {
-
-  if ((addr >= RAM_START) && (addr < (RAM_START + RAM_SIZE))) {
-    ram[addr - RAM_START] = val;
-  } else if ((addr >= RAM_START_ALIAS) && (addr < (RAM_START_ALIAS + RAM_SIZE))) {
-    ram[addr - RAM_START_ALIAS] = val;
+  uint8_t *ptr = mem_page_ptr(addr);
+  if (ptr != nullptr) {
+    *ptr = val;
+    ram_written(ptr - ram, 1);
   } else if ((addr >= IMEM_START) && (addr < (IMEM_START + IMEM_SIZE))) {
     imem[addr - IMEM_START] = val;
+    imem_written(addr - IMEM_START, 1);
   } else {
     // printf("Write 0x%02x to unmapped memory location 0x%08x\n", val, addr);
   }
@@ -80,10 +180,12 @@ uint16_t read_memU16(uint32_t addr) {
   /*	if(addr == 0xa0e002dc) {
                   printf("...\n");
           }*/
-  if ((addr >= RAM_START) && (addr < (RAM_START + RAM_SIZE))) {
-    return get_uint16le(&(ram[addr - RAM_START]));
-  } else if ((addr >= RAM_START_ALIAS) && (addr < (RAM_START_ALIAS + RAM_SIZE))) {
-    return get_uint16le(&(ram[addr - RAM_START_ALIAS]));
+  uint8_t *ptr = mem_page_ptr(addr);
+  if (ptr != nullptr) {
+#ifdef EMU293_TRACK_UNINIT
+    shadow_check(ptr, 2, addr);
+#endif
+    return get_uint16le(ptr);
   } else if ((addr >= IMEM_START) && (addr < (IMEM_START + IMEM_SIZE))) {
     printf("Read from imem 0x%08x at 0x%08x\n", addr, currentCPU->pc);
 
@@ -102,10 +204,10 @@ uint16_t read_memU16(uint32_t addr) {
   }
 }
 void write_memU16(uint32_t addr, uint16_t val) {
-  if ((addr >= RAM_START) && (addr < (RAM_START + RAM_SIZE))) {
-    set_uint16le(&(ram[addr - RAM_START]), val);
-  } else if ((addr >= RAM_START_ALIAS) && (addr < (RAM_START_ALIAS + RAM_SIZE))) {
-    set_uint16le(&(ram[addr - RAM_START_ALIAS]), val);
+  uint8_t *ptr = mem_page_ptr(addr);
+  if (ptr != nullptr) {
+    set_uint16le(ptr, val);
+    ram_written(ptr - ram, 2);
   } else {
     // printf("Write 0x%04x to unmapped memory location 0x%08x at 0x%08x\n",
     // val,
@@ -115,24 +217,20 @@ void write_memU16(uint32_t addr, uint16_t val) {
 
 // NB peripheral read/writes are only 32 bit
 uint32_t read_memU32(uint32_t addr) {
-  if ((addr >= RAM_START) && (addr < (RAM_START + RAM_SIZE))) {
-    // if (!ram_active[addr - RAM_START])
-    // printf("Read32 from uninit memory location 0x%08x at 0x%08x\n", addr,
-    //         currentCPU->pc);
-    return get_uint32le(&(ram[addr - RAM_START]));
-  } else if ((addr >= RAM_START_ALIAS) && (addr < (RAM_START_ALIAS + RAM_SIZE))) {
-    return get_uint32le(&(ram[addr - RAM_START_ALIAS]));
-  } else if ((addr >= IMEM_START) && (addr < (IMEM_START + IMEM_SIZE))) {
-    printf("Read from imem 0x%08x at 0x%08x\n", addr, currentCPU->pc);
-    return get_uint32le(&(imem[addr - IMEM_START]));
-  } else if ((addr >= IMEM_START_ALT) &&
-             (addr < (IMEM_START_ALT + IMEM_SIZE))) {
-    printf("Read from imem 0x%08x at 0x%08x\n", addr, currentCPU->pc);
-    return get_uint32le(&(imem[addr - IMEM_START_ALT]));
+  uint8_t *ptr = mem_page_ptr(addr);
+  if (ptr != nullptr) {
+#ifdef EMU293_TRACK_UNINIT
+    shadow_check(ptr, 4, addr);
+#endif
+    return get_uint32le(ptr);
   } else if ((addr >= PERIPH_START) && (addr < (PERIPH_START + PERIPH_SIZE))) {
     uint8_t pAddr = (addr >> 16) & 0xFF;
-    if (peripherals[pAddr] != NULL) {
-      return peripherals[pAddr]->regRead(addr & 0xFFFF);
+    const Peripheral *periph = peripherals[pAddr];
+    if (periph != NULL) {
+      uint32_t reg = (addr & 0xFFFF) / 4;
+      if (reg < periph->regCount && !has_side_effect(periph->readSideEffects, reg))
+        return periph->regs[reg];
+      return periph->regRead(addr & 0xFFFF);
     } else {
       if (pAddr != 0x05)
         printf("Read32 from unmapped peripheral location 0x%08x at 0x%08x\n",
@@ -142,6 +240,13 @@ uint32_t read_memU32(uint32_t addr) {
 
       return 0;
     }
+  } else if ((addr >= IMEM_START) && (addr < (IMEM_START + IMEM_SIZE))) {
+    printf("Read from imem 0x%08x at 0x%08x\n", addr, currentCPU->pc);
+    return get_uint32le(&(imem[addr - IMEM_START]));
+  } else if ((addr >= IMEM_START_ALT) &&
+             (addr < (IMEM_START_ALT + IMEM_SIZE))) {
+    printf("Read from imem 0x%08x at 0x%08x\n", addr, currentCPU->pc);
+    return get_uint32le(&(imem[addr - IMEM_START_ALT]));
   } else {
     /*printf("Read32 from unmapped memory location 0x%08x at 0x%08x\n", addr,
            currentCPU->pc);*/
@@ -152,29 +257,36 @@ uint32_t read_memU32(uint32_t addr) {
   }
 }
 void write_memU32(uint32_t addr, uint32_t val) {
-  if ((addr >= RAM_START) && (addr < (RAM_START + RAM_SIZE))) {
-    set_uint32le(&(ram[addr - RAM_START]), val);
-  } else if ((addr >= RAM_START_ALIAS) && (addr < (RAM_START_ALIAS + RAM_SIZE))) {
-    return set_uint32le(&(ram[addr - RAM_START_ALIAS]), val);
+  uint8_t *ptr = mem_page_ptr(addr);
+  if (ptr != nullptr) {
+    set_uint32le(ptr, val);
+    ram_written(ptr - ram, 4);
+  } else if ((addr >= PERIPH_START) && (addr < (PERIPH_START + PERIPH_SIZE))) {
+    uint8_t pAddr = (addr >> 16) & 0xFF;
+    // printf("Paddr = 0x%02x\n",pAddr);
+    const Peripheral *periph = peripherals[pAddr];
+    if (periph != NULL) {
+      uint32_t reg = (addr & 0xFFFF) / 4;
+      if (reg < periph->regCount && !has_side_effect(periph->writeSideEffects, reg))
+        periph->regs[reg] = val;
+      else
+        periph->regWrite(addr & 0xFFFF, val);
+    } else {
+      // printf("Write 0x%08x to unmapped peripheral location 0x%08x at
+      // 0x%08x\n",
+      //         val, addr, currentCPU->pc);
+    }
   } else if ((addr >= IMEM_START) && (addr < (IMEM_START + IMEM_SIZE))) {
     set_uint32le(&(imem[addr - IMEM_START]), val);
+    imem_written(addr - IMEM_START, 4);
     printf("Write 0x%08x to imem 0x%08x at 0x%08x\n", val, addr,
            currentCPU->pc);
   } else if ((addr >= IMEM_START_ALT) &&
              (addr < (IMEM_START_ALT + IMEM_SIZE))) {
     set_uint32le(&(imem[addr - IMEM_START_ALT]), val);
+    imem_written(addr - IMEM_START_ALT, 4);
     printf("Write 0x%08x to imem 0x%08x at 0x%08x\n", val, addr,
            currentCPU->pc);
-  } else if ((addr >= PERIPH_START) && (addr < (PERIPH_START + PERIPH_SIZE))) {
-    uint8_t pAddr = (addr >> 16) & 0xFF;
-    // printf("Paddr = 0x%02x\n",pAddr);
-    if (peripherals[pAddr] != NULL) {
-      peripherals[pAddr]->regWrite(addr & 0xFFFF, val);
-    } else {
-      // printf("Write 0x%08x to unmapped peripheral location 0x%08x at
-      // 0x%08x\n",
-      //         val, addr, currentCPU->pc);
-    }
   } else {
     // printf("Write 0x%08x to unmapped memory location 0x%08x at 0x%08x\n",
     // val,
@@ -194,6 +306,123 @@ uint8_t *get_dma_ptr(uint32_t addr) {
     return nullptr;
 }
 
+void mark_ram_dirty(uint32_t addr, uint32_t len) {
+  addr &= 0xDFFFFFFF;
+  if ((len == 0) || (addr < RAM_START_ALIAS) || (addr >= (RAM_START_ALIAS + RAM_SIZE)))
+    return;
+  uint32_t start = addr - RAM_START_ALIAS;
+  uint32_t end = min<uint64_t>(uint64_t(start) + len, RAM_SIZE);
+#ifdef EMU293_TRACK_UNINIT
+  shadow_init(start, end);
+#endif
+  uint32_t epoch = dirtyEpoch.load(memory_order_relaxed);
+  for (uint32_t p = start >> DIRTY_PAGE_SHIFT; p <= ((end - 1) >> DIRTY_PAGE_SHIFT); p++)
+    page_dirty(p, epoch);
+}
+
+uint32_t dirty_epoch_begin() {
+  return dirtyEpoch.fetch_add(1, memory_order_relaxed);
+}
+
+bool ram_page_dirty(uint32_t page, uint32_t since) {
+  return (page < DIRTY_PAGES) && (pageEpoch[page].load(memory_order_relaxed) > since);
+}
+
+// Pages from first to first + count, numbered from first
+static size_t dirty_pages(uint32_t first, uint32_t count, uint32_t since, vector<uint32_t> &pages) {
+  pages.clear();
+  for (uint32_t g = first >> DIRTY_GROUP_SHIFT; g < ((first + count) >> DIRTY_GROUP_SHIFT); g++) {
+    if (groupEpoch[g].load(memory_order_relaxed) <= since)
+      continue;
+    for (uint32_t p = g << DIRTY_GROUP_SHIFT; p < ((g + 1) << DIRTY_GROUP_SHIFT); p++)
+      if (pageEpoch[p].load(memory_order_relaxed) > since)
+        pages.push_back(p - first);
+  }
+  return pages.size();
+}
+
+size_t ram_dirty_pages(uint32_t since, vector<uint32_t> &pages) {
+  return dirty_pages(0, DIRTY_PAGES, since, pages);
+}
+
+size_t imem_dirty_pages(uint32_t since, vector<uint32_t> &pages) {
+  return dirty_pages(DIRTY_PAGES, IMEM_DIRTY_PAGES, since, pages);
+}
+
+bool imem_dirty(uint32_t since) {
+  for (uint32_t g = DIRTY_PAGES >> DIRTY_GROUP_SHIFT; g < ((DIRTY_PAGES + IMEM_DIRTY_PAGES) >> DIRTY_GROUP_SHIFT); g++)
+    if (groupEpoch[g].load(memory_order_relaxed) > since)
+      return true;
+  return false;
+}
+
+void mark_dma_write(uint32_t addr, uint32_t len) {
+  mark_ram_dirty(addr, len);
+  if ((len == 0) || (currentCPU == nullptr))
+    return;
+  uint32_t start, end;
+  if ((addr >= RAM_START) && (addr < (RAM_START + RAM_SIZE))) {
+    start = addr - RAM_START;
+    end = min<uint64_t>(uint64_t(start) + len, RAM_SIZE);
+    for (uint32_t p = start >> CPU::CODE_PAGE_SHIFT; p <= ((end - 1) >> CPU::CODE_PAGE_SHIFT); p++)
+      currentCPU->code_written(p);
+  } else if ((addr & 0xDF000000) == IMEM_START) {
+    start = addr & (IMEM_SIZE - 1);
+    end = min<uint64_t>(uint64_t(start) + len, IMEM_SIZE);
+    uint32_t epoch = dirtyEpoch.load(memory_order_relaxed);
+    for (uint32_t p = start >> DIRTY_PAGE_SHIFT; p <= ((end - 1) >> DIRTY_PAGE_SHIFT); p++)
+      page_dirty(DIRTY_PAGES + p, epoch);
+    for (uint32_t p = start >> CPU::CODE_PAGE_SHIFT; p <= ((end - 1) >> CPU::CODE_PAGE_SHIFT); p++)
+      currentCPU->code_written(CPU::RAM_CODE_PAGES + p);
+  }
+}
+
+#ifdef EMU293_FASTMEM
+static uint8_t *fastmem_base = nullptr;
+static bool fastmem_tried = false;
+
+uint8_t *get_fastmem_base() {
+  if (fastmem_tried)
+    return fastmem_base;
+  fastmem_tried = true;
+  // RAM moves onto a memfd so the same pages can be mapped at ram[] and at
+  // both RAM windows in a reserved 4GB region; the rest stays inaccessible
+  int fd = memfd_create("emu293-ram", 0);
+  if (fd < 0)
+    return nullptr;
+  void *space = mmap(nullptr, 1ULL << 32, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  bool ok = (space != MAP_FAILED) && (ftruncate(fd, RAM_SIZE) == 0);
+  // Only copy pages that have been written, so untouched RAM stays unbacked
+  vector<uint32_t> written;
+  ram_dirty_pages(0, written);
+  for (uint32_t p : written) {
+    if (ok)
+      ok = pwrite(fd, ram + (p << DIRTY_PAGE_SHIFT), 1 << DIRTY_PAGE_SHIFT,
+                  p << DIRTY_PAGE_SHIFT) == (1 << DIRTY_PAGE_SHIFT);
+  }
+  uint8_t *base = static_cast<uint8_t *>(space);
+  for (uint8_t *window : {base + RAM_START, base + RAM_START_ALIAS, ram}) {
+    if (ok)
+      ok = mmap(window, RAM_SIZE, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+    if (ok)
+      guest_advise_huge(window, RAM_SIZE);
+  }
+  close(fd);
+  if (!ok) {
+    printf("Failed to set up fastmem, using the memory handlers\n");
+    if (space != MAP_FAILED)
+      munmap(space, 1ULL << 32);
+    return nullptr;
+  }
+  fastmem_base = base;
+  return fastmem_base;
+}
+#else
+uint8_t *get_fastmem_base() { return nullptr; }
+#endif
+
 static uint32_t softreset_entryPoint;
 
 void system_init(CPU *cpu) {
@@ -234,16 +463,404 @@ void system_softreset() {
   currentCPU->reset();
 }
 
-void system_state(SaveStater &s) {
-  s.tag("EXTMEM");
-  s.a(ram);
-  s.tag("INTMEM");
-  s.a(imem);
+void system_device_state(SaveStater &s) {
   s.tag("PERIPH");
   for (auto p : peripherals)
     if (p)
       p->state(s);
+  IRGamepadState(s);
   currentCPU->state(s);
+  sched_state(s);
+}
+
+// Savestate files start with a table of sections. RAM and imem are split into
+// chunks that are compressed in parallel, leaving out pages that are all zero
+#define STATE_MAGIC "EMU293SS"
+#define STATE_VERSION 1
+#define STATE_CHUNK_PAGES 256
+#define STATE_CHUNK_SIZE (STATE_CHUNK_PAGES << DIRTY_PAGE_SHIFT)
+
+struct StateChunk {
+  // Which pages of the chunk are stored, in order
+  uint8_t present[STATE_CHUNK_PAGES / 8];
+  vector<uint8_t> data;
+  uint32_t raw_len;
+};
+
+static void parallel_for(size_t count, const function<void(size_t)> &fn) {
+  atomic<size_t> next{0};
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++)
+      fn(i);
+  };
+  size_t nthreads = min<size_t>(max(thread::hardware_concurrency(), 1U), count);
+  vector<thread> threads;
+  for (size_t t = 1; t < nthreads; t++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &t : threads)
+    t.join();
+}
+
+static bool page_is_zero(const uint8_t *page) {
+  static const uint8_t zero[1 << DIRTY_PAGE_SHIFT] = {0};
+  return memcmp(page, zero, sizeof(zero)) == 0;
+}
+
+// written says whether a page may be non-zero, anything never written is
+static void save_mem(const uint8_t *mem, uint32_t len, const function<bool(uint32_t)> &written,
+                     vector<StateChunk> &chunks) {
+  chunks.resize(len / STATE_CHUNK_SIZE);
+  parallel_for(chunks.size(), [&](size_t c) {
+    StateChunk &chunk = chunks[c];
+    vector<uint8_t> raw;
+    fill(chunk.present, chunk.present + sizeof(chunk.present), 0);
+    for (uint32_t i = 0; i < STATE_CHUNK_PAGES; i++) {
+      uint32_t page = c * STATE_CHUNK_PAGES + i;
+      const uint8_t *ptr = mem + (page << DIRTY_PAGE_SHIFT);
+      if (!written(page) || page_is_zero(ptr))
+        continue;
+      set_bit(chunk.present[i / 8], i % 8);
+      raw.insert(raw.end(), ptr, ptr + (1 << DIRTY_PAGE_SHIFT));
+    }
+    chunk.raw_len = raw.size();
+    uLongf clen = compressBound(raw.size());
+    chunk.data.resize(clen);
+    if (!raw.empty())
+      compress2(chunk.data.data(), &clen, raw.data(), raw.size(), Z_BEST_SPEED);
+    else
+      clen = 0;
+    chunk.data.resize(clen);
+  });
+}
+
+static void put32(vector<uint8_t> &out, uint32_t val) {
+  uint8_t b[4];
+  set_uint32le(b, val);
+  out.insert(out.end(), b, b + 4);
+}
+
+static uint32_t get32(const uint8_t *&ptr) {
+  uint32_t val = get_uint32le(ptr);
+  ptr += 4;
+  return val;
+}
+
+// Chunk table of (stored length, uncompressed length, page bitmap) then data
+static void put_mem(vector<uint8_t> &out, const vector<StateChunk> &chunks) {
+  put32(out, chunks.size());
+  for (auto &chunk : chunks) {
+    put32(out, chunk.data.size());
+    put32(out, chunk.raw_len);
+    out.insert(out.end(), chunk.present, chunk.present + sizeof(chunk.present));
+  }
+  for (auto &chunk : chunks)
+    out.insert(out.end(), chunk.data.begin(), chunk.data.end());
+}
+
+// Pages of RAM ever written, any others are zero
+static vector<bool> ram_used_pages() {
+  vector<uint32_t> pages;
+  ram_dirty_pages(0, pages);
+  vector<bool> used(DIRTY_PAGES);
+  for (uint32_t p : pages)
+    used[p] = true;
+  return used;
+}
+
+// Goes through a temporary file, so a failed or interrupted save never
+// leaves a broken one behind
+static bool write_state(const std::string &file, const vector<uint8_t> &dev, const uint8_t *ram_src,
+                        const vector<bool> &ram_used, const uint8_t *imem_src, bool imem_used) {
+  vector<StateChunk> ram_chunks, imem_chunks;
+  save_mem(ram_src, RAM_SIZE, [&](uint32_t p) { return bool(ram_used[p]); }, ram_chunks);
+  save_mem(imem_src, IMEM_SIZE, [&](uint32_t) { return imem_used; }, imem_chunks);
+
+  vector<uint8_t> sections[3];
+  const char *tags[3] = {"DEVICE", "RAM", "IMEM"};
+  uLongf clen = compressBound(dev.size());
+  sections[0].resize(clen);
+  compress2(sections[0].data(), &clen, dev.data(), dev.size(), Z_BEST_SPEED);
+  sections[0].resize(clen);
+  put32(sections[0], dev.size());
+  put_mem(sections[1], ram_chunks);
+  put_mem(sections[2], imem_chunks);
+
+  // Header, then (tag, offset, length) for each section
+  vector<uint8_t> header(STATE_MAGIC, STATE_MAGIC + 8);
+  put32(header, STATE_VERSION);
+  put32(header, 3);
+  uint32_t offset = header.size() + 3 * 16;
+  for (int i = 0; i < 3; i++) {
+    char tag[8] = {0};
+    memcpy(tag, tags[i], strlen(tags[i]));
+    header.insert(header.end(), tag, tag + 8);
+    put32(header, offset);
+    put32(header, sections[i].size());
+    offset += sections[i].size();
+  }
+  std::string tmp = file + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr) {
+    printf("failed to open savestate file %s for save\n", tmp.c_str());
+    return false;
+  }
+  bool ok = fwrite(header.data(), 1, header.size(), f) == header.size();
+  for (auto &sec : sections)
+    ok = ok && (fwrite(sec.data(), 1, sec.size(), f) == sec.size());
+  ok = (fclose(f) == 0) && ok;
+  if (ok) {
+#ifdef _WIN32
+    remove(file.c_str());
+#endif
+    ok = rename(tmp.c_str(), file.c_str()) == 0;
+  }
+  if (!ok) {
+    printf("failed to write savestate file %s\n", file.c_str());
+    remove(tmp.c_str());
+  }
+  return ok;
+}
+
+bool system_save_state(const std::string &file) {
+  vector<uint8_t> dev;
+  SaveStater s;
+  s.begin_save(dev);
+  system_device_state(s);
+  s.finalise();
+  return write_state(file, dev, ram, ram_used_pages(), imem, imem_dirty(0));
+}
+
+// Checks and decompresses a memory section into chunks, leaving the machine
+// alone so a bad file can't leave it half loaded
+static bool decode_mem(const uint8_t *sec, size_t sec_len, uint32_t len, vector<StateChunk> &chunks) {
+  if (sec_len < 4)
+    return false;
+  const uint8_t *ptr = sec;
+  uint32_t nchunks = get32(ptr);
+  if (nchunks != (len / STATE_CHUNK_SIZE))
+    return false;
+  size_t table = 4 + nchunks * (8 + STATE_CHUNK_PAGES / 8);
+  if (table > sec_len)
+    return false;
+  chunks.resize(nchunks);
+  vector<const uint8_t *> data(nchunks);
+  vector<uint32_t> clens(nchunks);
+  size_t offset = table;
+  for (uint32_t c = 0; c < nchunks; c++) {
+    StateChunk &chunk = chunks[c];
+    clens[c] = get32(ptr);
+    chunk.raw_len = get32(ptr);
+    memcpy(chunk.present, ptr, sizeof(chunk.present));
+    ptr += sizeof(chunk.present);
+    uint32_t pages = 0;
+    for (uint32_t i = 0; i < STATE_CHUNK_PAGES; i++)
+      pages += check_bit(chunk.present[i / 8], i % 8);
+    // Also bounds what gets allocated below
+    if (chunk.raw_len > STATE_CHUNK_SIZE || chunk.raw_len != (pages << DIRTY_PAGE_SHIFT))
+      return false;
+    data[c] = sec + offset;
+    offset += clens[c];
+  }
+  if (offset != sec_len)
+    return false;
+  atomic<bool> ok{true};
+  parallel_for(nchunks, [&](size_t c) {
+    vector<uint8_t> &raw = chunks[c].data;
+    raw.resize(chunks[c].raw_len);
+    uLongf rlen = raw.size();
+    if (!raw.empty() && (uncompress(raw.data(), &rlen, data[c], clens[c]) != Z_OK || rlen != raw.size()))
+      ok = false;
+  });
+  return ok;
+}
+
+// Pages not stored are zero. Only pages that change are written, so untouched
+// memory stays unbacked
+static void apply_mem(const vector<StateChunk> &chunks, uint8_t *mem, bool is_ram) {
+  uint32_t epoch = dirtyEpoch.load(memory_order_relaxed);
+  parallel_for(chunks.size(), [&](size_t c) {
+    const uint8_t *src = chunks[c].data.data();
+    for (uint32_t i = 0; i < STATE_CHUNK_PAGES; i++) {
+      uint32_t page = c * STATE_CHUNK_PAGES + i;
+      uint32_t index = is_ram ? page : (DIRTY_PAGES + page);
+      uint8_t *dst = mem + (page << DIRTY_PAGE_SHIFT);
+      bool changed = false;
+      if (check_bit(chunks[c].present[i / 8], i % 8)) {
+        changed = memcmp(dst, src, 1 << DIRTY_PAGE_SHIFT) != 0;
+        if (changed)
+          memcpy(dst, src, 1 << DIRTY_PAGE_SHIFT);
+        src += (1 << DIRTY_PAGE_SHIFT);
+      } else if (pageEpoch[index].load(memory_order_relaxed) != 0 && !page_is_zero(dst)) {
+        memset(dst, 0, 1 << DIRTY_PAGE_SHIFT);
+        changed = true;
+      }
+      if (changed)
+        page_dirty(index, epoch);
+    }
+  });
+}
+
+bool system_load_state(const std::string &file) {
+  vector<uint8_t> contents;
+  const uint8_t *base;
+  size_t size;
+#ifndef _WIN32
+  int fd = open(file.c_str(), O_RDONLY);
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (fd >= 0)
+    close(fd);
+  if (map == MAP_FAILED) {
+    printf("failed to open savestate file %s for load\n", file.c_str());
+    return false;
+  }
+  base = static_cast<const uint8_t *>(map);
+  size = st.st_size;
+#else
+  ifstream in(file, ios::binary);
+  if (!in) {
+    printf("failed to open savestate file %s for load\n", file.c_str());
+    return false;
+  }
+  contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  base = contents.data();
+  size = contents.size();
+#endif
+  const uint8_t *sections[3] = {nullptr};
+  size_t lengths[3] = {0};
+  const char *tags[3] = {"DEVICE", "RAM", "IMEM"};
+  bool ok = (size >= 16) && (memcmp(base, STATE_MAGIC, 8) == 0);
+  if (ok) {
+    const uint8_t *ptr = base + 8;
+    uint32_t version = get32(ptr), nsec = get32(ptr);
+    ok = (version == STATE_VERSION) && ((16 + uint64_t(nsec) * 16) <= size);
+    for (uint32_t i = 0; ok && i < nsec; i++) {
+      const uint8_t *tag = ptr;
+      ptr += 8;
+      uint32_t offset = get32(ptr), length = get32(ptr);
+      if ((uint64_t(offset) + length) > size) {
+        ok = false;
+        break;
+      }
+      for (int t = 0; t < 3; t++) {
+        if (strncmp(reinterpret_cast<const char *>(tag), tags[t], 8) == 0) {
+          sections[t] = base + offset;
+          lengths[t] = length;
+        }
+      }
+    }
+    for (int t = 0; t < 3; t++)
+      ok = ok && (sections[t] != nullptr);
+  }
+  vector<uint8_t> dev;
+  if (ok) {
+    // Device state, compressed, followed by its length
+    ok = lengths[0] >= 4;
+    if (ok) {
+      const uint8_t *tail = sections[0] + lengths[0] - 4;
+      uint32_t dev_len = get32(tail);
+      // No more than zlib can expand to
+      ok = dev_len <= (uint64_t(lengths[0]) * 1032);
+      if (ok) {
+        dev.resize(dev_len);
+        uLongf dlen = dev.size();
+        ok = uncompress(dev.data(), &dlen, sections[0], lengths[0] - 4) == Z_OK && dlen == dev.size();
+      }
+    }
+  }
+  // Everything is checked before any of it goes into the machine
+  vector<StateChunk> ram_chunks, imem_chunks;
+  ok = ok && decode_mem(sections[1], lengths[1], RAM_SIZE, ram_chunks) &&
+       decode_mem(sections[2], lengths[2], IMEM_SIZE, imem_chunks);
+  if (ok) {
+    apply_mem(ram_chunks, ram, true);
+    apply_mem(imem_chunks, imem, false);
+    SaveStater s;
+    s.begin_load(dev);
+    system_device_state(s);
+    s.finalise();
+  } else {
+    printf("savestate file %s is not valid\n", file.c_str());
+  }
+#ifndef _WIN32
+  munmap(const_cast<uint8_t *>(base), size);
+#endif
+  return ok;
+}
+
+void system_snapshot_save(SystemSnapshot &snap) {
+  if (snap.ram == nullptr) {
+    snap.ram = guest_alloc(RAM_SIZE);
+    snap.imem = guest_alloc(IMEM_SIZE);
+  }
+  ram_dirty_pages(snap.epoch, snap.pages);
+  for (uint32_t p : snap.pages)
+    memcpy(snap.ram + (p << DIRTY_PAGE_SHIFT), ram + (p << DIRTY_PAGE_SHIFT), 1 << DIRTY_PAGE_SHIFT);
+  imem_dirty_pages(snap.epoch, snap.pages);
+  for (uint32_t p : snap.pages)
+    memcpy(snap.imem + (p << DIRTY_PAGE_SHIFT), imem + (p << DIRTY_PAGE_SHIFT), 1 << DIRTY_PAGE_SHIFT);
+  snap.epoch = dirty_epoch_begin();
+  SaveStater s;
+  s.begin_save(snap.state);
+  system_device_state(s);
+  s.finalise();
+}
+
+void system_snapshot_load(SystemSnapshot &snap) {
+  // Pages put back are left marked dirty, so the next save copies them
+  // again, which is harmless
+  ram_dirty_pages(snap.epoch, snap.pages);
+  for (uint32_t p : snap.pages) {
+    uint32_t start = p << DIRTY_PAGE_SHIFT, end = (p + 1) << DIRTY_PAGE_SHIFT;
+    memcpy(ram + start, snap.ram + start, end - start);
+    for (uint32_t c = start >> CPU::CODE_PAGE_SHIFT; c <= ((end - 1) >> CPU::CODE_PAGE_SHIFT); c++)
+      currentCPU->code_written(c);
+  }
+  imem_dirty_pages(snap.epoch, snap.pages);
+  for (uint32_t p : snap.pages) {
+    uint32_t start = p << DIRTY_PAGE_SHIFT, end = (p + 1) << DIRTY_PAGE_SHIFT;
+    memcpy(imem + start, snap.imem + start, end - start);
+    for (uint32_t c = start >> CPU::CODE_PAGE_SHIFT; c <= ((end - 1) >> CPU::CODE_PAGE_SHIFT); c++)
+      currentCPU->code_written(CPU::RAM_CODE_PAGES + c);
+  }
+  SaveStater s;
+  s.keep_code = true;
+  s.begin_load(snap.state);
+  system_device_state(s);
+  s.finalise();
+}
+
+// Background saves write from a snapshot, which only needs the pages changed
+// since the last one copying, while emulation carries on
+static SystemSnapshot async_snap;
+static thread async_thread;
+static atomic<bool> async_busy{false};
+
+bool system_save_state_async(const std::string &file) {
+  if (async_busy) {
+    printf("Still writing the last savestate, not saving to %s\n", file.c_str());
+    return false;
+  }
+  if (async_thread.joinable())
+    async_thread.join();
+  system_snapshot_save(async_snap);
+  vector<bool> ram_used = ram_used_pages();
+  bool imem_used = imem_dirty(0);
+  async_busy = true;
+  async_thread = thread([file, ram_used, imem_used]() {
+    if (write_state(file, async_snap.state, async_snap.ram, ram_used, async_snap.imem, imem_used))
+      printf("Saved state to %s\n", file.c_str());
+    async_busy = false;
+  });
+  return true;
+}
+
+void system_save_state_wait() {
+  if (async_thread.joinable())
+    async_thread.join();
 }
 
 }
@@ -3,11 +3,35 @@
 #include "cpu/cpu.h"
 using namespace std;
 namespace Emu293 {
+	#define RAM_SIZE (64 * 1024 * 1024) // not sure about this
+	#define IMEM_SIZE 0x01000000
+
 	void system_init(CPU *cpu);
 
 	void system_softreset();
 
-	void system_state(SaveStater &s);
+	//Savestate files, returning false with a message on failure
+	bool system_save_state(const std::string &file);
+	bool system_load_state(const std::string &file);
+	//Takes a copy of the machine and writes it out on another thread, which
+	//reports when done. Returns false if the last is still being written
+	bool system_save_state_async(const std::string &file);
+	//Waits for any background save to finish
+	void system_save_state_wait();
+	//Everything but RAM and internal memory
+	void system_device_state(SaveStater &s);
+
+	//Machine state kept in memory, for run-ahead. The memories are whole copies
+	//that each save only updates where they have been written since the last
+	struct SystemSnapshot {
+		uint8_t *ram = nullptr, *imem = nullptr;
+		uint32_t epoch = 0;
+		vector<uint32_t> pages;
+		vector<uint8_t> state;
+	};
+	void system_snapshot_save(SystemSnapshot &snap);
+	//Puts back the last save
+	void system_snapshot_load(SystemSnapshot &snap);
 
 	uint8_t read_memU8(uint32_t addr);
 	void write_memU8(uint32_t addr, uint8_t val);
@@ -20,4 +44,29 @@ namespace Emu293 {
 
 	//Get a pointer for fast RAM access - returns nullptr if start address invalid
 	uint8_t *get_dma_ptr(uint32_t addr);
+
+	//Report a write made through a get_dma_ptr pointer, so cached code is dropped
+	void mark_dma_write(uint32_t addr, uint32_t len);
+
+	//As mark_dma_write, but only for dirty tracking so safe from other threads
+	void mark_ram_dirty(uint32_t addr, uint32_t len);
+
+	#define DIRTY_PAGE_SHIFT 12
+	#define DIRTY_PAGE_SIZE (1 << DIRTY_PAGE_SHIFT)
+
+	//Dirty page tracking over RAM and imem in 4KB pages. Each consumer keeps its own epoch
+	//from dirty_epoch_begin() and asks what has been written since; epoch 0
+	//means since power on
+	uint32_t dirty_epoch_begin();
+	bool ram_page_dirty(uint32_t page, uint32_t since);
+	//True if any page of internal memory was written since the epoch
+	bool imem_dirty(uint32_t since);
+	//Fills pages with the RAM page numbers written since the epoch
+	size_t ram_dirty_pages(uint32_t since, vector<uint32_t> &pages);
+	//As ram_dirty_pages, for internal memory
+	size_t imem_dirty_pages(uint32_t since, vector<uint32_t> &pages);
+
+	//Host mirror of the 4GB guest address space with only RAM accessible, so
+	//anything else faults - returns nullptr where unsupported
+	uint8_t *get_fastmem_base();
 }
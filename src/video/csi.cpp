@@ -70,11 +70,17 @@ void InitCSIDevice(PeripheralInitInfo initInfo) {
     memptr = get_dma_ptr(0xA0000000);
 }
 
+static const RegBitmap<csi_nreg> csi_write_side = {csi_tg_irqst};
+
 const Peripheral CSIPeripheral = {"CSI", InitCSIDevice,
                                      CSIDeviceReadHandler,
                                      CSIDeviceWriteHandler,
                                      CSIDeviceResetHandler,
-                                     CSIState};
+                                     CSIState,
+                                     csi_regs,
+                                     csi_nreg,
+                                     nullptr,
+                                     csi_write_side.bits};
 
 static std::atomic<bool> csi_frame_need;
 static std::atomic<bool> csi_frame_done;
@@ -116,6 +122,8 @@ void csi_copy_frame() {
       uint32_t baseaddr = csi_regs[csi_tg_fbaddr1];
       uint8_t *ptr = (memptr + (baseaddr & 0x03FFFFFE));
       std::copy(csi_frame_tmp, csi_frame_tmp+(w*h), reinterpret_cast<uint16_t*>(ptr));
+      // runs on the capture thread, so dirty tracking only
+      mark_ram_dirty(0xA0000000 | (baseaddr & 0x03FFFFFE), w * h * 2);
     }
     // TODO: frame end interrupt
 }
@@ -1,6 +1,11 @@
 #include "ppu.h"
 #include "../helper.h"
 #include "../sys/irq_if.h"
+#include "../sys/headless.h"
+#include "../sys/rewind.h"
+#include "../sys/runahead.h"
+#include "../sys/scheduler.h"
+#include "../sys/sync.h"
 #include "../system.h"
 #include "../io/ir_gamepad.h"
 #include "csi.h"
@@ -193,6 +198,9 @@ void ppudma_worker() {
       ramptr += 4;
       ppuptr++;
     }
+    if (check_bit(ppu_regs[ppu_dma_ctrl], ppu_dma_ctrl_dir))
+      mark_dma_write(0xA0000000 | (ppu_regs[ppu_dma_miu_saddr] & 0x03FFFFFF),
+                     (ppu_regs[ppu_dma_word_cnt] + 1) * 4);
 
     clear_bit(ppu_regs[ppu_dma_ctrl], ppu_dma_ctrl_en);
     set_bit(ppu_regs[ppu_irq_status], ppu_irq_ppudma);
@@ -676,8 +684,12 @@ void PPUDeviceWriteHandler(uint16_t addr, uint32_t val) {
 
 uint32_t PPUDeviceReadHandler(uint16_t addr) { return ppu_regs[addr / 4]; }
 
+static void PPULineEvent(uint64_t when);
+
 void InitPPUDevice(PeripheralInitInfo initInfo) {
   memptr = get_dma_ptr(0xA0000000);
+  sched_register(EVT_PPU_LINE, PPULineEvent);
+  sched_set(EVT_PPU_LINE, sched_now() + 1000);
 }
 
 SDL_Window *ppu_window;
@@ -708,6 +720,10 @@ static void PPURender() {
 
   int swidth = ppu_screen_width[ppu_regs[ppu_control] & 0x03];
   int sheight = ppu_screen_height[ppu_regs[ppu_control] & 0x03];
+  if (headless) {
+    HeadlessFrame(&rendered[0][0], swidth, sheight);
+    return;
+  }
   int sx = video_scale * (640/swidth);
   int sy = video_scale * (480/sheight);
   for (int y = 0; y < (480*video_scale); y++) {
@@ -762,18 +778,26 @@ void InitPPUThreads() {
   ppudma_cvar = SDL_CreateCond();
   ppudma_thread = SDL_CreateThread(PPUDMA_Thread, "PPUDMA", nullptr);
 */
+  // Frames are rendered in line with emulation instead, so they only
+  // depend on emulated state
+  if (headless)
+    return;
   ppu_window = SDL_CreateWindow("emu293", SDL_WINDOWPOS_CENTERED,
                                 SDL_WINDOWPOS_CENTERED, 640*video_scale, 480*video_scale, 0);
   if (ppu_window == nullptr) {
     printf("Failed to create window: %s.\n", SDL_GetError());
     exit(1);
   }
+  // Presenting then waits for the display, which paces everything else
   ppuwin_renderer =
-      SDL_CreateRenderer(ppu_window, -1, SDL_RENDERER_ACCELERATED);
+      SDL_CreateRenderer(ppu_window, -1, SDL_RENDERER_ACCELERATED |
+                         (sync_source == SYNC_VIDEO ? SDL_RENDERER_PRESENTVSYNC : 0));
   ppu_thread = thread(ppu_render_thread);
 }
 
 void ShutdownPPU() {
+  if (!ppu_thread.joinable())
+    return;
   {
     lock_guard<mutex> lk(do_render_m);
     render_ready = true;
@@ -942,7 +966,7 @@ static void do_quit() {
   shutdown_flag = true;
 }
 
-void PPUUpdate() {
+void PPUPollEvents() {
   SDL_Event e;
   while (SDL_PollEvent(&e)) {
     if (e.type == SDL_QUIT) {
@@ -962,16 +986,38 @@ void PPUUpdate() {
           else if (e.key.keysym.mod & KMOD_CTRL)
             loadstate_flag = slot;
         }
-
+        if (e.key.keysym.scancode == SDL_SCANCODE_TAB)
+          fast_forward = true;
+        if (e.key.keysym.scancode == SDL_SCANCODE_BACKSPACE)
+          rewind_held = true;
       }
     }
+    if (e.type == SDL_KEYUP && e.key.keysym.scancode == SDL_SCANCODE_TAB)
+      fast_forward = false;
+    if (e.type == SDL_KEYUP && e.key.keysym.scancode == SDL_SCANCODE_BACKSPACE)
+      rewind_held = false;
     IRGamepadEvent(&e);
   }
+}
+
+void PPUUpdate() {
+  PPUPollEvents();
   PPUFlip();
   // SDL_Delay(1000);
 }
 
-void PPUTick() {
+void PPUPresent() {
+  // Not while the render thread could be drawing the last frame
+  lock_guard<mutex> lk(do_render_m);
+  PPURender();
+  PPUFlip();
+}
+
+uint64_t ppu_frame_count = 0;
+
+#define PPU_LINE_CYCLES 2000
+
+static void PPULineEvent(uint64_t when) {
   // simulate some kind of vblank to keep the app happy
   if (curr_line == 800) {
     curr_line = 0;
@@ -983,15 +1029,33 @@ void PPUTick() {
     }
   } else if (curr_line == 50) {
     curr_line++;
+    if (!RunAheadActive())
+      ++ppu_frame_count;
     if (check_bit(ppu_regs[ppu_irq_control], ppu_irq_vblkend)) {
       SetIRQState(ppu_intno_vblkend, true);
       set_bit(ppu_regs[ppu_irq_status], ppu_irq_vblkend);
     }
-    {
-      lock_guard<mutex> lk(do_render_m);
-      render_ready = true;
+    if (headless) {
+      PPURender();
+    } else if (run_ahead_frames > 0) {
+      // Rendered in line, as the state is about to be put back
+      RunAheadFrame ra = RunAheadFrameDone();
+      if (ra == RA_REAL) {
+        PPUPollEvents();
+      } else if (ra == RA_SHOWN && !SyncSkipFrame()) {
+        PPURender();
+        PPUFlip();
+      }
+    } else if (SyncSkipFrame()) {
+      // Vblank still happens, the frame just isn't drawn
+      PPUPollEvents();
+    } else {
+      {
+        lock_guard<mutex> lk(do_render_m);
+        render_ready = true;
+      }
+      do_render_cv.notify_one();
     }
-    do_render_cv.notify_one();
   } else {
     curr_line++;
   }
@@ -1000,6 +1064,7 @@ void PPUTick() {
     render_done = false;
   }
   CSITick(curr_line == 700);
+  sched_set(EVT_PPU_LINE, when + PPU_LINE_CYCLES);
 }
 
 void PPUDeviceResetHandler() {
@@ -1013,7 +1078,11 @@ void PPUDeviceState(SaveStater &s) {
   s.i(curr_line);
 }
 
+// Only the first 64KB of registers are memory mapped
+static const RegBitmap<0x4000> ppu_write_side = {ppu_dma_ctrl, ppu_irq_status};
+
 const Peripheral PPUPeripheral = {"PPU", InitPPUDevice, PPUDeviceReadHandler,
                                   PPUDeviceWriteHandler, PPUDeviceResetHandler,
-                                  PPUDeviceState};
+                                  PPUDeviceState, ppu_regs, 0x4000, nullptr,
+                                  ppu_write_side.bits};
 }
@@ -9,10 +9,15 @@ extern bool shutdown_flag;
 extern int savestate_flag, loadstate_flag;
 
 extern int video_scale;
+// Frames completed, not counting any run ahead
+extern uint64_t ppu_frame_count;
 
 // Must only be called once
 void InitPPUThreads();
 void ShutdownPPU();
+// Handles host input and hotkeys
+void PPUPollEvents();
+// Renders and shows the current frame straight away
+void PPUPresent();
 
-void PPUTick();
 }
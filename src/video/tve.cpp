@@ -1,6 +1,7 @@
 #include "tve.h"
 #include "../helper.h"
 #include "../sys/irq_if.h"
+#include "../sys/scheduler.h"
 #include "../system.h"
 #include <cstdio>
 using namespace std;
@@ -47,8 +48,14 @@ void TVEDeviceResetHandler() {
     r = 0;
 }
 
-void InitTVEDevice(PeripheralInitInfo initInfo) { tve_curr_line = 100; }
-void TVETick() {
+#define TVE_LINE_CYCLES 2000
+
+// Only these lines do anything, the ones between just count up
+static uint16_t tve_next_event_line(uint16_t line) {
+  return (line <= 50) ? 50 : (line <= 550) ? 550 : 800;
+}
+
+static void TVETick() {
   // simulate some kind of vblank to keep the app happy
   if (tve_curr_line == 800) {
     tve_curr_line = 0;
@@ -69,12 +76,27 @@ void TVETick() {
   }
 }
 
+static void TVELineEvent(uint64_t when) {
+  tve_curr_line = tve_next_event_line(tve_curr_line);
+  TVETick();
+  sched_set(EVT_TVE_LINE, when + TVE_LINE_CYCLES * (tve_next_event_line(tve_curr_line) - tve_curr_line + 1));
+}
+
+void InitTVEDevice(PeripheralInitInfo initInfo) {
+  tve_curr_line = 100;
+  sched_register(EVT_TVE_LINE, TVELineEvent);
+  sched_set(EVT_TVE_LINE, sched_now() + 1500 + TVE_LINE_CYCLES * (tve_next_event_line(tve_curr_line) - tve_curr_line));
+}
+
 void TVEState(SaveStater &s) {
   s.tag("TVE");
   s.a(tve_regs);
   s.i(tve_curr_line);
 }
 
+static const RegBitmap<tve_regs_size> tve_write_side = {tve_irq_status};
+
 const Peripheral TVEPeripheral = {"TVE", InitTVEDevice, TVEDeviceReadHandler,
-                                  TVEDeviceWriteHandler, TVEDeviceResetHandler, TVEState};
+                                  TVEDeviceWriteHandler, TVEDeviceResetHandler, TVEState,
+                                  tve_regs, tve_regs_size, nullptr, tve_write_side.bits};
 }
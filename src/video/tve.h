@@ -4,6 +4,4 @@
 
 namespace Emu293 {
 extern const Peripheral TVEPeripheral;
-
-void TVETick();
 }